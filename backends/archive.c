@@ -24,8 +24,9 @@
 
 #include "../pqiv.h"
 #include "../lib/filebuffer.h"
-#include <archive.h>
-#include <archive_entry.h>
+#include "../lib/archivereader.h"
+#include "../lib/archivewindow.h"
+#include "../lib/archivetoc.h"
 #include <string.h>
 
 typedef struct {
@@ -34,26 +35,47 @@ typedef struct {
 
 	// The path to the target file within the archive
 	gchar *entry_name;
-} file_loader_delegate_archive_t;
 
-static struct archive *file_type_archive_gen_archive(GBytes *data) {/*{{{*/
-	struct archive *archive = archive_read_new();
-	archive_read_support_format_zip(archive);
-	archive_read_support_format_rar(archive);
-	archive_read_support_format_7zip(archive);
-	archive_read_support_format_tar(archive);
-	archive_read_support_filter_all(archive);
+	// Where the entry's header starts within the archive, for direct access,
+	// or -1 if unknown. entry_format is the libarchive format of the archive.
+	gint64 entry_offset;
+	int entry_format;
 
-	gsize data_size;
-	char *data_ptr = (char *)g_bytes_get_data(data, &data_size);
+	// The size of the entry as listed, or -1 if the listing did not have it
+	gint64 entry_size;
 
-	if(archive_read_open_memory(archive, data_ptr, data_size) != ARCHIVE_OK) {
-		g_printerr("Failed to load archive: %s\n", archive_error_string(archive));
-		archive_read_free(archive);
-		return NULL;
+	// The position of the entry within the archive
+	guint entry_index;
+} file_loader_delegate_archive_t;
+
+static void *file_type_archive_read_entry_data(struct archive *archive, struct archive_entry *entry, size_t *entry_size) {/*{{{*/
+	// Read the current entry completely. Entries written with a trailing data
+	// descriptor might not have their size in the header, read those until
+	// their end.
+	if(archive_entry_size_is_set(entry)) {
+		*entry_size = archive_entry_size(entry);
+		void *entry_data = g_malloc(*entry_size);
+		if(archive_read_data(archive, entry_data, *entry_size) != (ssize_t)*entry_size) {
+			g_free(entry_data);
+			*entry_size = 0;
+			return NULL;
+		}
+		return entry_data;
 	}
 
-	return archive;
+	GByteArray *entry_data = g_byte_array_new();
+	guint8 block[ARCHIVE_READER_BLOCK_SIZE];
+	ssize_t block_size;
+	while((block_size = archive_read_data(archive, block, sizeof(block))) > 0) {
+		g_byte_array_append(entry_data, block, block_size);
+	}
+	if(block_size < 0) {
+		g_byte_array_free(entry_data, TRUE);
+		*entry_size = 0;
+		return NULL;
+	}
+	*entry_size = entry_data->len;
+	return g_byte_array_free(entry_data, FALSE);
 }/*}}}*/
 
 void file_type_archive_data_free(file_loader_delegate_archive_t *data) {/*{{{*/
@@ -67,51 +89,167 @@ void file_type_archive_data_free(file_loader_delegate_archive_t *data) {/*{{{*/
 GBytes *file_type_archive_data_loader(file_t *file, GError **error_pointer) {/*{{{*/
 	const file_loader_delegate_archive_t *archive_data = g_bytes_get_data(file->file_data, NULL);
 
-	GBytes *data = buffered_file_as_bytes(archive_data->source_archive, NULL, error_pointer);
-	if(!data) {
-		g_printerr("Failed to load archive %s: %s\n", file->display_name, error_pointer && *error_pointer ? (*error_pointer)->message : "Unknown error");
-		g_clear_error(error_pointer);
-		return NULL;
+	// Archives on disk are read as a stream, such that only the parts of the
+	// archive that are needed are loaded. Others, e.g. archives within
+	// archives, must be buffered in memory.
+	GInputStream *stream = NULL;
+	if(!(archive_data->source_archive->file_flags & FILE_FLAGS_MEMORY_IMAGE)) {
+		GFile *input_file = gfile_for_commandline_arg(archive_data->source_archive->file_name);
+		if(input_file) {
+			stream = G_INPUT_STREAM(g_file_read(input_file, image_loader_cancellable, NULL));
+			g_object_unref(input_file);
+		}
+		if(stream && (!G_IS_SEEKABLE(stream) || !g_seekable_can_seek(G_SEEKABLE(stream)))) {
+			g_object_unref(stream);
+			stream = NULL;
+		}
 	}
 
-	struct archive *archive = file_type_archive_gen_archive(data);
-	if(!archive) {
-		buffered_file_unref(file);
-		return NULL;
+	GBytes *data = NULL;
+	if(!stream) {
+		data = buffered_file_as_bytes(archive_data->source_archive, NULL, error_pointer);
+		if(!data) {
+			g_printerr("Failed to load archive %s: %s\n", file->display_name, error_pointer && *error_pointer ? (*error_pointer)->message : "Unknown error");
+			g_clear_error(error_pointer);
+			return NULL;
+		}
 	}
 
-	// Find the proper entry
+	// Find the proper entry, directly if its position is known
 	size_t entry_size = 0;
 	void *entry_data = NULL;
 
 	struct archive_entry *entry;
-	while(archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
-		if(archive_data->entry_name && strcmp(archive_data->entry_name, archive_entry_pathname(entry)) == 0) {
-			entry_size = archive_entry_size(entry);
-			entry_data = g_malloc(entry_size);
-
-			if(archive_read_data(archive, entry_data, entry_size) != (ssize_t)entry_size) {
-				archive_read_free(archive);
-				buffered_file_unref(file);
-				*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "The file had an unexpected size");
-				return NULL;
-			}
+	struct archive *archive = archive_data->entry_name ? archive_reader_new_at(data, stream, archive_data->entry_offset, archive_data->entry_format, archive_data->entry_name, &entry) : NULL;
+	if(archive) {
+		// Entries with a trailing data descriptor do not have their size in
+		// the local header, and stored ones can not be read this way at all.
+		// Only trust the header if it agrees with the listing. Otherwise, fall
+		// back to reading the archive from the start.
+		if(archive_entry_size_is_set(entry) && archive_data->entry_size > 0 && archive_entry_size(entry) == archive_data->entry_size) {
+			entry_data = file_type_archive_read_entry_data(archive, entry, &entry_size);
+		}
+		if(!entry_data) {
+			archive_read_free(archive);
+			archive = NULL;
+		}
+	}
 
-			break;
+	gboolean read_window = FALSE;
+	if(!archive && archive_data->entry_offset < 0 && archive_data->entry_name && archive_data->source_archive->file_name) {
+		// Solid archive; the entry might have been extracted ahead already
+		read_window = archive_window_access(archive_data->source_archive->file_name, archive_data->entry_index);
+		GBytes *window_data = archive_window_take(archive_data->source_archive->file_name, archive_data->entry_name);
+		if(window_data) {
+			gsize window_data_size;
+			entry_data = g_bytes_unref_to_data(window_data, &window_data_size);
+			entry_size = window_data_size;
 		}
 	}
 
-	archive_read_free(archive);
-	buffered_file_unref(archive_data->source_archive);
+	if(!archive && !entry_data) {
+		archive = archive_reader_new(data, stream);
+		if(archive) {
+			while(archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+				if(archive_data->entry_name && strcmp(archive_data->entry_name, archive_entry_pathname(entry)) == 0) {
+					entry_data = file_type_archive_read_entry_data(archive, entry, &entry_size);
+
+					if(!entry_data) {
+						*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "The file had an unexpected size");
+					}
+					else if(read_window) {
+						// Reading forward; extract the next entries in the same pass
+						archive_reader_fill_window(archive, archive_data->source_archive->file_name);
+					}
+
+					break;
+				}
+			}
+		}
+		else {
+			*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "Failed to open archive file");
+		}
+	}
+
+	if(archive) {
+		archive_read_free(archive);
+	}
+	if(stream) {
+		g_object_unref(stream);
+	}
+	else {
+		buffered_file_unref(archive_data->source_archive);
+	}
 	if(!entry_size) {
-		*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "The file has gone within the archive");
+		g_free(entry_data);
+		if(!*error_pointer) {
+			*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "The file has gone within the archive");
+		}
 		return NULL;
 	}
 
 	return g_bytes_new_take(entry_data, entry_size);
 }/*}}}*/
 
+static BOSNode *file_type_archive_add_entry(load_images_state_t state, file_t *file, const gchar *entry_name, gint64 entry_size, gint64 entry_offset, int entry_format, guint entry_index) {/*{{{*/
+	// Prepare a new file_t for this entry
+	gchar *sub_name = g_strdup_printf("%s#%s", file->display_name, entry_name);
+	file_t *new_file = image_loader_duplicate_file(file, g_strdup(sub_name), g_strdup(sub_name), sub_name);
+	if(new_file->file_data) {
+		g_bytes_unref(new_file->file_data);
+		new_file->file_data = NULL;
+	}
+	size_t delegate_struct_alloc_size = sizeof(file_loader_delegate_archive_t) + strlen(entry_name) + 2;
+	file_loader_delegate_archive_t *new_file_data = g_malloc(delegate_struct_alloc_size);
+	new_file_data->source_archive = image_loader_duplicate_file(file, NULL, NULL, NULL);
+	new_file_data->entry_name     = (char *)(new_file_data) + sizeof(file_loader_delegate_archive_t) + 1;
+	memcpy(new_file_data->entry_name, entry_name, strlen(entry_name) + 1);
+	new_file_data->entry_offset   = entry_offset;
+	new_file_data->entry_format   = entry_format;
+	new_file_data->entry_size     = entry_size;
+	new_file_data->entry_index    = entry_index;
+	new_file->file_data = g_bytes_new_with_free_func(new_file_data, delegate_struct_alloc_size, (GDestroyNotify)file_type_archive_data_free, new_file_data);
+	new_file->file_flags |= FILE_FLAGS_MEMORY_IMAGE;
+	new_file->file_data_loader = file_type_archive_data_loader;
+
+	// Find an appropriate handler for this file
+	GtkFileFilterInfo file_filter_info;
+	file_filter_info.contains = GTK_FILE_FILTER_FILENAME | GTK_FILE_FILTER_DISPLAY_NAME;
+	gchar *name_lowerc = g_utf8_strdown(entry_name, -1);
+	file_filter_info.filename = file_filter_info.display_name = name_lowerc;
+
+	// Check if one of the file type handlers can handle this file
+	BOSNode *node = load_images_handle_parameter_find_handler(entry_name, state, new_file, &file_filter_info);
+	if(node == NULL) {
+		// No handler found. We could fall back to using a default. Free new_file instead.
+		file_free(new_file);
+	}
+	else if(node == FALSE_POINTER) {
+		// File type is known, but loading failed; new_file has already been free()d
+		node = NULL;
+	}
+
+	g_free(name_lowerc);
+	return node;
+}/*}}}*/
 BOSNode *file_type_archive_alloc(load_images_state_t state, file_t *file) {/*{{{*/
+	BOSNode *first_node = FALSE_POINTER;
+
+	// Use the cached table of contents if possible, to avoid reading the file
+	GPtrArray *toc = archive_toc_load(file);
+	if(toc) {
+		for(guint i=0; i<toc->len; i++) {
+			archive_toc_entry_t *toc_entry = g_ptr_array_index(toc, i);
+			BOSNode *node = file_type_archive_add_entry(state, file, toc_entry->entry_name, toc_entry->entry_size, toc_entry->entry_offset, toc_entry->entry_format, i);
+			if(node && first_node == FALSE_POINTER) {
+				first_node = node;
+			}
+		}
+		g_ptr_array_unref(toc);
+		file_free(file);
+		return first_node;
+	}
+
 	GError *error_pointer = NULL;
 	GBytes *data = buffered_file_as_bytes(file, NULL, &error_pointer);
 	if(!data) {
@@ -121,20 +259,19 @@ BOSNode *file_type_archive_alloc(load_images_state_t state, file_t *file) {/*{{{
 		return FALSE_POINTER;
 	}
 
-	struct archive *archive = file_type_archive_gen_archive(data);
+	struct archive *archive = archive_reader_new(data, NULL);
 	if(!archive) {
 		buffered_file_unref(file);
 		file_free(file);
 		return FALSE_POINTER;
 	}
 
-	GtkFileFilterInfo file_filter_info;
-	file_filter_info.contains = GTK_FILE_FILTER_FILENAME | GTK_FILE_FILTER_DISPLAY_NAME;
-
-	BOSNode *first_node = FALSE_POINTER;
+	GHashTable *zip_index = NULL;
+	toc = g_ptr_array_new_with_free_func((GDestroyNotify)archive_toc_entry_free);
 
 	struct archive_entry *entry;
-	while(archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+	int status;
+	while((status = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
 		const gchar *entry_name = archive_entry_pathname(entry);
 
 		#if ARCHIVE_VERSION_NUMBER < 3003002
@@ -143,6 +280,10 @@ BOSNode *file_type_archive_alloc(load_images_state_t state, file_t *file) {/*{{{
 				const char *archive_format = archive_format_name(archive);
 				if(strncmp("ZIP", archive_format, 3) == 0) {
 					g_printerr("Failed to load archive %s: This ZIP file is affected by libarchive bug #869, which was fixed in v3.3.2. Skipping file.\n", file->display_name);
+					g_ptr_array_unref(toc);
+					if(zip_index) {
+						g_hash_table_unref(zip_index);
+					}
 					archive_read_free(archive);
 					buffered_file_unref(file);
 					file_free(file);
@@ -151,46 +292,28 @@ BOSNode *file_type_archive_alloc(load_images_state_t state, file_t *file) {/*{{{
 			}
 		#endif
 
+		int entry_format;
+		gint64 entry_offset = archive_reader_entry_offset(archive, entry, &zip_index, data, &entry_format);
+		gint64 entry_size = archive_entry_size_is_set(entry) ? archive_entry_size(entry) : -1;
+		g_ptr_array_add(toc, archive_toc_entry_new(entry_name, entry_size, entry_offset, entry_format));
 
-		// Prepare a new file_t for this entry
-		gchar *sub_name = g_strdup_printf("%s#%s", file->display_name, entry_name);
-		file_t *new_file = image_loader_duplicate_file(file, g_strdup(sub_name), g_strdup(sub_name), sub_name);
-		if(new_file->file_data) {
-			g_bytes_unref(new_file->file_data);
-			new_file->file_data = NULL;
-		}
-		size_t delegate_struct_alloc_size = sizeof(file_loader_delegate_archive_t) + strlen(entry_name) + 2;
-		file_loader_delegate_archive_t *new_file_data = g_malloc(delegate_struct_alloc_size);
-		new_file_data->source_archive = image_loader_duplicate_file(file, NULL, NULL, NULL);
-		new_file_data->entry_name     = (char *)(new_file_data) + sizeof(file_loader_delegate_archive_t) + 1;
-		memcpy(new_file_data->entry_name, entry_name, strlen(entry_name) + 1);
-		new_file->file_data = g_bytes_new_with_free_func(new_file_data, delegate_struct_alloc_size, (GDestroyNotify)file_type_archive_data_free, new_file_data);
-		new_file->file_flags |= FILE_FLAGS_MEMORY_IMAGE;
-		new_file->file_data_loader = file_type_archive_data_loader;
-
-		// Find an appropriate handler for this file
-		gchar *name_lowerc = g_utf8_strdown(entry_name, -1);
-		file_filter_info.filename = file_filter_info.display_name = name_lowerc;
-
-		// Check if one of the file type handlers can handle this file
-		BOSNode *node = load_images_handle_parameter_find_handler(entry_name, state, new_file, &file_filter_info);
-		if(node == NULL) {
-			// No handler found. We could fall back to using a default. Free new_file instead.
-			file_free(new_file);
-		}
-		else if(node == FALSE_POINTER) {
-			// File type is known, but loading failed; new_file has already been free()d
-			node = NULL;
-		}
-		else if(first_node == FALSE_POINTER) {
+		BOSNode *node = file_type_archive_add_entry(state, file, entry_name, entry_size, entry_offset, entry_format, toc->len - 1);
+		if(node && first_node == FALSE_POINTER) {
 			first_node = node;
 		}
 
-		g_free(name_lowerc);
-
 		archive_read_data_skip(archive);
 	}
 
+	// Do not remember the contents of damaged archives
+	if(status == ARCHIVE_EOF) {
+		archive_toc_store(file, toc);
+	}
+	g_ptr_array_unref(toc);
+
+	if(zip_index) {
+		g_hash_table_unref(zip_index);
+	}
 	archive_read_free(archive);
 	buffered_file_unref(file);
 	file_free(file);
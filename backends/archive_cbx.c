@@ -26,39 +26,266 @@
 
 #include "../pqiv.h"
 #include "../lib/filebuffer.h"
-#include <archive.h>
-#include <archive_entry.h>
+#include "../lib/archivereader.h"
+#include "../lib/archivewindow.h"
+#include "../lib/archivetoc.h"
 #include <string.h>
 
+// Upper bound on the number of entries decoded ahead in parallel
+#define ARCHIVE_CBX_MAX_PREFETCH_THREADS 8
+
+// Upper bound on the memory held by entries decoded ahead
+#define ARCHIVE_CBX_PREFETCH_BUDGET (256 * 1024 * 1024)
+
 typedef struct {
+	gint ref_count;
+
+	// The archive's file name, or NULL if it does not live on disk
+	gchar *file_name;
+
+	// Protects the members below
+	GMutex lock;
+	GCond cond;
+
+	// archive_toc_entry_t for all entries, in archive order
+	GPtrArray *entries;
+
+	// Entries being decoded ahead, and the resulting GdkPixbufs, by index
+	GHashTable *prefetching;
+	GHashTable *prefetched;
+	gsize prefetched_bytes;
+} file_private_data_archive_shared_t;
+
+typedef struct {
+	file_private_data_archive_shared_t *shared;
+	guint index;
+} file_type_archive_cbx_prefetch_job_t;
+
+static GThreadPool *file_type_archive_cbx_prefetch_pool = NULL;
+G_LOCK_DEFINE_STATIC(file_type_archive_cbx_prefetch_pool);
+
+typedef struct {
+	// The archive this entry belongs to
+	file_private_data_archive_shared_t *shared;
+
 	// The archive object and raw archive data
 	gchar *entry_name;
 
+	// Where the entry's header starts within the archive, for direct access,
+	// or -1 if unknown. entry_format is the libarchive format of the archive.
+	gint64 entry_offset;
+	int entry_format;
+
+	// The position of the entry within the archive
+	guint entry_index;
+
 	// The surface where the image is stored.
 	cairo_surface_t *image_surface;
 } file_private_data_archive_t;
 
-static struct archive *file_type_archive_cbx_gen_archive(GBytes *data) {/*{{{*/
-	struct archive *archive = archive_read_new();
-	archive_read_support_format_zip(archive);
-	archive_read_support_format_rar(archive);
-	archive_read_support_format_7zip(archive);
-	archive_read_support_format_tar(archive);
-	archive_read_support_filter_all(archive);
+static GdkPixbuf *file_type_archive_cbx_decode_entry(struct archive *archive, GError **error_pointer) {/*{{{*/
+	// Stream the current entry into the image decoder, block by block, such
+	// that it never needs to be in memory as a whole
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+
+	const void *block;
+	size_t block_size;
+	gint64 block_offset;
+	int status;
+	while((status = archive_read_data_block(archive, &block, &block_size, &block_offset)) == ARCHIVE_OK) {
+		if(!gdk_pixbuf_loader_write(loader, block, block_size, error_pointer)) {
+			gdk_pixbuf_loader_close(loader, NULL);
+			g_object_unref(loader);
+			return NULL;
+		}
+	}
 
-	gsize data_size;
-	char *data_ptr = (char *)g_bytes_get_data(data, &data_size);
+	if(status != ARCHIVE_EOF) {
+		gdk_pixbuf_loader_close(loader, NULL);
+		g_object_unref(loader);
+		g_set_error(error_pointer, g_quark_from_static_string("pqiv-archive-error"), 1, "Failed to extract the file: %s", archive_error_string(archive));
+		return NULL;
+	}
 
-	if(archive_read_open_memory(archive, data_ptr, data_size) != ARCHIVE_OK) {
-		g_printerr("Failed to load archive: %s\n", archive_error_string(archive));
-		archive_read_free(archive);
+	if(!gdk_pixbuf_loader_close(loader, error_pointer)) {
+		g_object_unref(loader);
 		return NULL;
 	}
 
-	return archive;
+	GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+	if(pixbuf) {
+		g_object_ref(pixbuf);
+	}
+	else {
+		g_set_error(error_pointer, g_quark_from_static_string("pqiv-archive-error"), 1, "The file could not be decoded");
+	}
+	g_object_unref(loader);
+	return pixbuf;
+}/*}}}*/
+static file_private_data_archive_shared_t *file_type_archive_cbx_shared_new(file_t *file, GPtrArray *entries) {/*{{{*/
+	file_private_data_archive_shared_t *shared = g_slice_new0(file_private_data_archive_shared_t);
+	shared->ref_count = 1;
+	if(!(file->file_flags & FILE_FLAGS_MEMORY_IMAGE)) {
+		shared->file_name = g_strdup(file->file_name);
+	}
+	g_mutex_init(&shared->lock);
+	g_cond_init(&shared->cond);
+	shared->entries = g_ptr_array_ref(entries);
+	shared->prefetching = g_hash_table_new(g_direct_hash, g_direct_equal);
+	shared->prefetched = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
+	return shared;
+}/*}}}*/
+static void file_type_archive_cbx_shared_unref(file_private_data_archive_shared_t *shared) {/*{{{*/
+	if(g_atomic_int_dec_and_test(&shared->ref_count)) {
+		g_hash_table_unref(shared->prefetched);
+		g_hash_table_unref(shared->prefetching);
+		g_ptr_array_unref(shared->entries);
+		g_cond_clear(&shared->cond);
+		g_mutex_clear(&shared->lock);
+		g_free(shared->file_name);
+		g_slice_free(file_private_data_archive_shared_t, shared);
+	}
+}/*}}}*/
+static gsize file_type_archive_cbx_pixbuf_size(GdkPixbuf *pixbuf) {/*{{{*/
+	return (gsize)gdk_pixbuf_get_rowstride(pixbuf) * (gsize)gdk_pixbuf_get_height(pixbuf);
+}/*}}}*/
+static void file_type_archive_cbx_prefetch_thread(gpointer data, gpointer user_data) {/*{{{*/
+	file_type_archive_cbx_prefetch_job_t *job = data;
+	file_private_data_archive_shared_t *shared = job->shared;
+
+	// Skip entries that have left the prefetch window while queued
+	g_mutex_lock(&shared->lock);
+	archive_toc_entry_t *toc_entry = g_hash_table_contains(shared->prefetching, GUINT_TO_POINTER(job->index)) ? g_ptr_array_index(shared->entries, job->index) : NULL;
+	g_mutex_unlock(&shared->lock);
+
+	// Each job reads the archive through a stream of its own
+	GdkPixbuf *pixbuf = NULL;
+	if(toc_entry) {
+		GFile *input_file = gfile_for_commandline_arg(shared->file_name);
+		GInputStream *stream = G_INPUT_STREAM(g_file_read(input_file, NULL, NULL));
+		g_object_unref(input_file);
+		if(stream) {
+			if(G_IS_SEEKABLE(stream) && g_seekable_can_seek(G_SEEKABLE(stream))) {
+				struct archive_entry *entry;
+				struct archive *archive = archive_reader_new_at(NULL, stream, toc_entry->entry_offset, toc_entry->entry_format, toc_entry->entry_name, &entry);
+				if(archive) {
+					pixbuf = file_type_archive_cbx_decode_entry(archive, NULL);
+					archive_read_free(archive);
+				}
+			}
+			g_object_unref(stream);
+		}
+	}
+
+	// Failures are not stored; load() will then report the error itself. Neither
+	// are entries that would exceed the memory budget, load() decodes them again.
+	g_mutex_lock(&shared->lock);
+	if(g_hash_table_remove(shared->prefetching, GUINT_TO_POINTER(job->index)) && pixbuf) {
+		gsize size = file_type_archive_cbx_pixbuf_size(pixbuf);
+		if(shared->prefetched_bytes + size <= ARCHIVE_CBX_PREFETCH_BUDGET) {
+			g_hash_table_insert(shared->prefetched, GUINT_TO_POINTER(job->index), pixbuf);
+			shared->prefetched_bytes += size;
+			pixbuf = NULL;
+		}
+	}
+	g_cond_broadcast(&shared->cond);
+	g_mutex_unlock(&shared->lock);
+
+	if(pixbuf) {
+		g_object_unref(pixbuf);
+	}
+	file_type_archive_cbx_shared_unref(shared);
+	g_slice_free(file_type_archive_cbx_prefetch_job_t, job);
+}/*}}}*/
+static GdkPixbuf *file_type_archive_cbx_prefetch(file_private_data_archive_shared_t *shared, guint index) {/*{{{*/
+	// Return an entry if it has been decoded ahead, waiting for it if that is
+	// still in progress, and start decoding the entries following it
+	G_LOCK(file_type_archive_cbx_prefetch_pool);
+	if(!file_type_archive_cbx_prefetch_pool) {
+		file_type_archive_cbx_prefetch_pool = g_thread_pool_new(file_type_archive_cbx_prefetch_thread, NULL, CLAMP((gint)g_get_num_processors(), 1, ARCHIVE_CBX_MAX_PREFETCH_THREADS), FALSE, NULL);
+	}
+	G_UNLOCK(file_type_archive_cbx_prefetch_pool);
+	guint window = (guint)g_thread_pool_get_max_threads(file_type_archive_cbx_prefetch_pool);
+
+	g_mutex_lock(&shared->lock);
+	while(g_hash_table_contains(shared->prefetching, GUINT_TO_POINTER(index))) {
+		g_cond_wait(&shared->cond, &shared->lock);
+	}
+	GdkPixbuf *pixbuf = g_hash_table_lookup(shared->prefetched, GUINT_TO_POINTER(index));
+	if(pixbuf) {
+		g_hash_table_steal(shared->prefetched, GUINT_TO_POINTER(index));
+		shared->prefetched_bytes -= file_type_archive_cbx_pixbuf_size(pixbuf);
+	}
+
+	// Forget about entries outside of the new window
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, shared->prefetched);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		if(GPOINTER_TO_UINT(key) <= index || GPOINTER_TO_UINT(key) > index + window) {
+			shared->prefetched_bytes -= file_type_archive_cbx_pixbuf_size(GDK_PIXBUF(value));
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+	g_hash_table_iter_init(&iter, shared->prefetching);
+	while(g_hash_table_iter_next(&iter, &key, NULL)) {
+		if(GPOINTER_TO_UINT(key) <= index || GPOINTER_TO_UINT(key) > index + window) {
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	// Stop decoding ahead once the budget is used up; the window refills as
+	// load() takes entries out again
+	for(guint i=index + 1; i <= index + window && i < shared->entries->len && shared->prefetched_bytes < ARCHIVE_CBX_PREFETCH_BUDGET; i++) {
+		archive_toc_entry_t *toc_entry = g_ptr_array_index(shared->entries, i);
+		if(toc_entry->entry_offset < 0 || g_hash_table_contains(shared->prefetching, GUINT_TO_POINTER(i)) || g_hash_table_contains(shared->prefetched, GUINT_TO_POINTER(i))) {
+			continue;
+		}
+
+		g_hash_table_add(shared->prefetching, GUINT_TO_POINTER(i));
+		file_type_archive_cbx_prefetch_job_t *job = g_slice_new(file_type_archive_cbx_prefetch_job_t);
+		g_atomic_int_inc(&shared->ref_count);
+		job->shared = shared;
+		job->index = i;
+		g_thread_pool_push(file_type_archive_cbx_prefetch_pool, job, NULL);
+	}
+	g_mutex_unlock(&shared->lock);
+
+	return pixbuf;
 }/*}}}*/
 
+static BOSNode *file_type_archive_cbx_add_entry(load_images_state_t state, file_t *file, file_private_data_archive_shared_t *shared, archive_toc_entry_t *toc_entry, guint entry_index) {/*{{{*/
+	file_t *new_file = image_loader_duplicate_file(file, NULL, g_strdup_printf("%s#%s", file->display_name, toc_entry->entry_name), g_strdup_printf("%s#%s", file->sort_name, toc_entry->entry_name));
+	file_private_data_archive_t *private = g_slice_new0(file_private_data_archive_t);
+	new_file->private = private;
+	g_atomic_int_inc(&shared->ref_count);
+	private->shared = shared;
+	private->entry_name = g_strdup(toc_entry->entry_name);
+	private->entry_offset = toc_entry->entry_offset;
+	private->entry_format = toc_entry->entry_format;
+	private->entry_index = entry_index;
+
+	return load_images_handle_parameter_add_file(state, new_file);
+}/*}}}*/
 BOSNode *file_type_archive_cbx_alloc(load_images_state_t state, file_t *file) {/*{{{*/
+	BOSNode *first_node = FALSE_POINTER;
+
+	// Use the cached table of contents if possible, to avoid reading the file
+	GPtrArray *toc = archive_toc_load(file);
+	if(toc) {
+		file_private_data_archive_shared_t *shared = file_type_archive_cbx_shared_new(file, toc);
+		for(guint i=0; i<toc->len; i++) {
+			BOSNode *node = file_type_archive_cbx_add_entry(state, file, shared, g_ptr_array_index(toc, i), i);
+			if(first_node == FALSE_POINTER) {
+				first_node = node;
+			}
+		}
+		file_type_archive_cbx_shared_unref(shared);
+		g_ptr_array_unref(toc);
+		file_free(file);
+		return first_node;
+	}
+
 	GError *error_pointer = NULL;
 	GBytes *data = buffered_file_as_bytes(file, NULL, &error_pointer);
 	if(!data) {
@@ -68,33 +295,50 @@ BOSNode *file_type_archive_cbx_alloc(load_images_state_t state, file_t *file) {/
 		return FALSE_POINTER;
 	}
 
-	struct archive *archive = file_type_archive_cbx_gen_archive(data);
+	struct archive *archive = archive_reader_new(data, NULL);
 	if(!archive) {
+		buffered_file_unref(file);
 		file_free(file);
 		return FALSE_POINTER;
 	}
 
-	BOSNode *first_node = FALSE_POINTER;
+	GHashTable *zip_index = NULL;
+	toc = g_ptr_array_new_with_free_func((GDestroyNotify)archive_toc_entry_free);
+	file_private_data_archive_shared_t *shared = file_type_archive_cbx_shared_new(file, toc);
 
 	struct archive_entry *entry;
-	while(archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+	int status;
+	while((status = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
 		const gchar *entry_name = archive_entry_pathname(entry);
 
-		file_t *new_file = image_loader_duplicate_file(file, NULL, g_strdup_printf("%s#%s", file->display_name, entry_name), g_strdup_printf("%s#%s", file->sort_name, entry_name));
-		new_file->private = g_slice_new0(file_private_data_archive_t);
-		((file_private_data_archive_t *)new_file->private)->entry_name = g_strdup(entry_name);
+		int entry_format;
+		gint64 entry_offset = archive_reader_entry_offset(archive, entry, &zip_index, data, &entry_format);
+		archive_toc_entry_t *toc_entry = archive_toc_entry_new(entry_name, archive_entry_size_is_set(entry) ? archive_entry_size(entry) : -1, entry_offset, entry_format);
 
+		// Entries may already be loading while the archive is being listed
+		g_mutex_lock(&shared->lock);
+		g_ptr_array_add(toc, toc_entry);
+		g_mutex_unlock(&shared->lock);
+
+		BOSNode *node = file_type_archive_cbx_add_entry(state, file, shared, toc_entry, toc->len - 1);
 		if(first_node == FALSE_POINTER) {
-			first_node = load_images_handle_parameter_add_file(state, new_file);
-		}
-		else {
-			load_images_handle_parameter_add_file(state,  new_file);
+			first_node = node;
 		}
 
 		//printf("%s %d\n", archive_entry_pathname(entry), archive_entry_size(entry));
 		archive_read_data_skip(archive);
 	}
 
+	// Do not remember the contents of damaged archives
+	if(status == ARCHIVE_EOF) {
+		archive_toc_store(file, toc);
+	}
+	file_type_archive_cbx_shared_unref(shared);
+	g_ptr_array_unref(toc);
+
+	if(zip_index) {
+		g_hash_table_unref(zip_index);
+	}
 	archive_read_free(archive);
 	buffered_file_unref(file);
 	file_free(file);
@@ -109,6 +353,11 @@ void file_type_archive_cbx_free(file_t *file) {/*{{{*/
 			private->entry_name = NULL;
 		}
 
+		if(private->shared) {
+			file_type_archive_cbx_shared_unref(private->shared);
+			private->shared = NULL;
+		}
+
 		g_slice_free(file_private_data_archive_t, file->private);
 	}
 }/*}}}*/
@@ -124,58 +373,105 @@ gboolean file_type_archive_cbx_load_destroy_old_image_callback(gpointer old_surf
 	cairo_surface_destroy((cairo_surface_t *)old_surface);
 	return FALSE;
 }/*}}}*/
-void file_type_archive_cbx_load(file_t *file, GInputStream *data_stream, GError **error_pointer) {/*{{{*/
+static GdkPixbuf *file_type_archive_cbx_extract(file_t *file, GInputStream *data_stream, GError **error_pointer) {/*{{{*/
 	file_private_data_archive_t *private = (file_private_data_archive_t *)file->private;
 
-	// Open the archive
-	GBytes *data = buffered_file_as_bytes(file, data_stream, error_pointer);
-	if(!data) {
-		return;
-	}
-
-	struct archive *archive = file_type_archive_cbx_gen_archive(data);
-	if(!archive) {
-		buffered_file_unref(file);
-		*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "Failed to open archive file");
-		return;
+	// Open the archive. Seekable streams are read directly, such that only
+	// the parts of the archive that are needed are loaded. Others must be
+	// buffered in memory.
+	GBytes *data = NULL;
+	if(!G_IS_SEEKABLE(data_stream) || !g_seekable_can_seek(G_SEEKABLE(data_stream))) {
+		data = buffered_file_as_bytes(file, data_stream, error_pointer);
+		if(!data) {
+			return NULL;
+		}
+		data_stream = NULL;
 	}
 
-	// Find the proper entry
-	size_t entry_size = 0;
-	gchar *entry_data = NULL;
+	// Find the proper entry, directly if its position is known
+	GdkPixbuf *pixbuf = NULL;
 
 	struct archive_entry *entry;
-	while(archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
-		if(private->entry_name && strcmp(private->entry_name, archive_entry_pathname(entry)) == 0) {
-			entry_size = archive_entry_size(entry);
-			entry_data = g_malloc(entry_size);
+	struct archive *archive = private->entry_name ? archive_reader_new_at(data, data_stream, private->entry_offset, private->entry_format, private->entry_name, &entry) : NULL;
+	if(archive) {
+		// E.g. stored ZIP entries with a trailing size can not be read this
+		// way. If this fails, fall back to reading the archive from the start.
+		pixbuf = file_type_archive_cbx_decode_entry(archive, NULL);
+		archive_read_free(archive);
+	}
+
+	gboolean read_window = FALSE;
+	if(!pixbuf && private->entry_offset < 0 && private->entry_name && file->file_name) {
+		// Solid archive; the entry might have been extracted ahead already
+		read_window = archive_window_access(file->file_name, private->entry_index);
+		GBytes *window_data = archive_window_take(file->file_name, private->entry_name);
+		if(window_data) {
+			gsize window_data_size;
+			const void *window_data_ptr = g_bytes_get_data(window_data, &window_data_size);
+			GInputStream *entry_data_stream = g_memory_input_stream_new_from_data(window_data_ptr, window_data_size, NULL);
+			pixbuf = gdk_pixbuf_new_from_stream(entry_data_stream, NULL, error_pointer);
+			g_object_unref(entry_data_stream);
+			g_bytes_unref(window_data);
+			if(!pixbuf) {
+				if(data) {
+					buffered_file_unref(file);
+				}
+				return NULL;
+			}
+		}
+	}
 
-			if(archive_read_data(archive, entry_data, entry_size) != (ssize_t)entry_size) {
-				archive_read_free(archive);
+	if(!pixbuf) {
+		archive = archive_reader_new(data, data_stream);
+		if(!archive) {
+			if(data) {
 				buffered_file_unref(file);
-				*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "The file had an unexpected size");
-				return;
 			}
+			*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "Failed to open archive file");
+			return NULL;
+		}
+
+		gboolean found = FALSE;
+		while(archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+			if(private->entry_name && strcmp(private->entry_name, archive_entry_pathname(entry)) == 0) {
+				found = TRUE;
+				pixbuf = file_type_archive_cbx_decode_entry(archive, error_pointer);
 
-			break;
+				if(pixbuf && read_window) {
+					// Reading forward; extract the next entries in the same pass
+					archive_reader_fill_window(archive, file->file_name);
+				}
+
+				break;
+			}
+		}
+
+		archive_read_free(archive);
+		if(!found) {
+			*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "The file has gone within the archive");
 		}
 	}
 
-	archive_read_free(archive);
-	buffered_file_unref(file);
-	if(!entry_size) {
-		*error_pointer = g_error_new(g_quark_from_static_string("pqiv-archive-error"), 1, "The file has gone within the archive");
-		return;
+	if(data) {
+		buffered_file_unref(file);
 	}
+	return pixbuf;
+}/*}}}*/
+void file_type_archive_cbx_load(file_t *file, GInputStream *data_stream, GError **error_pointer) {/*{{{*/
+	file_private_data_archive_t *private = (file_private_data_archive_t *)file->private;
 
-	// Load it as a GdkPixbuf (This could be extended to support animations)
-	GInputStream *entry_data_stream = g_memory_input_stream_new_from_data(entry_data, entry_size, g_free);
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_stream(entry_data_stream, NULL, error_pointer);
+	// Entries of random-access archives on disk are decoded ahead in parallel,
+	// unless the user asked to keep memory usage low
+	GdkPixbuf *pixbuf = NULL;
+	if(!option_lowmem && private->shared->file_name && private->entry_offset >= 0) {
+		pixbuf = file_type_archive_cbx_prefetch(private->shared, private->entry_index);
+	}
 	if(!pixbuf) {
-		g_object_unref(entry_data_stream);
-		return;
+		pixbuf = file_type_archive_cbx_extract(file, data_stream, error_pointer);
+		if(!pixbuf) {
+			return;
+		}
 	}
-	g_object_unref(entry_data_stream);
 
 	GdkPixbuf *new_pixbuf = gdk_pixbuf_apply_embedded_orientation(pixbuf);
 	g_object_unref(pixbuf);
@@ -20,8 +20,32 @@
 
 #include "../pqiv.h"
 #include <math.h>
+#include <string.h>
 
 /* Default (GdkPixbuf) file type implementation {{{ */
+
+// Upper bound for the memory used to keep the converted frames of one animation
+#define ANIMATION_FRAME_CACHE_BUDGET (64 * 1024 * 1024)
+
+typedef struct {
+	cairo_surface_t *surface;
+	guint64 hash;
+	int delay;
+} gdkpixbuf_animation_frame_t;
+
+typedef enum {
+	// Frames are converted once and stored
+	ANIMATION_FRAME_CACHE_RECORDING,
+	// The first frame reappeared; check that the others follow as recorded,
+	// and that the first one follows them again
+	ANIMATION_FRAME_CACHE_VERIFYING,
+	// A whole loop matched, play from the cache. gdk-pixbuf is only asked
+	// whether the animation has ended.
+	ANIMATION_FRAME_CACHE_REPLAYING,
+	// Over budget or ended; convert into image_surface as frames come
+	ANIMATION_FRAME_CACHE_DISABLED
+} gdkpixbuf_animation_frame_cache_state_t;
+
 typedef struct {
 	// The surface where the image is stored. Only non-NULL for
 	// the current, previous and next image.
@@ -42,6 +66,19 @@ G_GNUC_BEGIN_IGNORE_DEPRECATIONS
 #if GLIB_CHECK_VERSION(2, 62, 0)
 G_GNUC_END_IGNORE_DEPRECATIONS
 #endif
+
+	// Converted animation frames, in playback order, and the state of
+	// the cache. current_frame is drawn instead of image_surface if set.
+	GArray *animation_frames;
+	gsize animation_frames_size;
+	guint animation_frame_index;
+	gdkpixbuf_animation_frame_cache_state_t animation_frame_cache_state;
+	cairo_surface_t *current_frame;
+
+	// Copy of the last frame's pixels, to find the region that changed
+	guchar *previous_pixels;
+	gsize previous_pixels_size;
+	gboolean previous_pixels_valid;
 } file_private_data_gdkpixbuf_t;
 
 BOSNode *file_type_gdkpixbuf_alloc(load_images_state_t state, file_t *file) {/*{{{*/
@@ -51,6 +88,18 @@ BOSNode *file_type_gdkpixbuf_alloc(load_images_state_t state, file_t *file) {/*{
 void file_type_gdkpixbuf_free(file_t *file) {/*{{{*/
 	g_slice_free(file_private_data_gdkpixbuf_t, file->private);
 }/*}}}*/
+static void file_type_gdkpixbuf_animation_frame_cache_clear(file_private_data_gdkpixbuf_t *private) {/*{{{*/
+	if(private->animation_frames) {
+		for(guint i = 0; i < private->animation_frames->len; i++) {
+			cairo_surface_destroy(g_array_index(private->animation_frames, gdkpixbuf_animation_frame_t, i).surface);
+		}
+		g_array_free(private->animation_frames, TRUE);
+		private->animation_frames = NULL;
+	}
+	private->animation_frames_size = 0;
+	private->animation_frame_index = 0;
+	private->current_frame = NULL;
+}/*}}}*/
 void file_type_gdkpixbuf_unload(file_t *file) {/*{{{*/
 	file_private_data_gdkpixbuf_t *private = file->private;
 	if(private->pixbuf_animation != NULL) {
@@ -65,19 +114,152 @@ void file_type_gdkpixbuf_unload(file_t *file) {/*{{{*/
 		g_object_unref(private->animation_iter);
 		private->animation_iter = NULL;
 	}
+	file_type_gdkpixbuf_animation_frame_cache_clear(private);
+	private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_RECORDING;
+	if(private->previous_pixels != NULL) {
+		g_free(private->previous_pixels);
+		private->previous_pixels = NULL;
+		private->previous_pixels_size = 0;
+		private->previous_pixels_valid = FALSE;
+	}
+}/*}}}*/
+static gboolean file_type_gdkpixbuf_animation_frame_compare(file_private_data_gdkpixbuf_t *private, GdkPixbuf *pixbuf, guint64 *hash, cairo_rectangle_int_t *damage) {/*{{{*/
+	// Hash the frame's pixels, and find the rectangle that differs from the
+	// previous frame. Returns FALSE if the frame did not change at all.
+	// Afterwards, previous_pixels holds this frame.
+	int width = gdk_pixbuf_get_width(pixbuf);
+	int height = gdk_pixbuf_get_height(pixbuf);
+	int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+	gsize row_length = (gsize)width * n_channels;
+	gsize size = (gsize)rowstride * (height - 1) + row_length;
+	const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+
+	if(private->previous_pixels_size != size) {
+		g_free(private->previous_pixels);
+		private->previous_pixels = g_malloc(size);
+		private->previous_pixels_size = size;
+		private->previous_pixels_valid = FALSE;
+	}
+
+	// FNV-1a, on the pixel data only, since padding is undefined
+	guint64 frame_hash = 14695981039346656037ULL;
+	int min_x = width, max_x = -1, min_y = height, max_y = -1;
+	for(int y = 0; y < height; y++) {
+		const guchar *row = pixels + (gsize)y * rowstride;
+		guchar *previous_row = private->previous_pixels + (gsize)y * rowstride;
+		for(gsize i = 0; i < row_length; i++) {
+			frame_hash = (frame_hash ^ row[i]) * 1099511628211ULL;
+		}
+
+		if(private->previous_pixels_valid && memcmp(row, previous_row, row_length) == 0) {
+			continue;
+		}
+		min_y = MIN(min_y, y);
+		max_y = y;
+		if(!private->previous_pixels_valid) {
+			min_x = 0;
+			max_x = width - 1;
+		}
+		else {
+			int x0 = 0;
+			while(memcmp(row + x0 * n_channels, previous_row + x0 * n_channels, n_channels) == 0) {
+				x0++;
+			}
+			int x1 = width - 1;
+			while(memcmp(row + x1 * n_channels, previous_row + x1 * n_channels, n_channels) == 0) {
+				x1--;
+			}
+			min_x = MIN(min_x, x0);
+			max_x = MAX(max_x, x1);
+		}
+		memcpy(previous_row, row, row_length);
+	}
+	private->previous_pixels_valid = TRUE;
+
+	*hash = frame_hash;
+	damage->x = min_x;
+	damage->y = min_y;
+	damage->width = max_x - min_x + 1;
+	damage->height = max_y - min_y + 1;
+	return max_y >= 0;
+}/*}}}*/
+static void file_type_gdkpixbuf_animation_paint_damage(cairo_surface_t *surface, GdkPixbuf *pixbuf, cairo_rectangle_int_t *damage) {/*{{{*/
+	// Convert only the part of the frame that changed
+	GdkPixbuf *damaged_pixbuf = gdk_pixbuf_new_subpixbuf(pixbuf, damage->x, damage->y, damage->width, damage->height);
+	cairo_t *sf_cr = cairo_create(surface);
+	cairo_rectangle(sf_cr, damage->x, damage->y, damage->width, damage->height);
+	cairo_clip(sf_cr);
+	cairo_set_operator(sf_cr, CAIRO_OPERATOR_SOURCE);
+	gdk_cairo_set_source_pixbuf(sf_cr, damaged_pixbuf, damage->x, damage->y);
+	cairo_paint(sf_cr);
+	cairo_destroy(sf_cr);
+	g_object_unref(damaged_pixbuf);
+}/*}}}*/
+static gboolean file_type_gdkpixbuf_animation_frame_cache_add(file_t *file, GdkPixbuf *pixbuf, guint64 hash, gboolean changed, cairo_rectangle_int_t *damage, int delay) {/*{{{*/
+	// Store a new frame, derived from the last one. Returns FALSE if the
+	// cache is over budget.
+	file_private_data_gdkpixbuf_t *private = (file_private_data_gdkpixbuf_t *)file->private;
+
+	gsize frame_size = (gsize)cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, file->width) * file->height;
+	if(private->animation_frames_size + frame_size > ANIMATION_FRAME_CACHE_BUDGET) {
+		return FALSE;
+	}
+
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, file->width, file->height);
+	if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		return FALSE;
+	}
+	if(private->current_frame) {
+		cairo_t *sf_cr = cairo_create(surface);
+		cairo_set_source_surface(sf_cr, private->current_frame, 0, 0);
+		cairo_set_operator(sf_cr, CAIRO_OPERATOR_SOURCE);
+		cairo_paint(sf_cr);
+		cairo_destroy(sf_cr);
+	}
+	if(changed) {
+		file_type_gdkpixbuf_animation_paint_damage(surface, pixbuf, damage);
+	}
+
+	if(!private->animation_frames) {
+		private->animation_frames = g_array_new(FALSE, FALSE, sizeof(gdkpixbuf_animation_frame_t));
+	}
+	gdkpixbuf_animation_frame_t frame = { surface, hash, delay };
+	g_array_append_val(private->animation_frames, frame);
+	private->animation_frames_size += frame_size;
+	private->animation_frame_index = private->animation_frames->len - 1;
+	private->current_frame = surface;
+	return TRUE;
 }/*}}}*/
 double file_type_gdkpixbuf_animation_initialize(file_t *file) {/*{{{*/
 	file_private_data_gdkpixbuf_t *private = file->private;
 	if(private->animation_iter == NULL) {
 		private->animation_iter = gdk_pixbuf_animation_get_iter(private->pixbuf_animation, &private->animation_time);
+
+		// Record the first frame
+		file_type_gdkpixbuf_animation_frame_cache_clear(private);
+		private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_RECORDING;
+		private->previous_pixels_valid = FALSE;
+
+		GdkPixbuf *pixbuf = gdk_pixbuf_animation_iter_get_pixbuf(private->animation_iter);
+		int delay = gdk_pixbuf_animation_iter_get_delay_time(private->animation_iter);
+		guint64 hash;
+		cairo_rectangle_int_t damage;
+		gboolean changed = file_type_gdkpixbuf_animation_frame_compare(private, pixbuf, &hash, &damage);
+		if(!file_type_gdkpixbuf_animation_frame_cache_add(file, pixbuf, hash, changed, &damage, delay)) {
+			private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_DISABLED;
+			private->previous_pixels_valid = FALSE;
+		}
+	}
+	if(private->animation_frame_cache_state == ANIMATION_FRAME_CACHE_REPLAYING) {
+		return g_array_index(private->animation_frames, gdkpixbuf_animation_frame_t, private->animation_frame_index).delay;
 	}
 	return gdk_pixbuf_animation_iter_get_delay_time(private->animation_iter);
 }/*}}}*/
 double file_type_gdkpixbuf_animation_next_frame(file_t *file) {/*{{{*/
 	file_private_data_gdkpixbuf_t *private = (file_private_data_gdkpixbuf_t *)file->private;
 
-	cairo_surface_t *surface = cairo_surface_reference(private->image_surface);
-
 	// We keep track of time manually to allow the user to adjust the playback speed:
 	// It is assumed that this function is called exactly at the right time, each time.
 	// TODO The downside from this is that animations won't play smoothly on slow X11 connections.
@@ -91,22 +273,92 @@ double file_type_gdkpixbuf_animation_next_frame(file_t *file) {/*{{{*/
 		}
 	}
 
+	// The iterator is advanced even while replaying, which is cheap as long as
+	// its pixbuf is not requested, to learn when the animation ends
 	gdk_pixbuf_animation_iter_advance(private->animation_iter, &private->animation_time);
+	int delay = gdk_pixbuf_animation_iter_get_delay_time(private->animation_iter);
+
+	if(private->animation_frame_cache_state == ANIMATION_FRAME_CACHE_REPLAYING) {
+		if(delay >= 0) {
+			private->animation_frame_index = (private->animation_frame_index + 1) % private->animation_frames->len;
+			gdkpixbuf_animation_frame_t *frame = &g_array_index(private->animation_frames, gdkpixbuf_animation_frame_t, private->animation_frame_index);
+			private->current_frame = frame->surface;
+			return frame->delay;
+		}
+
+		// All loops have been played; show the final frame as gdk-pixbuf has it
+		private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_DISABLED;
+	}
+
 	GdkPixbuf *pixbuf = gdk_pixbuf_animation_iter_get_pixbuf(private->animation_iter);
 
-	cairo_t *sf_cr = cairo_create(surface);
-	cairo_save(sf_cr);
-	cairo_set_source_rgba(sf_cr, 0., 0., 0., 0.);
-	cairo_set_operator(sf_cr, CAIRO_OPERATOR_SOURCE);
-	cairo_paint(sf_cr);
-	cairo_restore(sf_cr);
-	gdk_cairo_set_source_pixbuf(sf_cr, pixbuf, 0, 0);
-	cairo_paint(sf_cr);
-	cairo_destroy(sf_cr);
+	guint64 hash;
+	cairo_rectangle_int_t damage;
+	gboolean changed = file_type_gdkpixbuf_animation_frame_compare(private, pixbuf, &hash, &damage);
 
-	cairo_surface_destroy(surface);
+	if(private->animation_frame_cache_state == ANIMATION_FRAME_CACHE_VERIFYING) {
+		// A whole loop has been seen once the first frame follows the last
+		// recorded one again
+		guint index = private->animation_frame_index + 1;
+		gboolean loop_complete = index == private->animation_frames->len;
+		gdkpixbuf_animation_frame_t *frame = &g_array_index(private->animation_frames, gdkpixbuf_animation_frame_t, loop_complete ? 0 : index);
+		if(delay >= 0 && frame->hash == hash && frame->delay == delay) {
+			private->animation_frame_index = loop_complete ? 0 : index;
+			private->current_frame = frame->surface;
+			if(loop_complete) {
+				private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_REPLAYING;
+			}
+			return delay;
+		}
 
-	return gdk_pixbuf_animation_iter_get_delay_time(private->animation_iter);
+		// Not a loop after all, e.g. if parts of the animation repeat. The
+		// frames since the supposed start of the loop are part of the
+		// recording; they share the surfaces of the frames they matched.
+		for(guint i = 0; i <= private->animation_frame_index; i++) {
+			gdkpixbuf_animation_frame_t repeated_frame = g_array_index(private->animation_frames, gdkpixbuf_animation_frame_t, i);
+			cairo_surface_reference(repeated_frame.surface);
+			g_array_append_val(private->animation_frames, repeated_frame);
+		}
+		private->animation_frame_index = private->animation_frames->len - 1;
+		private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_RECORDING;
+		if(file_type_gdkpixbuf_animation_frame_cache_add(file, pixbuf, hash, changed, &damage, delay)) {
+			return delay;
+		}
+		private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_DISABLED;
+	}
+	else if(private->animation_frame_cache_state == ANIMATION_FRAME_CACHE_RECORDING && delay >= 0) {
+		gdkpixbuf_animation_frame_t *first_frame = &g_array_index(private->animation_frames, gdkpixbuf_animation_frame_t, 0);
+		if(private->animation_frames->len > 1 && first_frame->hash == hash && first_frame->delay == delay) {
+			// The animation seems to start over
+			private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_VERIFYING;
+			private->animation_frame_index = 0;
+			private->current_frame = first_frame->surface;
+			return delay;
+		}
+		if(file_type_gdkpixbuf_animation_frame_cache_add(file, pixbuf, hash, changed, &damage, delay)) {
+			return delay;
+		}
+		private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_DISABLED;
+	}
+	else {
+		// Animations that end are not cached beyond their end
+		private->animation_frame_cache_state = ANIMATION_FRAME_CACHE_DISABLED;
+	}
+
+	if(private->current_frame) {
+		// Switching to uncached playback. image_surface has not been kept
+		// up to date, so convert the whole frame once.
+		file_type_gdkpixbuf_animation_frame_cache_clear(private);
+		damage.x = damage.y = 0;
+		damage.width = gdk_pixbuf_get_width(pixbuf);
+		damage.height = gdk_pixbuf_get_height(pixbuf);
+		changed = TRUE;
+	}
+	if(changed) {
+		file_type_gdkpixbuf_animation_paint_damage(private->image_surface, pixbuf, &damage);
+	}
+
+	return delay;
 }/*}}}*/
 gboolean file_type_gdkpixbuf_load_destroy_old_image_callback(gpointer old_surface) {/*{{{*/
 	cairo_surface_destroy((cairo_surface_t *)old_surface);
@@ -260,7 +512,7 @@ void file_type_gdkpixbuf_load(file_t *file, GInputStream *data, GError **error_p
 void file_type_gdkpixbuf_draw(file_t *file, cairo_t *cr) {/*{{{*/
 	file_private_data_gdkpixbuf_t *private = (file_private_data_gdkpixbuf_t *)file->private;
 
-	cairo_surface_t *current_image_surface = private->image_surface;
+	cairo_surface_t *current_image_surface = private->current_frame ? private->current_frame : private->image_surface;
 	cairo_set_source_surface(cr, current_image_surface, 0, 0);
 	apply_interpolation_quality(cr);
 	cairo_paint(cr);
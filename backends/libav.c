@@ -62,6 +62,27 @@ static const char * const ignore_extensions[] = {
 	"w64", "wav", "xa", "xwma", NULL
 };
 
+// Number of decoded frames the decoder thread may run ahead of playback
+#define LIBAV_DECODE_AHEAD_FRAMES 4
+// Delay to use if playback catches up with the decoder
+#define LIBAV_DECODER_RETRY_DELAY FILE_TYPE_ANIMATION_RETRY_DELAY
+// Bounds for the size of the buffer used to read memory images
+#define LIBAV_AVIO_MIN_BUFFER_SIZE 4096
+#define LIBAV_AVIO_MAX_BUFFER_SIZE (256 * 1024)
+// Timestamp differences above this many milliseconds are considered
+// discontinuities, not frame durations
+#define LIBAV_MAX_FRAME_DURATION 10000
+
+typedef struct {
+	AVFrame *frame;
+	double delay;
+} libav_decoded_frame_t;
+
+typedef struct {
+	int64_t pts;
+	int64_t pos;
+} libav_keyframe_t;
+
 typedef struct {
 	GBytes *file_data;
 	gsize file_data_pos;
@@ -71,16 +92,52 @@ typedef struct {
 	AVCodecContext *cocontext;
 	int video_stream_id;
 
-	gboolean pkt_valid;
-	AVPacket pkt;
-
+	// Currently displayed frame
 	AVFrame *frame;
+	double frame_delay;
+	guint frame_serial;
+
+	// RGB32 version of the current frame, at the size it was last drawn at
+	struct SwsContext *sws_context;
 	AVFrame *rgb_frame;
 	uint8_t *buffer;
+	size_t buffer_size;
+	guint rgb_frame_serial;
+	int rgb_frame_width;
+	int rgb_frame_height;
 
 	guint pixel_width;
 	guint pixel_height;
 	AVRational sample_aspect_ratio;
+
+	// Decoding happens in a separate thread, which reads ahead into
+	// decoded_frames. decoder_cond signals changes to the queue.
+	GThread *decoder_thread;
+	GMutex decoder_lock;
+	GCond decoder_cond;
+	GQueue decoded_frames;
+	gboolean decoder_stop;
+	gboolean decoder_finished;
+
+	// The decoder thread holds back the latest frame until the next one is
+	// known, since a frame's duration is the difference of their timestamps
+	AVFrame *decoder_pending_frame;
+	int64_t decoder_pending_pts;
+	double decoder_pending_delay;
+
+	// Seeks are handed to the decoder thread. It then decodes forward from the
+	// preceding keyframe, dropping frames before decoder_skip_until_pts.
+	// seek_frame_pending is set until the first frame at the new position
+	// replaces the current one.
+	gboolean decoder_seek_pending;
+	int64_t decoder_seek_target;
+	int64_t decoder_skip_until_pts;
+	gboolean seek_frame_pending;
+
+	// Keyframes of the video stream, sorted by timestamp. Taken from the
+	// container's index, and completed from the packets read during playback.
+	// Only accessed by the decoder thread once it is running.
+	GArray *keyframe_index;
 } file_private_data_libav_t;
 
 static int file_type_libav_memory_access_reader(void *opaque, uint8_t *buf, int buf_size) {/*{{{*/
@@ -93,72 +150,393 @@ static int file_type_libav_memory_access_reader(void *opaque, uint8_t *buf, int
 		return -1;
 	}
 
+	if(private->file_data_pos >= data_size) {
+		return AVERROR_EOF;
+	}
+
 	if((unsigned)buf_size > data_size - private->file_data_pos) {
 		buf_size = data_size - private->file_data_pos;
 	}
 
-	if(private->file_data_pos < data_size) {
-		memcpy(buf, (const char*)data + private->file_data_pos, buf_size);
-		private->file_data_pos += buf_size;
-	}
+	memcpy(buf, (const char*)data + private->file_data_pos, buf_size);
+	private->file_data_pos += buf_size;
 
 	return buf_size;
 }/*}}}*/
 
 static int64_t file_type_libav_memory_access_seeker(void *opaque, int64_t offset, int whence) {/*{{{*/
 	file_private_data_libav_t *private = opaque;
-	whence &= (SEEK_CUR | SEEK_SET | SEEK_END);
 
 	gsize data_size = 0;
 	g_bytes_get_data(private->file_data, &data_size);
 
-	switch(whence) {
+	// Knowing the size allows libav to seek within the data instead of
+	// reading through it
+	if(whence & AVSEEK_SIZE) {
+		return data_size;
+	}
+
+	int64_t new_pos;
+	switch(whence & (SEEK_CUR | SEEK_SET | SEEK_END)) {
 		case SEEK_CUR:
-			if(0 <= (ssize_t)private->file_data_pos + offset && private->file_data_pos + offset < data_size) {
-				private->file_data_pos += offset;
-			}
-			return 0;
+			new_pos = (int64_t)private->file_data_pos + offset;
 			break;
 
 		case SEEK_SET:
-			if(offset >= 0 && offset < (ssize_t)data_size) {
-				private->file_data_pos = offset;
-			}
-			return 0;
+			new_pos = offset;
 			break;
 
 		case SEEK_END:
-			if(offset <= 0) {
-				private->file_data_pos = data_size + offset;
-			}
+			new_pos = (int64_t)data_size + offset;
 			break;
+
+		default:
+			return -1;
+	}
+
+	if(new_pos < 0 || new_pos > (int64_t)data_size) {
+		return -1;
+	}
+	private->file_data_pos = new_pos;
+	return new_pos;
+}/*}}}*/
+
+static double file_type_libav_packet_delay(file_private_data_libav_t *private, AVPacket *pkt) {/*{{{*/
+	if(private->avcontext->streams[private->video_stream_id]->avg_frame_rate.den != 0 && private->avcontext->streams[private->video_stream_id]->avg_frame_rate.num != 0) {
+		// Stream has reliable average framerate
+		return 1000. * private->avcontext->streams[private->video_stream_id]->avg_frame_rate.den / private->avcontext->streams[private->video_stream_id]->avg_frame_rate.num;
+	}
+	else if(private->avcontext->streams[private->video_stream_id]->time_base.den != 0 && private->avcontext->streams[private->video_stream_id]->time_base.num != 0) {
+		// Stream has usable time base
+		return pkt->duration * private->avcontext->streams[private->video_stream_id]->time_base.num * 1000. / private->avcontext->streams[private->video_stream_id]->time_base.den;
+	}
+
+	// TODO What could be done here as a last fallback?! -> Figure this out from ffmpeg!
+	return 10;
+}/*}}}*/
+static int64_t file_type_libav_frame_pts(AVFrame *frame) {/*{{{*/
+#ifdef AV_COMPAT_CODEC_DEPRECATED
+	return frame->best_effort_timestamp;
+#else
+	return frame->pkt_pts;
+#endif
+}/*}}}*/
+static void file_type_libav_keyframe_index_add(file_private_data_libav_t *private, int64_t pts, int64_t pos) {/*{{{*/
+	if(pts == AV_NOPTS_VALUE) {
+		return;
+	}
+
+	// Keyframes are mostly found in order, so look from the end
+	guint i = private->keyframe_index->len;
+	while(i > 0 && g_array_index(private->keyframe_index, libav_keyframe_t, i - 1).pts > pts) {
+		i--;
+	}
+	if(i > 0 && g_array_index(private->keyframe_index, libav_keyframe_t, i - 1).pts == pts) {
+		return;
+	}
+	libav_keyframe_t keyframe = { pts, pos };
+	g_array_insert_val(private->keyframe_index, i, keyframe);
+}/*}}}*/
+static const libav_keyframe_t *file_type_libav_keyframe_index_lookup(file_private_data_libav_t *private, int64_t pts) {/*{{{*/
+	// Find the last keyframe at or before pts
+	guint low = 0;
+	guint high = private->keyframe_index->len;
+	while(low < high) {
+		guint mid = (low + high) / 2;
+		if(g_array_index(private->keyframe_index, libav_keyframe_t, mid).pts <= pts) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return low > 0 ? &g_array_index(private->keyframe_index, libav_keyframe_t, low - 1) : NULL;
+}/*}}}*/
+static void file_type_libav_keyframe_index_build(file_private_data_libav_t *private) {/*{{{*/
+	// Start with whatever index the container has
+	private->keyframe_index = g_array_new(FALSE, FALSE, sizeof(libav_keyframe_t));
+	AVStream *stream = private->avcontext->streams[private->video_stream_id];
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+	int count = avformat_index_get_entries_count(stream);
+	for(int i = 0; i < count; i++) {
+		const AVIndexEntry *entry = avformat_index_get_entry(stream, i);
+#else
+	int count = stream->nb_index_entries;
+	for(int i = 0; i < count; i++) {
+		const AVIndexEntry *entry = &(stream->index_entries[i]);
+#endif
+		if(entry->flags & AVINDEX_KEYFRAME) {
+			file_type_libav_keyframe_index_add(private, entry->timestamp, entry->pos);
+		}
+	}
+}/*}}}*/
+static void file_type_libav_decoder_seek(file_private_data_libav_t *private, int64_t target) {/*{{{*/
+	// Jump to the last keyframe before target. Like ffplay, prefer byte
+	// positions for formats whose timestamps may be discontinuous.
+	const libav_keyframe_t *keyframe = file_type_libav_keyframe_index_lookup(private, target);
+	int status = -1;
+	if(keyframe && keyframe->pos >= 0 && (private->avcontext->iformat->flags & AVFMT_TS_DISCONT) && strcmp(private->avcontext->iformat->name, "ogg") != 0) {
+		status = av_seek_frame(private->avcontext, private->video_stream_id, keyframe->pos, AVSEEK_FLAG_BYTE);
+	}
+	if(status < 0) {
+		status = av_seek_frame(private->avcontext, private->video_stream_id, keyframe ? keyframe->pts : target, AVSEEK_FLAG_BACKWARD);
+	}
+	if(status < 0) {
+		return;
+	}
+
+	avcodec_flush_buffers(private->cocontext);
+	if(private->decoder_pending_frame) {
+		av_frame_free(&(private->decoder_pending_frame));
+	}
+	private->decoder_skip_until_pts = target;
+}/*}}}*/
+static gboolean file_type_libav_decoder_push_frame(file_private_data_libav_t *private, AVFrame *frame, double delay) {/*{{{*/
+	// Queue a decoded frame, waiting for room if the queue is full. Returns
+	// FALSE if the decoder has been asked to stop.
+	g_mutex_lock(&private->decoder_lock);
+	while(!private->decoder_stop && g_queue_get_length(&private->decoded_frames) >= LIBAV_DECODE_AHEAD_FRAMES) {
+		g_cond_wait(&private->decoder_cond, &private->decoder_lock);
+	}
+	gboolean stop = private->decoder_stop;
+	gboolean drop = private->decoder_seek_pending;
+	if(!stop && !drop) {
+		libav_decoded_frame_t *entry = g_slice_new(libav_decoded_frame_t);
+		entry->frame = frame;
+		entry->delay = delay;
+		g_queue_push_tail(&private->decoded_frames, entry);
+		g_cond_broadcast(&private->decoder_cond);
+	}
+	g_mutex_unlock(&private->decoder_lock);
+
+	// Frames decoded before a pending seek are obsolete
+	if(stop || drop) {
+		av_frame_free(&frame);
+	}
+	return !stop;
+}/*}}}*/
+static gboolean file_type_libav_decoder_flush_pending_frame(file_private_data_libav_t *private) {/*{{{*/
+	// Queue the held back frame with its estimated duration, for use at
+	// the end of the stream
+	if(!private->decoder_pending_frame) {
+		return TRUE;
+	}
+	AVFrame *frame = private->decoder_pending_frame;
+	private->decoder_pending_frame = NULL;
+	return file_type_libav_decoder_push_frame(private, frame, private->decoder_pending_delay);
+}/*}}}*/
+static gboolean file_type_libav_decoder_queue_frame(file_private_data_libav_t *private, AVFrame *frame, double fallback_delay) {/*{{{*/
+	// Queue the previous frame, with its duration taken from the
+	// presentation timestamps if possible, and hold back this one
+	int64_t pts = file_type_libav_frame_pts(frame);
+
+	if(private->decoder_skip_until_pts != AV_NOPTS_VALUE) {
+		if(pts != AV_NOPTS_VALUE && pts < private->decoder_skip_until_pts) {
+			av_frame_free(&frame);
+			return TRUE;
+		}
+		private->decoder_skip_until_pts = AV_NOPTS_VALUE;
+	}
+
+	if(private->decoder_pending_frame && pts != AV_NOPTS_VALUE && private->decoder_pending_pts != AV_NOPTS_VALUE && pts > private->decoder_pending_pts) {
+		double duration = 1000. * (pts - private->decoder_pending_pts) * av_q2d(private->avcontext->streams[private->video_stream_id]->time_base);
+		if(duration > 0 && duration < LIBAV_MAX_FRAME_DURATION) {
+			private->decoder_pending_delay = duration;
+		}
+	}
+	if(!file_type_libav_decoder_flush_pending_frame(private)) {
+		av_frame_free(&frame);
+		return FALSE;
 	}
 
-	return -1;
+	private->decoder_pending_frame = frame;
+	private->decoder_pending_pts = pts;
+	private->decoder_pending_delay = fallback_delay;
+	return TRUE;
+}/*}}}*/
+#ifdef AV_COMPAT_CODEC_DEPRECATED
+static gboolean file_type_libav_decoder_receive_frames(file_private_data_libav_t *private, double delay) {/*{{{*/
+	// With frame threading, a packet may yield no frame or several
+	while(TRUE) {
+		AVFrame *frame = av_frame_alloc();
+		if(avcodec_receive_frame(private->cocontext, frame) < 0) {
+			av_frame_free(&frame);
+			return TRUE;
+		}
+		if(!file_type_libav_decoder_queue_frame(private, frame, delay)) {
+			return FALSE;
+		}
+	}
+}/*}}}*/
+#endif
+static gpointer file_type_libav_decoder_thread(gpointer user_data) {/*{{{*/
+	file_private_data_libav_t *private = (file_private_data_libav_t *)user_data;
+
+	double delay = 10;
+	gboolean keep_going = TRUE;
+	gboolean read_since_seek = FALSE;
+
+	while(keep_going) {
+		g_mutex_lock(&private->decoder_lock);
+		keep_going = !private->decoder_stop;
+		gboolean seek = private->decoder_seek_pending;
+		int64_t seek_target = private->decoder_seek_target;
+		private->decoder_seek_pending = FALSE;
+		g_mutex_unlock(&private->decoder_lock);
+		if(!keep_going) {
+			break;
+		}
+		if(seek) {
+			file_type_libav_decoder_seek(private, seek_target);
+		}
+
+		AVPacket pkt;
+		memset(&pkt, 0, sizeof(AVPacket));
+		if(av_read_frame(private->avcontext, &pkt) < 0) {
+			av_packet_unref(&pkt);
+
+#ifdef AV_COMPAT_CODEC_DEPRECATED
+			// Retrieve the frames the decoder still holds back
+			if(avcodec_send_packet(private->cocontext, NULL) >= 0) {
+				keep_going = file_type_libav_decoder_receive_frames(private, delay);
+			}
+			avcodec_flush_buffers(private->cocontext);
+#endif
+			if(keep_going) {
+				// Timestamps start over after looping
+				keep_going = file_type_libav_decoder_flush_pending_frame(private);
+			}
+			private->decoder_skip_until_pts = AV_NOPTS_VALUE;
+
+			// Loop the video. If the stream cannot be read even after
+			// seeking back, end it here; the last frame stays visible.
+			if(!read_since_seek || avformat_seek_file(private->avcontext, -1, 0, 0, 1, 0) < 0) {
+				break;
+			}
+			read_since_seek = FALSE;
+			continue;
+		}
+		read_since_seek = TRUE;
+
+		if(pkt.stream_index != private->video_stream_id) {
+			av_packet_unref(&pkt);
+			continue;
+		}
+		if(pkt.flags & AV_PKT_FLAG_KEY) {
+			file_type_libav_keyframe_index_add(private, pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts, pkt.pos);
+		}
+
+		delay = file_type_libav_packet_delay(private, &pkt);
+#ifndef AV_COMPAT_CODEC_DEPRECATED
+		AVFrame *frame = av_frame_alloc();
+		int got_picture_ptr = 0;
+		avcodec_decode_video2(private->cocontext, frame, &got_picture_ptr, &pkt);
+		if(got_picture_ptr) {
+			keep_going = file_type_libav_decoder_queue_frame(private, frame, delay);
+		}
+		else {
+			av_frame_free(&frame);
+		}
+#else
+		if(avcodec_send_packet(private->cocontext, &pkt) >= 0) {
+			keep_going = file_type_libav_decoder_receive_frames(private, delay);
+		}
+#endif
+		av_packet_unref(&pkt);
+	}
+
+	if(keep_going) {
+		file_type_libav_decoder_flush_pending_frame(private);
+	}
+	else if(private->decoder_pending_frame) {
+		av_frame_free(&(private->decoder_pending_frame));
+	}
+
+	g_mutex_lock(&private->decoder_lock);
+	private->decoder_finished = TRUE;
+	g_cond_broadcast(&private->decoder_cond);
+	g_mutex_unlock(&private->decoder_lock);
+
+	return NULL;
+}/*}}}*/
+static gboolean file_type_libav_decoder_pop_frame(file_private_data_libav_t *private, gboolean wait) {/*{{{*/
+	// Make the oldest decoded frame the current one. Returns FALSE if there
+	// is none, after waiting for the decoder if wait is set.
+	g_mutex_lock(&private->decoder_lock);
+	while(wait && g_queue_is_empty(&private->decoded_frames) && !private->decoder_finished) {
+		g_cond_wait(&private->decoder_cond, &private->decoder_lock);
+	}
+	libav_decoded_frame_t *entry = g_queue_pop_head(&private->decoded_frames);
+	if(entry) {
+		g_cond_broadcast(&private->decoder_cond);
+	}
+	g_mutex_unlock(&private->decoder_lock);
+
+	if(!entry) {
+		return FALSE;
+	}
+	if(private->frame) {
+		av_frame_free(&(private->frame));
+	}
+	private->frame = entry->frame;
+	private->frame_delay = entry->delay;
+	private->frame_serial++;
+	private->seek_frame_pending = FALSE;
+	g_slice_free(libav_decoded_frame_t, entry);
+	return TRUE;
+}/*}}}*/
+static void file_type_libav_decoder_stop(file_private_data_libav_t *private) {/*{{{*/
+	if(private->decoder_thread) {
+		g_mutex_lock(&private->decoder_lock);
+		private->decoder_stop = TRUE;
+		g_cond_broadcast(&private->decoder_cond);
+		g_mutex_unlock(&private->decoder_lock);
+		g_thread_join(private->decoder_thread);
+		private->decoder_thread = NULL;
+	}
+
+	libav_decoded_frame_t *entry;
+	while((entry = g_queue_pop_head(&private->decoded_frames)) != NULL) {
+		av_frame_free(&(entry->frame));
+		g_slice_free(libav_decoded_frame_t, entry);
+	}
+	private->decoder_stop = FALSE;
+	private->decoder_finished = FALSE;
+	private->decoder_seek_pending = FALSE;
+	private->seek_frame_pending = FALSE;
+
+	if(private->keyframe_index) {
+		g_array_free(private->keyframe_index, TRUE);
+		private->keyframe_index = NULL;
+	}
 }/*}}}*/
 
 BOSNode *file_type_libav_alloc(load_images_state_t state, file_t *file) {/*{{{*/
-	file->private = g_slice_new0(file_private_data_libav_t);
+	file_private_data_libav_t *private = g_slice_new0(file_private_data_libav_t);
+	g_mutex_init(&private->decoder_lock);
+	g_cond_init(&private->decoder_cond);
+	file->private = private;
 	return load_images_handle_parameter_add_file(state, file);
 }/*}}}*/
 void file_type_libav_free(file_t *file) {/*{{{*/
+	file_private_data_libav_t *private = (file_private_data_libav_t *)file->private;
+	g_mutex_clear(&private->decoder_lock);
+	g_cond_clear(&private->decoder_cond);
 	g_slice_free(file_private_data_libav_t, file->private);
 }/*}}}*/
 void file_type_libav_unload(file_t *file) {/*{{{*/
 	file_private_data_libav_t *private = (file_private_data_libav_t *)file->private;
 
+	// The decoder thread uses the contexts freed below
+	file_type_libav_decoder_stop(private);
+
 	if(private->file_data) {
-		g_bytes_unref(private->file_data);
+		// The reference is owned by the file buffer
 		buffered_file_unref(file);
 		private->file_data = NULL;
 		private->file_data_pos = 0;
 	}
 
-	if(private->pkt_valid) {
-		av_packet_unref(&(private->pkt));
-		private->pkt_valid = FALSE;
-	}
-
 	if(private->frame) {
 		av_frame_free(&(private->frame));
 	}
@@ -185,7 +563,14 @@ void file_type_libav_unload(file_t *file) {/*{{{*/
 	if(private->buffer) {
 		g_free(private->buffer);
 		private->buffer = NULL;
+		private->buffer_size = 0;
 	}
+
+	if(private->sws_context) {
+		sws_freeContext(private->sws_context);
+		private->sws_context = NULL;
+	}
+	private->rgb_frame_serial = 0;
 }/*}}}*/
 void file_type_libav_load(file_t *file, GInputStream *data, GError **error_pointer) {/*{{{*/
 	file_private_data_libav_t *private = (file_private_data_libav_t *)file->private;
@@ -201,10 +586,21 @@ void file_type_libav_load(file_t *file, GInputStream *data, GError **error_point
 		if(!private->file_data) {
 			private->file_data = buffered_file_as_bytes(file, data, error_pointer);
 		}
+		if(!private->file_data) {
+			return;
+		}
 		private->file_data_pos = 0;
 
+		// The data is in memory already. Use a buffer large enough that few
+		// reads are needed, and have large reads bypass it, such that data is
+		// copied straight from the mapping into libav's packets.
+		gsize data_size = 0;
+		g_bytes_get_data(private->file_data, &data_size);
+		int buffer_size = CLAMP(data_size, LIBAV_AVIO_MIN_BUFFER_SIZE, LIBAV_AVIO_MAX_BUFFER_SIZE);
+
 		private->avcontext = avformat_alloc_context();
-		private->aviocontext = avio_alloc_context(av_malloc(4096), 4096, 0, private, &file_type_libav_memory_access_reader, NULL, &file_type_libav_memory_access_seeker);
+		private->aviocontext = avio_alloc_context(av_malloc(buffer_size), buffer_size, 0, private, &file_type_libav_memory_access_reader, NULL, &file_type_libav_memory_access_seeker);
+		private->aviocontext->direct = 1;
 		private->avcontext->pb = private->aviocontext;
 		if(avformat_open_input(&(private->avcontext), NULL, NULL, NULL) < 0) {
 			*error_pointer = g_error_new(g_quark_from_static_string("pqiv-libav-error"), 1, "Failed to load image using libav.");
@@ -259,13 +655,15 @@ void file_type_libav_load(file_t *file, GInputStream *data, GError **error_point
 #else
 	avcodec_parameters_to_context(private->cocontext, private->avcontext->streams[private->video_stream_id]->codecpar);
 #endif
+	// Have the codec decode several frames, or slices, in parallel
+	private->cocontext->thread_count = 0;
+	private->cocontext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 	if(!codec || avcodec_open2(private->cocontext, codec, NULL) < 0) {
 		*error_pointer = g_error_new(g_quark_from_static_string("pqiv-libav-error"), 1, "Failed to open codec.");
 		avformat_close_input(&(private->avcontext));
 		return;
 	}
 
-	private->frame = av_frame_alloc();
 	private->rgb_frame = av_frame_alloc();
 
 	file->file_flags |= FILE_FLAGS_ANIMATION;
@@ -292,18 +690,20 @@ void file_type_libav_load(file_t *file, GInputStream *data, GError **error_point
 		file->height = private->sample_aspect_ratio.den * private->pixel_height / private->sample_aspect_ratio.num;
 	}
 
-#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(55, 0, 0)
-	size_t num_bytes = avpicture_get_size(PIX_FMT_RGB32, file->width, file->height);
-#else
-	size_t num_bytes = av_image_get_buffer_size(AV_PIX_FMT_RGB32, file->width, file->height, 64);
-#endif
-	private->buffer = (uint8_t *)g_malloc(num_bytes * sizeof(uint8_t));
-
 	if(file->width == 0 || file->height == 0) {
 		file_type_libav_unload(file);
 		file->is_loaded = FALSE;
 		return;
 	}
+
+	// Start decoding, and wait for the first frame such that there is
+	// something to display right away
+	private->frame_delay = -1;
+	private->decoder_skip_until_pts = AV_NOPTS_VALUE;
+	file_type_libav_keyframe_index_build(private);
+	private->decoder_thread = g_thread_new("libav-decoder", file_type_libav_decoder_thread, private);
+	file_type_libav_decoder_pop_frame(private, TRUE);
+
 	file->is_loaded = TRUE;
 }/*}}}*/
 double file_type_libav_animation_next_frame(file_t *file) {/*{{{*/
@@ -313,61 +713,110 @@ double file_type_libav_animation_next_frame(file_t *file) {/*{{{*/
 		return -1;
 	}
 
-	AVPacket old_pkt = private->pkt;
+	if(file_type_libav_decoder_pop_frame(private, FALSE)) {
+		return private->frame_delay;
+	}
 
-	do {
-		// Loop until the next video frame is found
-		memset(&(private->pkt), 0, sizeof(AVPacket));
-		if(av_read_frame(private->avcontext, &(private->pkt)) < 0) {
-			av_packet_unref(&(private->pkt));
-			if(avformat_seek_file(private->avcontext, -1, 0, 0, 1, 0) < 0 || av_read_frame(private->avcontext, &(private->pkt)) < 0) {
-				// Reading failed; end stream here to be on the safe side
-				// Display last frame to the user
-				private->pkt = old_pkt;
-				return -1;
-			}
-		}
-	} while(private->pkt.stream_index != private->video_stream_id);
+	g_mutex_lock(&private->decoder_lock);
+	gboolean is_finished = private->decoder_finished && g_queue_is_empty(&private->decoded_frames);
+	g_mutex_unlock(&private->decoder_lock);
+	if(is_finished) {
+		// End of stream; display the last frame to the user
+		return -1;
+	}
+
+	// The decoder has fallen behind; show the current frame a bit longer
+	return LIBAV_DECODER_RETRY_DELAY;
+}/*}}}*/
+double file_type_libav_animation_seek(file_t *file, double position, animation_seek_mode_t mode) {/*{{{*/
+	file_private_data_libav_t *private = (file_private_data_libav_t *)file->private;
+
+	if(!private->avcontext || !private->decoder_thread) {
+		return -1;
+	}
 
-	if(private->pkt_valid) {
-		av_packet_unref(&old_pkt);
+	AVStream *stream = private->avcontext->streams[private->video_stream_id];
+	double time_base = av_q2d(stream->time_base);
+	if(time_base <= 0) {
+		return -1;
 	}
-	else {
-		private->pkt_valid = TRUE;
+	int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+	int64_t duration = stream->duration;
+	if(duration == AV_NOPTS_VALUE && private->avcontext->duration != AV_NOPTS_VALUE) {
+		duration = av_rescale_q(private->avcontext->duration, AV_TIME_BASE_Q, stream->time_base);
 	}
 
-	AVFrame *frame = private->frame;
-#ifndef AV_COMPAT_CODEC_DEPRECATED
-	int got_picture_ptr = 0;
-	avcodec_decode_video2(private->cocontext, frame, &got_picture_ptr, &(private->pkt));
-#else
-	if(avcodec_send_packet(private->cocontext, &(private->pkt)) >= 0) {
-		avcodec_receive_frame(private->cocontext, frame);
+	int64_t target;
+	if(mode == ANIMATION_SEEK_RELATIVE_SECONDS) {
+		// Repeated seeks add up, even if the previous one has not finished yet
+		int64_t current = private->frame ? file_type_libav_frame_pts(private->frame) : AV_NOPTS_VALUE;
+		if(private->seek_frame_pending) {
+			current = private->decoder_seek_target;
+		}
+		target = (current != AV_NOPTS_VALUE ? current : start) + position / time_base;
+	}
+	else {
+		if(duration == AV_NOPTS_VALUE || duration <= 0) {
+			return -1;
+		}
+		target = start + position * duration;
+	}
+	if(target < start) {
+		target = start;
+	}
+	if(duration != AV_NOPTS_VALUE && duration > 0 && target >= start + duration) {
+		target = start + duration - 1;
 	}
-#endif
 
-	if(private->avcontext->streams[private->video_stream_id]->avg_frame_rate.den != 0 && private->avcontext->streams[private->video_stream_id]->avg_frame_rate.num != 0) {
-		// Stream has reliable average framerate
-		return 1000. * private->avcontext->streams[private->video_stream_id]->avg_frame_rate.den / private->avcontext->streams[private->video_stream_id]->avg_frame_rate.num;
+	// Discard what has been decoded ahead. The decoder thread seeks in the
+	// background; the current frame stays until the first one at the new
+	// position is available to file_type_libav_animation_next_frame.
+	g_mutex_lock(&private->decoder_lock);
+	if(private->decoder_finished) {
+		g_mutex_unlock(&private->decoder_lock);
+		return -1;
 	}
-	else if(private->avcontext->streams[private->video_stream_id]->time_base.den != 0 && private->avcontext->streams[private->video_stream_id]->time_base.num != 0) {
-		// Stream has usable time base
-		return private->pkt.duration * private->avcontext->streams[private->video_stream_id]->time_base.num * 1000. / private->avcontext->streams[private->video_stream_id]->time_base.den;
+	libav_decoded_frame_t *entry;
+	while((entry = g_queue_pop_head(&private->decoded_frames)) != NULL) {
+		av_frame_free(&(entry->frame));
+		g_slice_free(libav_decoded_frame_t, entry);
 	}
+	private->decoder_seek_pending = TRUE;
+	private->decoder_seek_target = target;
+	g_cond_broadcast(&private->decoder_cond);
+	g_mutex_unlock(&private->decoder_lock);
+	private->seek_frame_pending = TRUE;
 
-	// TODO What could be done here as a last fallback?! -> Figure this out from ffmpeg!
-	return 10;
+	return LIBAV_DECODER_RETRY_DELAY;
 }/*}}}*/
 double file_type_libav_animation_initialize(file_t *file) {/*{{{*/
-	return file_type_libav_animation_next_frame(file);
+	file_private_data_libav_t *private = (file_private_data_libav_t *)file->private;
+
+	// The first frame has been decoded while loading
+	return private->frame_delay;
 }/*}}}*/
 void file_type_libav_draw(file_t *file, cairo_t *cr) {/*{{{*/
 	file_private_data_libav_t *private = (file_private_data_libav_t *)file->private;
 
-	if(private->pkt_valid) {
-		AVFrame *frame = private->frame;
-		AVFrame *rgb_frame = private->rgb_frame;
+	if(!private->frame || !private->frame->data[0]) {
+		return;
+	}
+	AVFrame *frame = private->frame;
+	AVFrame *rgb_frame = private->rgb_frame;
+
+	// If the frame is drawn downscaled and not rotated, let swscale do the
+	// scaling along with the color conversion, directly to the size the
+	// frame will have on the target
+	int target_width = file->width;
+	int target_height = file->height;
+	cairo_matrix_t matrix;
+	cairo_get_matrix(cr, &matrix);
+	if(ABS(matrix.xy) < 1e-6 && ABS(matrix.yx) < 1e-6 && matrix.xx > 0 && matrix.xx < 1 && matrix.yy > 0 && matrix.yy < 1) {
+		target_width = MAX(1, file->width * matrix.xx + .5);
+		target_height = MAX(1, file->height * matrix.yy + .5);
+	}
 
+	if(private->rgb_frame_serial != private->frame_serial || private->rgb_frame_width != target_width || private->rgb_frame_height != target_height) {
 #ifdef AV_COMPAT_CODEC_DEPRECATED
 		int pix_fmt = private->avcontext->streams[private->video_stream_id]->codecpar->format;
 #else
@@ -396,45 +845,58 @@ void file_type_libav_draw(file_t *file, cairo_t *cr) {/*{{{*/
 				break;
 		}
 
+		// The context is only recreated if the parameters change
+		private->sws_context = sws_getCachedContext(private->sws_context, private->pixel_width, private->pixel_height, pix_fmt, target_width,
+				target_height, AV_PIX_FMT_RGB32, SWS_BICUBIC, NULL, NULL, NULL);
+		if(!private->sws_context) {
+			return;
+		}
+
+		if(color_space_needs_patching) {
+			// Following https://stackoverflow.com/questions/23067722
+			// Needed to use YUV for YUVJ
+			int dummy[4];
+			int src_range, dst_range;
+			int brightness, contrast, saturation;
+			sws_getColorspaceDetails(private->sws_context, (int**)&dummy, &src_range, (int**)&dummy, &dst_range, &brightness, &contrast, &saturation);
+			const int* coefs = sws_getCoefficients(SWS_CS_DEFAULT);
+			src_range = 1;
+			sws_setColorspaceDetails(private->sws_context, coefs, src_range, coefs, dst_range,
+					brightness, contrast, saturation);
+		}
+
 		// Prepare buffer for RGB32 version
-		uint8_t *buffer = private->buffer;
 #if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(55, 0, 0)
-		avpicture_fill((AVPicture *)rgb_frame, buffer, PIX_FMT_RGB32, file->width, file->height);
+		size_t num_bytes = avpicture_get_size(PIX_FMT_RGB32, target_width, target_height);
 #else
-		av_image_fill_arrays(rgb_frame->data, rgb_frame->linesize, buffer, AV_PIX_FMT_RGB32, file->width, file->height, 16);
+		size_t num_bytes = av_image_get_buffer_size(AV_PIX_FMT_RGB32, target_width, target_height, 16);
 #endif
-
-		// If a valid frame is available..
-		if(frame->data[0]) {
-			// ..convert to RGB32
-			struct SwsContext *img_convert_ctx = sws_getCachedContext(NULL, private->pixel_width, private->pixel_height, pix_fmt, file->width,
-					file->height, AV_PIX_FMT_RGB32, SWS_BICUBIC, NULL, NULL, NULL);
-
-			if(color_space_needs_patching) {
-				// Following https://stackoverflow.com/questions/23067722
-				// Needed to use YUV for YUVJ
-				int dummy[4];
-				int src_range, dst_range;
-				int brightness, contrast, saturation;
-				sws_getColorspaceDetails(img_convert_ctx, (int**)&dummy, &src_range, (int**)&dummy, &dst_range, &brightness, &contrast, &saturation);
-				const int* coefs = sws_getCoefficients(SWS_CS_DEFAULT);
-				src_range = 1;
-				sws_setColorspaceDetails(img_convert_ctx, coefs, src_range, coefs, dst_range,
-						brightness, contrast, saturation);
-			}
-
-
-			sws_scale(img_convert_ctx, (const uint8_t * const*)frame->data, frame->linesize, 0, private->pixel_height, rgb_frame->data, rgb_frame->linesize);
-			sws_freeContext(img_convert_ctx);
+		if(num_bytes > private->buffer_size) {
+			g_free(private->buffer);
+			private->buffer = (uint8_t *)g_malloc(num_bytes * sizeof(uint8_t));
+			private->buffer_size = num_bytes;
 		}
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(55, 0, 0)
+		avpicture_fill((AVPicture *)rgb_frame, private->buffer, PIX_FMT_RGB32, target_width, target_height);
+#else
+		av_image_fill_arrays(rgb_frame->data, rgb_frame->linesize, private->buffer, AV_PIX_FMT_RGB32, target_width, target_height, 16);
+#endif
 
-		// Draw to a temporary image surface and then to cr
-		cairo_surface_t *image_surface = cairo_image_surface_create_for_data(rgb_frame->data[0], CAIRO_FORMAT_ARGB32, file->width, file->height, rgb_frame->linesize[0]);
-		cairo_set_source_surface(cr, image_surface, 0, 0);
-		apply_interpolation_quality(cr);
-		cairo_paint(cr);
-		cairo_surface_destroy(image_surface);
+		sws_scale(private->sws_context, (const uint8_t * const*)frame->data, frame->linesize, 0, private->pixel_height, rgb_frame->data, rgb_frame->linesize);
+		private->rgb_frame_serial = private->frame_serial;
+		private->rgb_frame_width = target_width;
+		private->rgb_frame_height = target_height;
 	}
+
+	// Draw to a temporary image surface and then to cr
+	cairo_surface_t *image_surface = cairo_image_surface_create_for_data(rgb_frame->data[0], CAIRO_FORMAT_ARGB32, target_width, target_height, rgb_frame->linesize[0]);
+	cairo_save(cr);
+	cairo_scale(cr, (double)file->width / target_width, (double)file->height / target_height);
+	cairo_set_source_surface(cr, image_surface, 0, 0);
+	apply_interpolation_quality(cr);
+	cairo_paint(cr);
+	cairo_restore(cr);
+	cairo_surface_destroy(image_surface);
 }/*}}}*/
 static gboolean _is_ignored_extension(const char *extension) {/*{{{*/
 	for(const char * const * ext = ignore_extensions; *ext; ext++) {
@@ -498,5 +960,6 @@ void file_type_libav_initializer(file_type_handler_t *info) {/*{{{*/
 	info->unload_fn                =  file_type_libav_unload;
 	info->animation_initialize_fn  =  file_type_libav_animation_initialize;
 	info->animation_next_frame_fn  =  file_type_libav_animation_next_frame;
+	info->animation_seek_fn        =  file_type_libav_animation_seek;
 	info->draw_fn                  =  file_type_libav_draw;
 }/*}}}*/
@@ -21,18 +21,88 @@
 #include "../pqiv.h"
 #include "../lib/filebuffer.h"
 #include <poppler.h>
+#include <math.h>
 
+// Renders covering more device pixels than this are split into tiles, which
+// are rendered in parallel
+#define POPPLER_TILED_RENDER_MIN_AREA (1024 * 1024)
+#define POPPLER_TILE_SIZE 512
+#define POPPLER_MAX_RENDER_THREADS 8
+
+// The parsed document, shared by all pages of a PDF
 typedef struct {
-	// The page to be displayed
+	gint ref_count;
+
+	// Protects the fields below, and serializes rendering, since poppler
+	// does not support concurrent access to one document
+	GMutex lock;
 	PopplerDocument *document;
+	guint document_users;
+
+	// Incremented whenever a page is reloaded, e.g. because the file changed.
+	// Pages loaded from an older generation keep their own reference to the
+	// document they were loaded from.
+	guint generation;
+
+	// A copy of the file's contents, which the document is parsed from. It
+	// is read rather than mapped, since the file might be truncated while it
+	// is in use. Additional instances for the tile renderers are parsed from
+	// this in the background; render_documents holds the idle ones, and
+	// renderers wait on render_documents_cond for one to become idle.
+	GBytes *render_data;
+	GSList *render_documents;
+	GCond render_documents_cond;
+	guint render_documents_count;
+	guint render_documents_pending;
+} file_private_data_poppler_document_t;
+
+// A tiled render in progress
+typedef struct {
+	file_private_data_poppler_document_t *document;
+	guint generation;
+	guint page_number;
+	cairo_matrix_t matrix;
+
+	GMutex lock;
+	GCond cond;
+	guint pending_tiles;
+} file_type_poppler_tiled_render_t;
+
+typedef struct {
+	// NULL for jobs that only parse a new instance of document
+	file_type_poppler_tiled_render_t *render;
+	file_private_data_poppler_document_t *document;
+	GBytes *document_data;
+
+	int x, y, width, height;
+	cairo_surface_t *surface;
+} file_type_poppler_tile_t;
+
+static GThreadPool *file_type_poppler_tile_pool = NULL;
+G_LOCK_DEFINE_STATIC(file_type_poppler_tile_pool);
+
+typedef struct {
+	// The page to be displayed
+	file_private_data_poppler_document_t *document;
 	PopplerPage *page;
+	guint generation;
 
 	// The page number, for loading
 	guint page_number;
 } file_private_data_poppler_t;
 
-BOSNode *file_type_poppler_alloc(load_images_state_t state, file_t *file) {/*{{{*/
-	// We have to load the file now to get the number of pages
+static void file_type_poppler_document_unref(file_private_data_poppler_document_t *document) {/*{{{*/
+	if(g_atomic_int_dec_and_test(&document->ref_count)) {
+		g_cond_clear(&document->render_documents_cond);
+		g_mutex_clear(&document->lock);
+		g_slice_free(file_private_data_poppler_document_t, document);
+	}
+}/*}}}*/
+
+static GList *file_type_poppler_expand(file_t *file, gpointer user_data) {/*{{{*/
+	// Open the document to get the number of pages, and create one file_t for
+	// each page after the first
+	file_private_data_poppler_document_t *document = user_data;
 	GError *error_pointer = NULL;
 
 	#if POPPLER_CHECK_VERSION(22, 2, 0)
@@ -43,7 +113,6 @@ BOSNode *file_type_poppler_alloc(load_images_state_t state, file_t *file) {/*{{{
 		GInputStream *data = image_loader_stream_file(file, NULL);
 		if(!data) {
 			g_printerr("Failed to load PDF %s: Error while reading file\n", file->display_name);
-			file_free(file);
 			return NULL;
 		}
 		PopplerDocument *poppler_document = poppler_document_new_from_stream(data, -1, NULL, NULL, &error_pointer);
@@ -52,40 +121,35 @@ BOSNode *file_type_poppler_alloc(load_images_state_t state, file_t *file) {/*{{{
 		if(!data_bytes || error_pointer) {
 			g_printerr("Failed to load PDF %s: %s\n", file->display_name, error_pointer->message);
 			g_clear_error(&error_pointer);
-			file_free(file);
-			return FALSE_POINTER;
+			return NULL;
 		}
 		gsize data_size;
 		char *data_ptr = (char *)g_bytes_get_data(data_bytes, &data_size);
 		PopplerDocument *poppler_document = poppler_document_new_from_data(data_ptr, (int)data_size, NULL, &error_pointer);
 	#endif
 
-	BOSNode *first_node = NULL;
+	GList *files = NULL;
 
 	if(poppler_document) {
 		int n_pages = poppler_document_get_n_pages(poppler_document);
 		g_object_unref(poppler_document);
 
-		for(int n=0; n<n_pages; n++) {
+		for(int n=n_pages - 1; n>0; n--) {
 			file_t *new_file = image_loader_duplicate_file(file,
 					NULL,
-					n == 0 ? NULL :  g_strdup_printf("%s[%d]", file->display_name, n + 1),
+					g_strdup_printf("%s[%d]", file->display_name, n + 1),
 					g_strdup_printf("%s[%d]", file->sort_name, n + 1));
 			new_file->private = g_slice_new0(file_private_data_poppler_t);
 			((file_private_data_poppler_t *)new_file->private)->page_number = n;
+			((file_private_data_poppler_t *)new_file->private)->document = document;
+			g_atomic_int_inc(&document->ref_count);
 
-			if(n == 0) {
-				first_node = load_images_handle_parameter_add_file(state, new_file);
-			}
-			else {
-				load_images_handle_parameter_add_file(state,  new_file);
-			}
+			files = g_list_prepend(files, new_file);
 		}
 	}
 	else if(error_pointer) {
 		g_printerr("Failed to load PDF %s: %s\n", file->display_name, error_pointer->message);
 		g_clear_error(&error_pointer);
-		first_node = FALSE_POINTER;
 	}
 
 	#if POPPLER_CHECK_VERSION(22, 2, 0)
@@ -94,69 +158,312 @@ BOSNode *file_type_poppler_alloc(load_images_state_t state, file_t *file) {/*{{{
 		buffered_file_unref(file);
 	#endif
 
+	return files;
+}/*}}}*/
+BOSNode *file_type_poppler_alloc(load_images_state_t state, file_t *file) {/*{{{*/
+	// Only the first page is added right away. The document is opened in the
+	// background to add the others, see file_type_poppler_expand().
+	file_private_data_poppler_document_t *document = g_slice_new0(file_private_data_poppler_document_t);
+	g_mutex_init(&document->lock);
+	g_cond_init(&document->render_documents_cond);
+	document->ref_count = 2;
+
+	file_t *new_file = image_loader_duplicate_file(file, NULL, NULL, g_strdup_printf("%s[1]", file->sort_name));
+	new_file->private = g_slice_new0(file_private_data_poppler_t);
+	((file_private_data_poppler_t *)new_file->private)->document = document;
+
+	BOSNode *first_node = load_images_handle_parameter_add_document(state, new_file, file, file_type_poppler_expand, document, (GDestroyNotify)file_type_poppler_document_unref);
+
 	if(first_node) {
 		file_free(file);
 	}
 	return first_node;
 }/*}}}*/
 void file_type_poppler_free(file_t *file) {/*{{{*/
+	file_private_data_poppler_t *private = file->private;
+	file_type_poppler_document_unref(private->document);
 	g_slice_free(file_private_data_poppler_t, file->private);
 }/*}}}*/
+static PopplerDocument *file_type_poppler_document_new(GBytes *data, GError **error_pointer) {/*{{{*/
+	#if POPPLER_CHECK_VERSION(0, 82, 0)
+		return poppler_document_new_from_bytes(data, NULL, error_pointer);
+	#else
+		gsize data_size;
+		char *data_ptr = (char *)g_bytes_get_data(data, &data_size);
+		return poppler_document_new_from_data(data_ptr, (int)data_size, NULL, error_pointer);
+	#endif
+}/*}}}*/
+static void file_type_poppler_document_clear(file_private_data_poppler_document_t *document) {/*{{{*/
+	// Drop the parsed document; must be called with the lock held
+	g_object_unref(document->document);
+	document->document = NULL;
+	document->document_users = 0;
+
+	// Instances still being parsed are discarded once done
+	g_slist_free_full(document->render_documents, g_object_unref);
+	document->render_documents = NULL;
+	document->render_documents_count = 0;
+	g_bytes_unref(document->render_data);
+	document->render_data = NULL;
+
+	// Pages still loaded keep their own reference to the old document
+	document->generation++;
+	g_cond_broadcast(&document->render_documents_cond);
+}/*}}}*/
+static void file_type_poppler_document_release(file_private_data_poppler_t *private) {/*{{{*/
+	// Drop one page's use of the document; must be called with the lock held
+	file_private_data_poppler_document_t *document = private->document;
+	if(private->generation == document->generation && --document->document_users == 0) {
+		file_type_poppler_document_clear(document);
+	}
+}/*}}}*/
 void file_type_poppler_load(file_t *file, GInputStream *data, GError **error_pointer) {/*{{{*/
 	if(error_pointer) {
 		*error_pointer = NULL;
 	}
 	file_private_data_poppler_t *private = file->private;
+	file_private_data_poppler_document_t *document = private->document;
 
-	// We need to load the data into memory, because poppler has problems with serving from streams; see above
-	#if POPPLER_CHECK_VERSION(22, 2, 0)
-		PopplerDocument *document = poppler_document_new_from_stream(data, -1, NULL, image_loader_cancellable, error_pointer);
-	#else
-		GBytes *data_bytes = buffered_file_as_bytes(file, data, error_pointer);
+	g_mutex_lock(&document->lock);
+
+	// The document is only parsed once, and then shared by all loaded pages.
+	// It is parsed from memory, since the tile renderers need the data in
+	// memory anyway, see file_type_poppler_draw_tiled().
+	if(!document->document) {
+		GBytes *data_bytes = g_input_stream_read_completely(data, image_loader_cancellable, error_pointer);
 		if(!data_bytes || (error_pointer && *error_pointer)) {
+			if(data_bytes) {
+				g_bytes_unref(data_bytes);
+			}
+			g_mutex_unlock(&document->lock);
 			return;
 		}
-		gsize data_size;
-		char *data_ptr = (char *)g_bytes_get_data(data_bytes, &data_size);
-		PopplerDocument *document = poppler_document_new_from_data(data_ptr, (int)data_size, NULL, error_pointer);
-	#endif
-
-	if(document) {
-		PopplerPage *page = poppler_document_get_page(document, private->page_number);
-
-		if(page) {
-			double width, height;
-			poppler_page_get_size(page, &width, &height);
-
-			file->width = width;
-			file->height = height;
-			file->is_loaded = TRUE;
-			private->page = page;
-			private->document = document;
+		document->document = file_type_poppler_document_new(data_bytes, error_pointer);
+		if(!document->document) {
+			g_bytes_unref(data_bytes);
+			g_mutex_unlock(&document->lock);
 			return;
 		}
+		document->render_data = data_bytes;
+	}
+	document->document_users++;
+	private->generation = document->generation;
 
-		g_object_unref(document);
+	PopplerPage *page = poppler_document_get_page(document->document, private->page_number);
+	if(page) {
+		double width, height;
+		poppler_page_get_size(page, &width, &height);
+
+		file->width = width;
+		file->height = height;
+		file->is_loaded = TRUE;
+		private->page = page;
+	}
+	else {
+		file_type_poppler_document_release(private);
 	}
 
-	#if !POPPLER_CHECK_VERSION(22, 2, 0)
-		buffered_file_unref(file);
-	#endif
+	g_mutex_unlock(&document->lock);
 }/*}}}*/
 void file_type_poppler_unload(file_t *file) {/*{{{*/
 	file_private_data_poppler_t *private = file->private;
+	file_private_data_poppler_document_t *document = private->document;
 	if(private->page) {
+		g_mutex_lock(&document->lock);
 		g_object_unref(private->page);
 		private->page = NULL;
+		file_type_poppler_document_release(private);
+
+		// If the file is reloaded, e.g. because it changed, the next page to
+		// load parses it again. Other pages keep using the old document until
+		// they are reloaded as well.
+		if(file->force_reload && document->document && private->generation == document->generation) {
+			file_type_poppler_document_clear(document);
+		}
+		g_mutex_unlock(&document->lock);
 	}
-	if(private->document) {
-		g_object_unref(private->document);
-		private->document = NULL;
+}/*}}}*/
+static void file_type_poppler_prepare_document(file_type_poppler_tile_t *job) {/*{{{*/
+	// Parse an instance of the document for the tile renderers
+	file_private_data_poppler_document_t *document = job->document;
+	PopplerDocument *poppler_document = file_type_poppler_document_new(job->document_data, NULL);
 
-		#if !POPPLER_CHECK_VERSION(22, 2, 0)
-			buffered_file_unref(file);
-		#endif
+	g_mutex_lock(&document->lock);
+	document->render_documents_pending--;
+	if(poppler_document && document->render_data == job->document_data) {
+		document->render_documents = g_slist_prepend(document->render_documents, poppler_document);
+		document->render_documents_count++;
+		g_cond_signal(&document->render_documents_cond);
+		poppler_document = NULL;
 	}
+	g_mutex_unlock(&document->lock);
+
+	if(poppler_document) {
+		// The document has been unloaded in the meantime
+		g_object_unref(poppler_document);
+	}
+	g_bytes_unref(job->document_data);
+	file_type_poppler_document_unref(document);
+	g_slice_free(file_type_poppler_tile_t, job);
+}/*}}}*/
+static void file_type_poppler_render_tile(gpointer data, gpointer user_data) {/*{{{*/
+	file_type_poppler_tile_t *tile = data;
+	if(!tile->render) {
+		file_type_poppler_prepare_document(tile);
+		return;
+	}
+	file_type_poppler_tiled_render_t *render = tile->render;
+	file_private_data_poppler_document_t *document = render->document;
+
+	// Take an idle instance of the document. There is at least one, see
+	// file_type_poppler_draw_tiled(), which is returned by whoever uses it,
+	// unless another page reloaded the document in the meantime.
+	g_mutex_lock(&document->lock);
+	while(!document->render_documents && document->generation == render->generation) {
+		g_cond_wait(&document->render_documents_cond, &document->lock);
+	}
+	PopplerDocument *poppler_document = NULL;
+	if(document->generation == render->generation) {
+		poppler_document = document->render_documents->data;
+		document->render_documents = g_slist_delete_link(document->render_documents, document->render_documents);
+	}
+	g_mutex_unlock(&document->lock);
+
+	tile->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, tile->width, tile->height);
+	cairo_t *cr = cairo_create(tile->surface);
+	cairo_set_source_rgb(cr, 1., 1., 1.);
+	cairo_paint(cr);
+	PopplerPage *page = poppler_document ? poppler_document_get_page(poppler_document, render->page_number) : NULL;
+	if(page) {
+		cairo_translate(cr, -tile->x, -tile->y);
+		cairo_transform(cr, &render->matrix);
+		apply_interpolation_quality(cr);
+		poppler_page_render(page, cr);
+		g_object_unref(page);
+	}
+	cairo_destroy(cr);
+
+	if(poppler_document) {
+		g_mutex_lock(&document->lock);
+		if(document->generation == render->generation) {
+			document->render_documents = g_slist_prepend(document->render_documents, poppler_document);
+			g_cond_signal(&document->render_documents_cond);
+			poppler_document = NULL;
+		}
+		g_mutex_unlock(&document->lock);
+		if(poppler_document) {
+			g_object_unref(poppler_document);
+		}
+	}
+
+	g_mutex_lock(&render->lock);
+	if(--render->pending_tiles == 0) {
+		g_cond_signal(&render->cond);
+	}
+	g_mutex_unlock(&render->lock);
+}/*}}}*/
+static gboolean file_type_poppler_draw_tiled(file_t *file, cairo_t *cr) {/*{{{*/
+	// Render large views in tiles, on several threads. Each thread uses its
+	// own instance of the document. Returns FALSE if the view should be
+	// rendered in one piece instead, which is also the case until the first
+	// instance has been parsed in the background.
+	file_private_data_poppler_t *private = (file_private_data_poppler_t *)file->private;
+	file_private_data_poppler_document_t *document = private->document;
+
+	if(cairo_surface_get_type(cairo_get_target(cr)) != CAIRO_SURFACE_TYPE_IMAGE) {
+		return FALSE;
+	}
+	cairo_matrix_t matrix;
+	cairo_get_matrix(cr, &matrix);
+	if(fabs(matrix.xy) > 1e-9 || fabs(matrix.yx) > 1e-9) {
+		return FALSE;
+	}
+
+	// Find the part of the target that the page covers
+	double x1 = 0, y1 = 0, x2 = file->width, y2 = file->height;
+	double clip_x1, clip_y1, clip_x2, clip_y2;
+	cairo_clip_extents(cr, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+	x1 = fmax(x1, clip_x1);
+	y1 = fmax(y1, clip_y1);
+	x2 = fmin(x2, clip_x2);
+	y2 = fmin(y2, clip_y2);
+	cairo_user_to_device(cr, &x1, &y1);
+	cairo_user_to_device(cr, &x2, &y2);
+	int left = (int)floor(fmin(x1, x2));
+	int top = (int)floor(fmin(y1, y2));
+	int right = (int)ceil(fmax(x1, x2));
+	int bottom = (int)ceil(fmax(y1, y2));
+	if(right <= left || bottom <= top || (gint64)(right - left) * (bottom - top) < POPPLER_TILED_RENDER_MIN_AREA) {
+		return FALSE;
+	}
+
+	G_LOCK(file_type_poppler_tile_pool);
+	if(!file_type_poppler_tile_pool) {
+		file_type_poppler_tile_pool = g_thread_pool_new(file_type_poppler_render_tile, NULL, CLAMP((gint)g_get_num_processors(), 1, POPPLER_MAX_RENDER_THREADS), FALSE, NULL);
+	}
+	G_UNLOCK(file_type_poppler_tile_pool);
+
+	g_mutex_lock(&document->lock);
+	gboolean has_render_documents = document->render_documents_count > 0 && private->generation == document->generation;
+	if(!has_render_documents && document->render_documents_pending == 0 && document->render_data && private->generation == document->generation) {
+		guint count = (guint)g_thread_pool_get_max_threads(file_type_poppler_tile_pool);
+		for(guint i=0; i<count; i++) {
+			file_type_poppler_tile_t *job = g_slice_new0(file_type_poppler_tile_t);
+			g_atomic_int_inc(&document->ref_count);
+			job->document = document;
+			job->document_data = g_bytes_ref(document->render_data);
+			g_thread_pool_push(file_type_poppler_tile_pool, job, NULL);
+		}
+		document->render_documents_pending = count;
+	}
+	g_mutex_unlock(&document->lock);
+	if(!has_render_documents) {
+		return FALSE;
+	}
+
+	file_type_poppler_tiled_render_t render = { 0 };
+	render.document = document;
+	render.generation = private->generation;
+	render.page_number = private->page_number;
+	render.matrix = matrix;
+	g_mutex_init(&render.lock);
+	g_cond_init(&render.cond);
+
+	int columns = (right - left + POPPLER_TILE_SIZE - 1) / POPPLER_TILE_SIZE;
+	int rows = (bottom - top + POPPLER_TILE_SIZE - 1) / POPPLER_TILE_SIZE;
+	file_type_poppler_tile_t *tiles = g_new0(file_type_poppler_tile_t, columns * rows);
+	render.pending_tiles = columns * rows;
+	for(int i=0; i<columns * rows; i++) {
+		tiles[i].render = &render;
+		tiles[i].x = left + (i % columns) * POPPLER_TILE_SIZE;
+		tiles[i].y = top + (i / columns) * POPPLER_TILE_SIZE;
+		tiles[i].width = MIN(POPPLER_TILE_SIZE, right - tiles[i].x);
+		tiles[i].height = MIN(POPPLER_TILE_SIZE, bottom - tiles[i].y);
+		g_thread_pool_push(file_type_poppler_tile_pool, &tiles[i], NULL);
+	}
+
+	g_mutex_lock(&render.lock);
+	while(render.pending_tiles > 0) {
+		g_cond_wait(&render.cond, &render.lock);
+	}
+	g_mutex_unlock(&render.lock);
+
+	// Assemble the tiles in device space
+	cairo_save(cr);
+	cairo_identity_matrix(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	for(int i=0; i<columns * rows; i++) {
+		cairo_set_source_surface(cr, tiles[i].surface, tiles[i].x, tiles[i].y);
+		cairo_rectangle(cr, tiles[i].x, tiles[i].y, tiles[i].width, tiles[i].height);
+		cairo_fill(cr);
+		cairo_surface_destroy(tiles[i].surface);
+	}
+	cairo_restore(cr);
+
+	g_free(tiles);
+	g_mutex_clear(&render.lock);
+	g_cond_clear(&render.cond);
+	return TRUE;
 }/*}}}*/
 void file_type_poppler_draw(file_t *file, cairo_t *cr) {/*{{{*/
 	file_private_data_poppler_t *private = (file_private_data_poppler_t *)file->private;
@@ -164,7 +471,12 @@ void file_type_poppler_draw(file_t *file, cairo_t *cr) {/*{{{*/
 	cairo_set_source_rgb(cr, 1., 1., 1.);
 	cairo_paint(cr);
 	apply_interpolation_quality(cr);
+	if(file_type_poppler_draw_tiled(file, cr)) {
+		return;
+	}
+	g_mutex_lock(&private->document->lock);
 	poppler_page_render(private->page, cr);
+	g_mutex_unlock(&private->document->lock);
 }/*}}}*/
 
 void file_type_poppler_initializer(file_type_handler_t *info) {/*{{{*/
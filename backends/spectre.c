@@ -18,6 +18,8 @@
  * libspectre backend (PS support)
  */
 
+#define _GNU_SOURCE
+
 #include "../pqiv.h"
 #include "../lib/filebuffer.h"
 #include <stdint.h>
@@ -31,11 +33,24 @@
 #include <libspectre/spectre.h>
 #include <cairo/cairo.h>
 
+#ifdef __linux__
+	#include <sys/mman.h>
+	#include <sys/socket.h>
+	#include <sys/wait.h>
+	#include <signal.h>
+	#ifdef MFD_CLOEXEC
+		#define SPECTRE_WITH_DECODER_PROCESSES
+	#endif
+#endif
+
 typedef struct {
 	int page_number;
 
 	struct SpectreDocument *document;
 	struct SpectrePage *page;
+
+	// Set instead of the above if the file is rendered by a helper process
+	const char *worker_file_name;
 } file_private_data_spectre_t;
 
 #if defined(__GNUC__)
@@ -62,46 +77,353 @@ void cmsPluginTHR(void *context, void *plugin) {
 	}
 }
 
-BOSNode *file_type_spectre_alloc(load_images_state_t state, file_t *file) {/*{{{*/
-	BOSNode *first_node = FALSE_POINTER;
+#ifdef SPECTRE_WITH_DECODER_PROCESSES
+// Helper processes (--decoder-processes) {{{
+// ghostscript is not reentrant, and does not play well with poppler in one
+// process (see above). With helper processes, documents are loaded and
+// rendered in separate address spaces, in parallel. The helpers are forked
+// while the backend is initialized, before pqiv starts its own threads. They
+// render into memfds, which are passed back over a socket and mapped.
+#define SPECTRE_WORKER_PATH_MAX 4096
+
+typedef struct {
+	enum { SPECTRE_WORKER_COUNT_PAGES, SPECTRE_WORKER_GET_SIZE, SPECTRE_WORKER_RENDER } type;
+	int page_number;
+	double scale_level;
+	char file_name[SPECTRE_WORKER_PATH_MAX];
+} spectre_worker_request_t;
+
+typedef struct {
+	// A SpectreStatus, or -1 if the helper failed otherwise
+	int status;
+	int n_pages;
+	int width;
+	int height;
+	int row_length;
+} spectre_worker_reply_t;
+
+typedef struct {
+	int socket;
+	pid_t pid;
+	gboolean busy;
+} spectre_worker_t;
+
+static spectre_worker_t *spectre_workers = NULL;
+static int spectre_workers_count = 0;
+static GMutex spectre_workers_lock;
+static GCond spectre_workers_cond;
+
+static void file_type_spectre_worker_main(int worker_socket) {/*{{{*/
+	// Main loop of a helper process. This runs in a forked copy of pqiv, so
+	// avoid anything besides libc and libspectre here.
+	struct SpectreDocument *document = NULL;
+	char document_file_name[SPECTRE_WORKER_PATH_MAX] = "";
+	struct stat document_stat = { 0 };
+	spectre_worker_request_t request;
+
+	while(recv(worker_socket, &request, sizeof(request), 0) == sizeof(request)) {
+		spectre_worker_reply_t reply = { -1, 0, 0, 0, 0 };
+		int fd = -1;
+		request.file_name[SPECTRE_WORKER_PATH_MAX - 1] = 0;
+
+		// Keep the last document, since pages are usually requested in a row,
+		// unless the file has changed since
+		struct stat request_stat;
+		if(stat(request.file_name, &request_stat) != 0) {
+			memset(&request_stat, 0, sizeof(request_stat));
+		}
+		if(!document || strcmp(document_file_name, request.file_name) != 0
+				|| request_stat.st_dev != document_stat.st_dev
+				|| request_stat.st_ino != document_stat.st_ino
+				|| request_stat.st_size != document_stat.st_size
+				|| request_stat.st_mtim.tv_sec != document_stat.st_mtim.tv_sec
+				|| request_stat.st_mtim.tv_nsec != document_stat.st_mtim.tv_nsec) {
+			if(document) {
+				spectre_document_free(document);
+			}
+			document = spectre_document_new();
+			spectre_document_load(document, request.file_name);
+			strcpy(document_file_name, request.file_name);
+			document_stat = request_stat;
+		}
+
+		struct SpectrePage *page = NULL;
+		reply.status = spectre_document_status(document);
+		if(reply.status == SPECTRE_STATUS_SUCCESS) {
+			reply.n_pages = spectre_document_get_n_pages(document);
+			if(request.type != SPECTRE_WORKER_COUNT_PAGES) {
+				page = spectre_document_get_page(document, request.page_number);
+				reply.status = page ? (int)spectre_page_status(page) : -1;
+			}
+		}
+		else {
+			document_file_name[0] = 0;
+		}
+
+		if(page && reply.status == SPECTRE_STATUS_SUCCESS) {
+			spectre_page_get_size(page, &reply.width, &reply.height);
+		}
+
+		if(page && reply.status == SPECTRE_STATUS_SUCCESS && request.type == SPECTRE_WORKER_RENDER) {
+			SpectreRenderContext *render_context = spectre_render_context_new();
+			spectre_render_context_set_scale(render_context, request.scale_level, request.scale_level);
+			unsigned char *page_data = NULL;
+			int row_length;
+			spectre_page_render(page, render_context, &page_data, &row_length);
+			spectre_render_context_free(render_context);
+
+			reply.status = spectre_page_status(page);
+			if(reply.status == SPECTRE_STATUS_SUCCESS && page_data) {
+				reply.width = reply.width * request.scale_level;
+				reply.height = reply.height * request.scale_level;
+				reply.row_length = row_length;
+
+				size_t size = (size_t)row_length * reply.height;
+				void *map = MAP_FAILED;
+				fd = memfd_create("pqiv-spectre", MFD_CLOEXEC);
+				if(fd >= 0 && ftruncate(fd, size) == 0) {
+					map = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+				}
+				if(map != MAP_FAILED) {
+					memcpy(map, page_data, size);
+					munmap(map, size);
+				}
+				else {
+					if(fd >= 0) {
+						close(fd);
+						fd = -1;
+					}
+					reply.status = -1;
+				}
+			}
+			else if(reply.status == SPECTRE_STATUS_SUCCESS) {
+				reply.status = -1;
+			}
+			free(page_data);
+		}
+		if(page) {
+			spectre_page_free(page);
+		}
+
+		// Send the reply, and the memfd along with it
+		struct iovec iov = { &reply, sizeof(reply) };
+		union { struct cmsghdr align; char buffer[CMSG_SPACE(sizeof(int))]; } control;
+		struct msghdr message = { 0 };
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		if(fd >= 0) {
+			message.msg_control = control.buffer;
+			message.msg_controllen = sizeof(control.buffer);
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+		ssize_t sent = sendmsg(worker_socket, &message, MSG_NOSIGNAL);
+		if(fd >= 0) {
+			close(fd);
+		}
+		if(sent != sizeof(reply)) {
+			break;
+		}
+	}
+
+	_exit(0);
+}/*}}}*/
+static void file_type_spectre_workers_start(int count) {/*{{{*/
+	spectre_workers = g_new0(spectre_worker_t, count);
+	for(int i=0; i<count; i++) {
+		int sockets[2];
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+			break;
+		}
+		pid_t pid = fork();
+		if(pid == 0) {
+			close(sockets[0]);
+			for(int j=0; j<spectre_workers_count; j++) {
+				close(spectre_workers[j].socket);
+			}
+			file_type_spectre_worker_main(sockets[1]);
+		}
+		close(sockets[1]);
+		if(pid < 0) {
+			close(sockets[0]);
+			break;
+		}
+		spectre_workers[spectre_workers_count].socket = sockets[0];
+		spectre_workers[spectre_workers_count].pid = pid;
+		spectre_workers_count++;
+	}
+	if(spectre_workers_count == 0) {
+		g_printerr("Failed to start decoder processes, PS files will be rendered in-process\n");
+	}
+}/*}}}*/
+static gboolean file_type_spectre_worker_available() {/*{{{*/
+	gboolean retval = FALSE;
+	g_mutex_lock(&spectre_workers_lock);
+	for(int i=0; i<spectre_workers_count; i++) {
+		if(spectre_workers[i].socket >= 0) {
+			retval = TRUE;
+			break;
+		}
+	}
+	g_mutex_unlock(&spectre_workers_lock);
+	return retval;
+}/*}}}*/
+static gboolean file_type_spectre_worker_request(spectre_worker_request_t *request, spectre_worker_reply_t *reply, int *fd) {/*{{{*/
+	// Have an idle helper process the request. Returns FALSE if the helper
+	// failed; it is not used again afterwards.
+	*fd = -1;
+
+	g_mutex_lock(&spectre_workers_lock);
+	spectre_worker_t *worker = NULL;
+	while(!worker) {
+		gboolean any_alive = FALSE;
+		for(int i=0; i<spectre_workers_count; i++) {
+			if(spectre_workers[i].socket >= 0) {
+				any_alive = TRUE;
+				if(!spectre_workers[i].busy) {
+					worker = &spectre_workers[i];
+					break;
+				}
+			}
+		}
+		if(!any_alive) {
+			g_mutex_unlock(&spectre_workers_lock);
+			return FALSE;
+		}
+		if(!worker) {
+			g_cond_wait(&spectre_workers_cond, &spectre_workers_lock);
+		}
+	}
+	worker->busy = TRUE;
+	g_mutex_unlock(&spectre_workers_lock);
+
+	gboolean success = send(worker->socket, request, sizeof(*request), MSG_NOSIGNAL) == sizeof(*request);
+	if(success) {
+		struct iovec iov = { reply, sizeof(*reply) };
+		union { struct cmsghdr align; char buffer[CMSG_SPACE(sizeof(int))]; } control;
+		struct msghdr message = { 0 };
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		message.msg_control = control.buffer;
+		message.msg_controllen = sizeof(control.buffer);
+		success = recvmsg(worker->socket, &message, MSG_CMSG_CLOEXEC) == sizeof(*reply);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+		if(success && cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+
+	pid_t failed_pid = 0;
+	g_mutex_lock(&spectre_workers_lock);
+	worker->busy = FALSE;
+	if(!success) {
+		close(worker->socket);
+		worker->socket = -1;
+		failed_pid = worker->pid;
+	}
+	g_cond_broadcast(&spectre_workers_cond);
+	g_mutex_unlock(&spectre_workers_lock);
+
+	if(failed_pid > 0) {
+		// Reap the helper. It has usually crashed already; otherwise, it is
+		// not trusted with further requests anyway.
+		if(waitpid(failed_pid, NULL, WNOHANG) == 0) {
+			kill(failed_pid, SIGKILL);
+			waitpid(failed_pid, NULL, 0);
+		}
+	}
+
+	return success;
+}/*}}}*/
+static gboolean file_type_spectre_worker_prepare_request(spectre_worker_request_t *request, int type, const char *file_name, int page_number) {/*{{{*/
+	if(!file_type_spectre_worker_available() || strlen(file_name) >= SPECTRE_WORKER_PATH_MAX) {
+		return FALSE;
+	}
+	memset(request, 0, sizeof(*request));
+	request->type = type;
+	request->page_number = page_number;
+	request->scale_level = current_scale_level;
+	strcpy(request->file_name, file_name);
+	return TRUE;
+}/*}}}*/
+// }}}
+#endif
+
+static GList *file_type_spectre_expand(file_t *file, gpointer user_data) {/*{{{*/
+	// Load the document to get the number of pages, and create one file_t for
+	// each page after the first
 	GError *error_pointer = NULL;
 
-	// Load the document to get the number of pages
 	struct SpectreDocument *document = spectre_document_new();
 	char *file_name = buffered_file_as_local_file(file, NULL, &error_pointer);
 	if(!file_name) {
 		g_printerr("Failed to load PS file %s: %s\n", file->file_name, error_pointer->message);
 		g_clear_error(&error_pointer);
-		return FALSE_POINTER;
+		spectre_document_free(document);
+		return NULL;
 	}
-	spectre_document_load(document, file_name);
-	if(spectre_document_status(document)) {
-		g_printerr("Failed to load image %s: %s\n", file->file_name, spectre_status_to_string(spectre_document_status(document)));
+	int n_pages = 0;
+	#ifdef SPECTRE_WITH_DECODER_PROCESSES
+		spectre_worker_request_t request;
+		if(file_type_spectre_worker_prepare_request(&request, SPECTRE_WORKER_COUNT_PAGES, file_name, 0)) {
+			spectre_worker_reply_t reply;
+			int fd;
+			spectre_document_free(document);
+
+			// The helper reads the file, so it must stay around until the
+			// reply arrives
+			gboolean success = file_type_spectre_worker_request(&request, &reply, &fd);
+			buffered_file_unref(file);
+			if(!success) {
+				g_printerr("Failed to load image %s: The decoder process failed\n", file->file_name);
+				return NULL;
+			}
+			if(reply.status) {
+				g_printerr("Failed to load image %s: %s\n", file->file_name, spectre_status_to_string(reply.status));
+				return NULL;
+			}
+			n_pages = reply.n_pages;
+		}
+		else
+	#endif
+	{
+		spectre_document_load(document, file_name);
+		if(spectre_document_status(document)) {
+			g_printerr("Failed to load image %s: %s\n", file->file_name, spectre_status_to_string(spectre_document_status(document)));
+			spectre_document_free(document);
+			buffered_file_unref(file);
+			return NULL;
+		}
+		n_pages = spectre_document_get_n_pages(document);
 		spectre_document_free(document);
 		buffered_file_unref(file);
-		file_free(file);
-		return FALSE_POINTER;
 	}
-	int n_pages = spectre_document_get_n_pages(document);
-	spectre_document_free(document);
-	buffered_file_unref(file);
 
-	for(int n=0; n<n_pages; n++) {
+	GList *files = NULL;
+	for(int n=n_pages - 1; n>0; n--) {
 		file_t *new_file = image_loader_duplicate_file(file,
 				NULL,
-				n == 0 ? NULL :  g_strdup_printf("%s[%d]", file->display_name, n + 1),
+				g_strdup_printf("%s[%d]", file->display_name, n + 1),
 				g_strdup_printf("%s[%d]", file->sort_name, n + 1));
 		new_file->private = g_slice_new0(file_private_data_spectre_t);
 		((file_private_data_spectre_t *)new_file->private)->page_number = n;
 
-		if(n == 0) {
-			first_node = load_images_handle_parameter_add_file(state, new_file);
-		}
-		else {
-			load_images_handle_parameter_add_file(state, new_file);
-		}
+		files = g_list_prepend(files, new_file);
 	}
 
+	return files;
+}/*}}}*/
+BOSNode *file_type_spectre_alloc(load_images_state_t state, file_t *file) {/*{{{*/
+	// Only the first page is added right away. The document is loaded in the
+	// background to add the others, see file_type_spectre_expand().
+	file_t *new_file = image_loader_duplicate_file(file, NULL, NULL, g_strdup_printf("%s[1]", file->sort_name));
+	new_file->private = g_slice_new0(file_private_data_spectre_t);
+
+	BOSNode *first_node = load_images_handle_parameter_add_document(state, new_file, file, file_type_spectre_expand, NULL, NULL);
+
 	if(first_node) {
 		file_free(file);
 	}
@@ -117,6 +439,30 @@ void file_type_spectre_load(file_t *file, GInputStream *data, GError **error_poi
 	if(!file_name) {
 		return;
 	}
+
+	#ifdef SPECTRE_WITH_DECODER_PROCESSES
+		spectre_worker_request_t request;
+		if(file_type_spectre_worker_prepare_request(&request, SPECTRE_WORKER_GET_SIZE, file_name, private->page_number)) {
+			spectre_worker_reply_t reply;
+			int fd;
+			if(!file_type_spectre_worker_request(&request, &reply, &fd)) {
+				*error_pointer = g_error_new(g_quark_from_static_string("pqiv-spectre-error"), 1, "Failed to load image %s: The decoder process failed\n", file->file_name);
+				buffered_file_unref(file);
+				return;
+			}
+			if(reply.status) {
+				*error_pointer = g_error_new(g_quark_from_static_string("pqiv-spectre-error"), 1, "Failed to load image %s / page %d: %s\n", file->file_name, private->page_number, reply.status > 0 ? spectre_status_to_string(reply.status) : "Failed to load page");
+				buffered_file_unref(file);
+				return;
+			}
+			file->width = reply.width;
+			file->height = reply.height;
+			private->worker_file_name = file_name;
+			file->is_loaded = TRUE;
+			return;
+		}
+	#endif
+
 	struct SpectreDocument *document = spectre_document_new();
 	spectre_document_load(document, file_name);
 	if(spectre_document_status(document)) {
@@ -158,12 +504,66 @@ void file_type_spectre_unload(file_t *file) {/*{{{*/
 		spectre_document_free(private->document);
 		private->document = NULL;
 
+		buffered_file_unref(file);
+	}
+	if(private->worker_file_name) {
+		private->worker_file_name = NULL;
+
 		buffered_file_unref(file);
 	}
 }/*}}}*/
+#ifdef SPECTRE_WITH_DECODER_PROCESSES
+static void file_type_spectre_draw_from_worker(file_t *file, cairo_t *cr) {/*{{{*/
+	file_private_data_spectre_t *private = (file_private_data_spectre_t *)file->private;
+
+	spectre_worker_request_t request;
+	if(!file_type_spectre_worker_prepare_request(&request, SPECTRE_WORKER_RENDER, private->worker_file_name, private->page_number)) {
+		g_printerr("Failed to draw image: No decoder process left\n");
+		return;
+	}
+	spectre_worker_reply_t reply;
+	int fd;
+	if(!file_type_spectre_worker_request(&request, &reply, &fd)) {
+		g_printerr("Failed to draw image: The decoder process failed\n");
+		return;
+	}
+	if(reply.status || fd < 0) {
+		g_printerr("Failed to draw image: %s\n", reply.status > 0 ? spectre_status_to_string(reply.status) : "Unknown error");
+		if(fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+
+	size_t size = (size_t)reply.row_length * reply.height;
+	unsigned char *page_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(page_data == MAP_FAILED) {
+		g_printerr("Failed to draw image: Failed to map the rendered page\n");
+		return;
+	}
+
+	cairo_surface_t *image_surface = cairo_image_surface_create_for_data(page_data, CAIRO_FORMAT_RGB24, reply.width, reply.height, reply.row_length);
+
+	cairo_scale(cr, 1 / request.scale_level, 1 / request.scale_level);
+	cairo_set_source_surface(cr, image_surface, 0, 0);
+	apply_interpolation_quality(cr);
+	cairo_paint(cr);
+
+	cairo_surface_destroy(image_surface);
+	munmap(page_data, size);
+}/*}}}*/
+#endif
 void file_type_spectre_draw(file_t *file, cairo_t *cr) {/*{{{*/
 	file_private_data_spectre_t *private = (file_private_data_spectre_t *)file->private;
 
+	#ifdef SPECTRE_WITH_DECODER_PROCESSES
+		if(private->worker_file_name) {
+			file_type_spectre_draw_from_worker(file, cr);
+			return;
+		}
+	#endif
+
 	SpectreRenderContext *render_context = spectre_render_context_new();
 	spectre_render_context_set_scale(render_context, current_scale_level, current_scale_level);
 
@@ -212,4 +612,10 @@ void file_type_spectre_initializer(file_type_handler_t *info) {/*{{{*/
 	info->load_fn                  =  file_type_spectre_load;
 	info->unload_fn                =  file_type_spectre_unload;
 	info->draw_fn                  =  file_type_spectre_draw;
+
+	#ifdef SPECTRE_WITH_DECODER_PROCESSES
+		if(option_decoder_processes > 0) {
+			file_type_spectre_workers_start(option_decoder_processes);
+		}
+	#endif
 }/*}}}*/
@@ -46,15 +46,19 @@
 
 #include <cairo/cairo.h>
 
-// ImageMagick's multithreading is broken. To test this, open a multi-page
-// postscript document using this backend without --low-memory and then quit
-// pqiv. The backend will freeze in MagickWandTerminus() while waiting for
-// a Mutex. We must do this call to allow ImageMagick to delete temporary
-// files created using postscript processing (in /tmp usually).
+// A wand may be used from any thread, as long as no two threads use it at
+// the same time. pqiv guarantees that through the per-file lock, so distinct
+// files decode concurrently and only hold this lock for reading.
 //
-// The only way around this, sadly, is to use a global mutex around all
-// ImageMagick calls.
-G_LOCK_DEFINE_STATIC(magick_wand_global_lock);
+// Two things need exclusive access: MagickWandTerminus() freezes while
+// waiting for a mutex if other threads still use ImageMagick. To test this,
+// open a multi-page postscript document without --low-memory and quit pqiv.
+// We must call it to allow ImageMagick to delete temporary files created
+// using postscript processing (in /tmp usually). And PS/PDF documents are
+// rendered through ghostscript, which is not reentrant. Since ImageMagick
+// decides that by content, only well known raster formats are decoded
+// concurrently, see file_type_wand_is_raster_format().
+static GRWLock magick_wand_lock;
 
 typedef struct {
 	MagickWand *wand;
@@ -62,21 +66,61 @@ typedef struct {
 
 	// Starting from 1 for numbered files, 0 for unpaginated files
 	unsigned int page_number;
+
+	// Set if the file might be decoded through a delegate such as
+	// ghostscript, and must therefore not be used concurrently with others
+	gboolean needs_exclusive_access;
 } file_private_data_wand_t;
 
+static void file_type_wand_lock(file_t *file) {/*{{{*/
+	if(((file_private_data_wand_t *)file->private)->needs_exclusive_access) {
+		g_rw_lock_writer_lock(&magick_wand_lock);
+	}
+	else {
+		g_rw_lock_reader_lock(&magick_wand_lock);
+	}
+}/*}}}*/
+static void file_type_wand_unlock(file_t *file) {/*{{{*/
+	if(((file_private_data_wand_t *)file->private)->needs_exclusive_access) {
+		g_rw_lock_writer_unlock(&magick_wand_lock);
+	}
+	else {
+		g_rw_lock_reader_unlock(&magick_wand_lock);
+	}
+}/*}}}*/
+
 // Check if a (named) file has a certain extension. Used for psd fix and multi-page detection (ps, pdf, ..)
 static gboolean file_type_wand_has_extension(file_t *file, const char *extension) {
 	char *actual_extension;
 	return (!(file->file_flags & FILE_FLAGS_MEMORY_IMAGE) && file->file_name && (actual_extension = strrchr(file->file_name, '.')) && strcasecmp(actual_extension, extension) == 0);
 }
 
-// Functions to render the Magick backend to a cairo surface via in-memory PNG export
-cairo_status_t file_type_wand_read_data(void *closure, unsigned char *data, unsigned int length) {/*{{{*/
-	unsigned char **pos = closure;
-	memcpy(data, *pos, length);
-	*pos += length;
-	return CAIRO_STATUS_SUCCESS;
+// Check if data is in one of the common raster formats, which ImageMagick
+// decodes by itself. Others, e.g. EPS, AI or PS without a telling name,
+// might be handed to a delegate.
+static gboolean file_type_wand_is_raster_format(const guchar *data, gsize size) {/*{{{*/
+	static const struct { const char *signature; gsize offset; gsize length; } signatures[] = {
+		{ "\x89PNG", 0, 4 },
+		{ "\xff\xd8\xff", 0, 3 },
+		{ "GIF8", 0, 4 },
+		{ "II*\0", 0, 4 },
+		{ "MM\0*", 0, 4 },
+		{ "BM", 0, 2 },
+		{ "WEBP", 8, 4 },
+		{ "8BPS", 0, 4 },
+		{ "gimp xcf", 0, 8 },
+		{ "DDS ", 0, 4 },
+		{ "\x76\x2f\x31\x01", 0, 4 }, // OpenEXR
+	};
+	for(gsize i=0; i<G_N_ELEMENTS(signatures); i++) {
+		if(size >= signatures[i].offset + signatures[i].length && memcmp(data + signatures[i].offset, signatures[i].signature, signatures[i].length) == 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
 }/*}}}*/
+
+// Render the current image of the wand to a cairo surface
 void file_type_wand_update_image_surface(file_t *file) {/*{{{*/
 	file_private_data_wand_t *private = file->private;
 
@@ -85,102 +129,156 @@ void file_type_wand_update_image_surface(file_t *file) {/*{{{*/
 		private->rendered_image_surface = NULL;
 	}
 
-	MagickSetImageFormat(private->wand, "PNG32");
+	size_t width = MagickGetImageWidth(private->wand);
+	size_t height = MagickGetImageHeight(private->wand);
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		return;
+	}
+	cairo_surface_flush(surface);
+	unsigned char *data = cairo_image_surface_get_data(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+
+	// CAIRO_FORMAT_ARGB32 pixels are native endian 32 bit integers
+	#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		const char *map = "BGRA";
+	#else
+		const char *map = "ARGB";
+	#endif
+
+	// Pixels are exported in the image's own colorspace. Convert e.g. CMYK
+	// and Lab images to sRGB first, using a copy of the current frame such
+	// that the wand stays untouched for later frames.
+	MagickWand *export_wand = private->wand;
+	ColorspaceType colorspace = MagickGetImageColorspace(private->wand);
+	if(colorspace != sRGBColorspace && colorspace != GRAYColorspace && colorspace != UndefinedColorspace) {
+		MagickWand *converted_wand = MagickGetImage(private->wand);
+		if(converted_wand) {
+			if(MagickTransformImageColorspace(converted_wand, sRGBColorspace) == MagickTrue) {
+				export_wand = converted_wand;
+			}
+			else {
+				DestroyMagickWand(converted_wand);
+			}
+		}
+	}
 
-	size_t image_size;
-	unsigned char *image_data = MagickGetImageBlob(private->wand, &image_size);
-	unsigned char *image_data_loc = image_data;
+	for(size_t y=0; y<height; y++) {
+		MagickExportImagePixels(export_wand, 0, y, width, 1, map, CharPixel, data + y * stride);
+	}
 
-	private->rendered_image_surface = cairo_image_surface_create_from_png_stream(file_type_wand_read_data, &image_data_loc);
+	if(export_wand != private->wand) {
+		DestroyMagickWand(export_wand);
+	}
 
-	MagickRelinquishMemory(image_data);
-}/*}}}*/
+	// cairo expects premultiplied alpha
+	for(size_t y=0; y<height; y++) {
+		guint32 *row = (guint32 *)(data + y * stride);
+		for(size_t x=0; x<width; x++) {
+			guint32 alpha = row[x] >> 24;
+			if(alpha == 0xff) {
+				continue;
+			}
+			guint32 red = (((row[x] >> 16) & 0xff) * alpha + 127) / 255;
+			guint32 green = (((row[x] >> 8) & 0xff) * alpha + 127) / 255;
+			guint32 blue = ((row[x] & 0xff) * alpha + 127) / 255;
+			row[x] = (alpha << 24) | (red << 16) | (green << 8) | blue;
+		}
+	}
+	cairo_surface_mark_dirty(surface);
 
-BOSNode *file_type_wand_alloc(load_images_state_t state, file_t *file) {/*{{{*/
-	G_LOCK(magick_wand_global_lock);
+	private->rendered_image_surface = surface;
+}/*}}}*/
 
-	if(file_type_wand_has_extension(file, ".pdf") || file_type_wand_has_extension(file, ".ps")) {
-		// Multi-page document. Load number of pages and create one file_t per page
-		GError *error_pointer = NULL;
-		MagickWand *wand = NewMagickWand();
-		GBytes *image_bytes = buffered_file_as_bytes(file, NULL, &error_pointer);
-		if(!image_bytes) {
-			g_printerr("Failed to read image %s: %s\n", file->file_name, error_pointer->message);
-			g_clear_error(&error_pointer);
-			G_UNLOCK(magick_wand_global_lock);
-			file_free(file);
-			return FALSE_POINTER;
-		}
-		size_t image_size;
-		const gchar *image_data = g_bytes_get_data(image_bytes, &image_size);
-		MagickBooleanType success = MagickReadImageBlob(wand, image_data, image_size);
-		if(success == MagickFalse) {
-			ExceptionType severity;
-			char *message = MagickGetException(wand, &severity);
-			g_printerr("Failed to read image %s: %s\n", file->file_name, message);
-			MagickRelinquishMemory(message);
-			DestroyMagickWand(wand);
-			buffered_file_unref(file);
-			G_UNLOCK(magick_wand_global_lock);
-			file_free(file);
-			return FALSE_POINTER;
-		}
+static GList *file_type_wand_expand(file_t *file, gpointer user_data) {/*{{{*/
+	// Load the number of pages and create one file_t for each page after the first
+	g_rw_lock_writer_lock(&magick_wand_lock);
 
-		int n_pages = MagickGetNumberImages(wand);
+	GError *error_pointer = NULL;
+	MagickWand *wand = NewMagickWand();
+	GBytes *image_bytes = buffered_file_as_bytes(file, NULL, &error_pointer);
+	if(!image_bytes) {
+		g_printerr("Failed to read image %s: %s\n", file->file_name, error_pointer->message);
+		g_clear_error(&error_pointer);
+		DestroyMagickWand(wand);
+		g_rw_lock_writer_unlock(&magick_wand_lock);
+		return NULL;
+	}
+	size_t image_size;
+	const gchar *image_data = g_bytes_get_data(image_bytes, &image_size);
+	MagickBooleanType success = MagickReadImageBlob(wand, image_data, image_size);
+	if(success == MagickFalse) {
+		ExceptionType severity;
+		char *message = MagickGetException(wand, &severity);
+		g_printerr("Failed to read image %s: %s\n", file->file_name, message);
+		MagickRelinquishMemory(message);
 		DestroyMagickWand(wand);
 		buffered_file_unref(file);
+		g_rw_lock_writer_unlock(&magick_wand_lock);
+		return NULL;
+	}
 
-		BOSNode *first_node = FALSE_POINTER;
-		for(int n=0; n<n_pages; n++) {
-			file_t *new_file = image_loader_duplicate_file(file,
-					NULL,
-					n == 0 ? NULL :  g_strdup_printf("%s[%d]", file->display_name, n + 1),
-					g_strdup_printf("%s[%d]", file->sort_name, n + 1));
-			new_file->private = g_slice_new0(file_private_data_wand_t);
-			((file_private_data_wand_t *)new_file->private)->page_number = n + 1;
-
-			// Temporarily give up lock to do this: Otherwise we might see a deadlock
-			// if another thread holding the file tree's lock is waiting for the wand
-			// lock for another operation.
-			G_UNLOCK(magick_wand_global_lock);
-			if(n == 0) {
-				first_node = load_images_handle_parameter_add_file(state, new_file);
-			}
-			else {
-				load_images_handle_parameter_add_file(state, new_file);
-			}
-			G_LOCK(magick_wand_global_lock);
-		}
+	int n_pages = MagickGetNumberImages(wand);
+	DestroyMagickWand(wand);
+	buffered_file_unref(file);
+	g_rw_lock_writer_unlock(&magick_wand_lock);
+
+	GList *files = NULL;
+	for(int n=n_pages - 1; n>0; n--) {
+		file_t *new_file = image_loader_duplicate_file(file,
+				NULL,
+				g_strdup_printf("%s[%d]", file->display_name, n + 1),
+				g_strdup_printf("%s[%d]", file->sort_name, n + 1));
+		new_file->private = g_slice_new0(file_private_data_wand_t);
+		((file_private_data_wand_t *)new_file->private)->page_number = n + 1;
+
+		files = g_list_prepend(files, new_file);
+	}
+
+	return files;
+}/*}}}*/
+BOSNode *file_type_wand_alloc(load_images_state_t state, file_t *file) {/*{{{*/
+	if(file_type_wand_has_extension(file, ".pdf") || file_type_wand_has_extension(file, ".ps")) {
+		// Multi-page document. Only the first page is added right away, the
+		// document is read in the background to add the others, see
+		// file_type_wand_expand().
+		file_t *new_file = image_loader_duplicate_file(file, NULL, NULL, g_strdup_printf("%s[1]", file->sort_name));
+		new_file->private = g_slice_new0(file_private_data_wand_t);
+		((file_private_data_wand_t *)new_file->private)->page_number = 1;
+
+		BOSNode *first_node = load_images_handle_parameter_add_document(state, new_file, file, file_type_wand_expand, NULL, NULL);
 
 		if(first_node) {
 			file_free(file);
 		}
-		G_UNLOCK(magick_wand_global_lock);
 		return first_node;
 	}
 	else {
 		// Simple image
 		file->private = g_slice_new0(file_private_data_wand_t);
-		BOSNode *first_node = load_images_handle_parameter_add_file(state, file);
-		G_UNLOCK(magick_wand_global_lock);
-		return first_node;
+		return load_images_handle_parameter_add_file(state, file);
 	}
 }/*}}}*/
 void file_type_wand_free(file_t *file) {/*{{{*/
 	g_slice_free(file_private_data_wand_t, file->private);
 }/*}}}*/
 void file_type_wand_load(file_t *file, GInputStream *data, GError **error_pointer) {/*{{{*/
-	G_LOCK(magick_wand_global_lock);
 	file_private_data_wand_t *private = file->private;
 
-	private->wand = NewMagickWand();
 	gsize image_size;
 	GBytes *image_bytes = buffered_file_as_bytes(file, data, error_pointer);
 	if(!image_bytes) {
-		G_UNLOCK(magick_wand_global_lock);
 		return;
 	}
 	const gchar *image_data = g_bytes_get_data(image_bytes, &image_size);
+
+	// Decide by content rather than by name, which e.g. files from archives
+	// or stdin do not have
+	private->needs_exclusive_access = private->page_number > 0 || !file_type_wand_is_raster_format((const guchar *)image_data, image_size);
+	file_type_wand_lock(file);
+
+	private->wand = NewMagickWand();
 	MagickBooleanType success = MagickReadImageBlob(private->wand, image_data, image_size);
 
 	if(success == MagickFalse) {
@@ -191,7 +289,7 @@ void file_type_wand_load(file_t *file, GInputStream *data, GError **error_pointe
 		DestroyMagickWand(private->wand);
 		private->wand = NULL;
 		buffered_file_unref(file);
-		G_UNLOCK(magick_wand_global_lock);
+		file_type_wand_unlock(file);
 		return;
 	}
 
@@ -232,7 +330,7 @@ void file_type_wand_load(file_t *file, GInputStream *data, GError **error_pointe
 	file->width = MagickGetImageWidth(private->wand);
 	file->height = MagickGetImageHeight(private->wand);
 	file->is_loaded = TRUE;
-	G_UNLOCK(magick_wand_global_lock);
+	file_type_wand_unlock(file);
 }/*}}}*/
 double file_type_wand_animation_initialize(file_t *file) {/*{{{*/
 	file_private_data_wand_t *private = file->private;
@@ -243,7 +341,7 @@ double file_type_wand_animation_next_frame(file_t *file) {/*{{{*/
 	// ImageMagick tends to be really slow when it comes to loading frames.
 	// We therefore measure the required time and subtract it from the time
 	// pqiv waits before loading the next frame:
-	G_LOCK(magick_wand_global_lock);
+	file_type_wand_lock(file);
 	gint64 begin_time = g_get_monotonic_time();
 
 	file_private_data_wand_t *private = file->private;
@@ -258,12 +356,12 @@ double file_type_wand_animation_next_frame(file_t *file) {/*{{{*/
 	gint64 required_time = (g_get_monotonic_time() - begin_time) / 1000;
 	gint pause = 1000. / MagickGetImageDelay(private->wand);
 
-	G_UNLOCK(magick_wand_global_lock);
+	file_type_wand_unlock(file);
 
 	return pause + 1 > required_time ? pause - required_time : 1;
 }/*}}}*/
 void file_type_wand_unload(file_t *file) {/*{{{*/
-	G_LOCK(magick_wand_global_lock);
+	file_type_wand_lock(file);
 	file_private_data_wand_t *private = file->private;
 
 	if(private->rendered_image_surface) {
@@ -277,7 +375,7 @@ void file_type_wand_unload(file_t *file) {/*{{{*/
 
 		buffered_file_unref(file);
 	}
-	G_UNLOCK(magick_wand_global_lock);
+	file_type_wand_unlock(file);
 }/*}}}*/
 void file_type_wand_draw(file_t *file, cairo_t *cr) {/*{{{*/
 	file_private_data_wand_t *private = file->private;
@@ -296,9 +394,9 @@ void file_type_wand_draw(file_t *file, cairo_t *cr) {/*{{{*/
 }/*}}}*/
 
 static void file_type_wand_exit_handler() {/*{{{*/
-	G_LOCK(magick_wand_global_lock);
+	g_rw_lock_writer_lock(&magick_wand_lock);
 	MagickWandTerminus();
-	G_UNLOCK(magick_wand_global_lock);
+	g_rw_lock_writer_unlock(&magick_wand_lock);
 }/*}}}*/
 
 void file_type_wand_initializer(file_type_handler_t *info) {/*{{{*/
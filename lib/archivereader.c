@@ -0,0 +1,183 @@
+/**
+ * pqiv
+ *
+ * Copyright (c) 2013-2017, Phillip Berndt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "archivereader.h"
+#include "archivewindow.h"
+#include "zipindex.h"
+#include <string.h>
+#include <errno.h>
+
+typedef struct {
+	GInputStream *stream;
+
+	// Where the archive starts within the stream
+	gint64 start;
+
+	gchar block[ARCHIVE_READER_BLOCK_SIZE];
+} archive_reader_stream_t;
+
+static ssize_t archive_reader_stream_read(struct archive *archive, void *client_data, const void **buffer) {/*{{{*/
+	archive_reader_stream_t *reader = client_data;
+
+	GError *error_pointer = NULL;
+	gssize bytes_read = g_input_stream_read(reader->stream, reader->block, sizeof(reader->block), image_loader_cancellable, &error_pointer);
+	if(bytes_read < 0) {
+		archive_set_error(archive, EIO, "%s", error_pointer->message);
+		g_clear_error(&error_pointer);
+		return -1;
+	}
+
+	*buffer = reader->block;
+	return bytes_read;
+}/*}}}*/
+static gint64 archive_reader_stream_skip(struct archive *archive, void *client_data, gint64 request) {/*{{{*/
+	archive_reader_stream_t *reader = client_data;
+
+	// If seeking fails, libarchive reads over the data instead
+	if(!g_seekable_seek(G_SEEKABLE(reader->stream), request, G_SEEK_CUR, image_loader_cancellable, NULL)) {
+		return 0;
+	}
+	return request;
+}/*}}}*/
+static gint64 archive_reader_stream_seek(struct archive *archive, void *client_data, gint64 offset, int whence) {/*{{{*/
+	archive_reader_stream_t *reader = client_data;
+
+	GSeekType type = G_SEEK_END;
+	if(whence == SEEK_SET) {
+		type = G_SEEK_SET;
+		offset += reader->start;
+	}
+	else if(whence == SEEK_CUR) {
+		type = G_SEEK_CUR;
+	}
+
+	if(!g_seekable_seek(G_SEEKABLE(reader->stream), offset, type, image_loader_cancellable, NULL)) {
+		return ARCHIVE_FATAL;
+	}
+	return g_seekable_tell(G_SEEKABLE(reader->stream)) - reader->start;
+}/*}}}*/
+static int archive_reader_stream_close(struct archive *archive, void *client_data) {/*{{{*/
+	archive_reader_stream_t *reader = client_data;
+	g_object_unref(reader->stream);
+	g_free(reader);
+	return ARCHIVE_OK;
+}/*}}}*/
+
+int archive_reader_open(struct archive *archive, GBytes *data, GInputStream *stream, gint64 offset) {/*{{{*/
+	if(data) {
+		gsize data_size;
+		char *data_ptr = (char *)g_bytes_get_data(data, &data_size);
+		if(offset < 0 || (gsize)offset >= data_size) {
+			return ARCHIVE_FATAL;
+		}
+		return archive_read_open_memory(archive, data_ptr + offset, data_size - offset);
+	}
+
+	if(!g_seekable_seek(G_SEEKABLE(stream), offset, G_SEEK_SET, image_loader_cancellable, NULL)) {
+		return ARCHIVE_FATAL;
+	}
+
+	archive_reader_stream_t *reader = g_new(archive_reader_stream_t, 1);
+	reader->stream = g_object_ref(stream);
+	reader->start = offset;
+	archive_read_set_read_callback(archive, archive_reader_stream_read);
+	archive_read_set_skip_callback(archive, archive_reader_stream_skip);
+	archive_read_set_seek_callback(archive, archive_reader_stream_seek);
+	archive_read_set_close_callback(archive, archive_reader_stream_close);
+	archive_read_set_callback_data(archive, reader);
+	return archive_read_open1(archive);
+}/*}}}*/
+struct archive *archive_reader_new(GBytes *data, GInputStream *stream) {/*{{{*/
+	struct archive *archive = archive_read_new();
+	archive_read_support_format_zip(archive);
+	archive_read_support_format_rar(archive);
+	archive_read_support_format_7zip(archive);
+	archive_read_support_format_tar(archive);
+	archive_read_support_filter_all(archive);
+
+	if(archive_reader_open(archive, data, stream, 0) != ARCHIVE_OK) {
+		g_printerr("Failed to load archive: %s\n", archive_error_string(archive));
+		archive_read_free(archive);
+		return NULL;
+	}
+
+	return archive;
+}/*}}}*/
+struct archive *archive_reader_new_at(GBytes *data, GInputStream *stream, gint64 offset, int format, const gchar *entry_name, struct archive_entry **entry) {/*{{{*/
+	if(offset < 0) {
+		return NULL;
+	}
+
+	struct archive *archive = archive_read_new();
+	if(format == ARCHIVE_FORMAT_ZIP) {
+		archive_read_support_format_zip_streamable(archive);
+	}
+	else if(format == ARCHIVE_FORMAT_TAR) {
+		archive_read_support_format_tar(archive);
+	}
+	else {
+		archive_read_free(archive);
+		return NULL;
+	}
+
+	if(archive_reader_open(archive, data, stream, offset) != ARCHIVE_OK || archive_read_next_header(archive, entry) != ARCHIVE_OK || strcmp(entry_name, archive_entry_pathname(*entry)) != 0) {
+		archive_read_free(archive);
+		return NULL;
+	}
+
+	return archive;
+}/*}}}*/
+gint64 archive_reader_entry_offset(struct archive *archive, struct archive_entry *entry, GHashTable **zip_index, GBytes *data, int *format) {/*{{{*/
+	*format = archive_format(archive) & ARCHIVE_FORMAT_BASE_MASK;
+	if(*format == ARCHIVE_FORMAT_ZIP) {
+		// The position libarchive reports for seekable ZIP reading is not
+		// reliable; use the central directory instead
+		if(!*zip_index) {
+			gsize data_size;
+			const guchar *data_ptr = g_bytes_get_data(data, &data_size);
+			*zip_index = zip_index_from_central_directory(data_ptr, data_size);
+			if(!*zip_index) {
+				*zip_index = g_hash_table_new(g_str_hash, g_str_equal);
+			}
+		}
+		gpointer offset;
+		if(g_hash_table_lookup_extended(*zip_index, archive_entry_pathname(entry), NULL, &offset)) {
+			return GPOINTER_TO_SIZE(offset);
+		}
+	}
+	else if(*format == ARCHIVE_FORMAT_TAR && archive_filter_code(archive, 0) == ARCHIVE_FILTER_NONE) {
+		// Only uncompressed tar files can be entered in the middle
+		return archive_read_header_position(archive);
+	}
+	return -1;
+}/*}}}*/
+void archive_reader_fill_window(struct archive *archive, const gchar *archive_name) {/*{{{*/
+	struct archive_entry *entry;
+	for(int i=0; i<ARCHIVE_WINDOW_ENTRIES && archive_read_next_header(archive, &entry) == ARCHIVE_OK; i++) {
+		gint64 entry_size = archive_entry_size(entry);
+		if(entry_size <= 0 || entry_size > ARCHIVE_WINDOW_BUDGET) {
+			continue;
+		}
+
+		void *entry_data = g_malloc(entry_size);
+		if(archive_read_data(archive, entry_data, entry_size) != (ssize_t)entry_size) {
+			g_free(entry_data);
+			break;
+		}
+		archive_window_store(archive_name, archive_entry_pathname(entry), g_bytes_new_take(entry_data, entry_size));
+	}
+}/*}}}*/
@@ -0,0 +1,55 @@
+/**
+ * pqiv
+ *
+ * Copyright (c) 2013-2017, Phillip Berndt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// libarchive helpers shared by the archive backends
+//
+// Archives are read either from memory or from a seekable stream, in which
+// case only the parts that are needed are loaded. Entries of ZIP and plain tar
+// files can be read directly from the offset of their header.
+//
+// Unlike the other lib/ modules, this one depends on libarchive. It is only
+// built along with the backends that need it.
+//
+
+#include "../pqiv.h"
+#include <archive.h>
+#include <archive_entry.h>
+
+// Size of the blocks in which archives are read from streams
+#define ARCHIVE_READER_BLOCK_SIZE (64 * 1024)
+
+// Open an archive starting at offset, either from data or, if that is NULL,
+// from a seekable stream. Returns a libarchive status.
+int archive_reader_open(struct archive *archive, GBytes *data, GInputStream *stream, gint64 offset);
+
+// Open an archive of any supported format for reading from the start.
+// Returns NULL on failure.
+struct archive *archive_reader_new(GBytes *data, GInputStream *stream);
+
+// Open an archive at the header of an entry, if that is possible for its
+// format, and read the header. Returns NULL if the entry is not found there.
+struct archive *archive_reader_new_at(GBytes *data, GInputStream *stream, gint64 offset, int format, const gchar *entry_name, struct archive_entry **entry);
+
+// Find where the header of the entry just read starts, for use with
+// archive_reader_new_at, or return -1. zip_index caches the central directory
+// of ZIP archives between calls and must be freed by the caller.
+gint64 archive_reader_entry_offset(struct archive *archive, struct archive_entry *entry, GHashTable **zip_index, GBytes *data, int *format);
+
+// Extract the entries following the current one into the read window, see
+// archivewindow.h
+void archive_reader_fill_window(struct archive *archive, const gchar *archive_name);
@@ -0,0 +1,247 @@
+/**
+ * pqiv
+ *
+ * Copyright (c) 2013-2017, Phillip Berndt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "archivetoc.h"
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <time.h>
+
+// Cache files consist of NUL terminated fields: This magic, the archive's
+// path, inode, size, mtime and the mtime's nanoseconds, followed by name,
+// size, offset and format of each entry.
+#define ARCHIVE_TOC_MAGIC "pqiv-archive-toc-2"
+
+// Cache files unused for longer than this many seconds are removed, and at
+// most this many are kept
+#define ARCHIVE_TOC_MAX_AGE (30 * 24 * 60 * 60)
+#define ARCHIVE_TOC_MAX_FILES 512
+
+typedef struct {
+	gchar *file_name;
+	time_t mtime;
+} archive_toc_cache_file_t;
+
+archive_toc_entry_t *archive_toc_entry_new(const gchar *entry_name, gint64 entry_size, gint64 entry_offset, int entry_format) {/*{{{*/
+	archive_toc_entry_t *entry = g_slice_new(archive_toc_entry_t);
+	entry->entry_name = g_strdup(entry_name);
+	entry->entry_size = entry_size;
+	entry->entry_offset = entry_offset;
+	entry->entry_format = entry_format;
+	return entry;
+}/*}}}*/
+void archive_toc_entry_free(archive_toc_entry_t *entry) {/*{{{*/
+	g_free(entry->entry_name);
+	g_slice_free(archive_toc_entry_t, entry);
+}/*}}}*/
+
+static gchar *archive_toc_cache_file_name(file_t *file, gchar **local_path, GStatBuf *file_stat) {/*{{{*/
+	// Only files on disk can be identified later on
+	if(file->file_flags & FILE_FLAGS_MEMORY_IMAGE) {
+		return NULL;
+	}
+
+	GFile *gfile = gfile_for_commandline_arg(file->file_name);
+	*local_path = g_file_get_path(gfile);
+	g_object_unref(gfile);
+	if(!*local_path) {
+		return NULL;
+	}
+
+	if(g_stat(*local_path, file_stat) != 0 || !S_ISREG(file_stat->st_mode)) {
+		g_free(*local_path);
+		*local_path = NULL;
+		return NULL;
+	}
+
+	gchar *md5_path = g_compute_checksum_for_string(G_CHECKSUM_MD5, *local_path, -1);
+	gchar *md5_file_name = g_strdup_printf("%s.toc", md5_path);
+	gchar *cache_file_name = g_build_filename(g_get_user_cache_dir(), "pqiv", "archives", md5_file_name, NULL);
+	g_free(md5_file_name);
+	g_free(md5_path);
+	return cache_file_name;
+}/*}}}*/
+static gint64 archive_toc_mtime_nsec(GStatBuf *file_stat) {/*{{{*/
+	#ifdef _WIN32
+		return 0;
+	#else
+		return (gint64)file_stat->st_mtim.tv_nsec;
+	#endif
+}/*}}}*/
+static const gchar *archive_toc_next_field(const gchar **pos, const gchar *end) {/*{{{*/
+	// Return the field at *pos and advance past it, or NULL if there is none
+	if(*pos >= end) {
+		return NULL;
+	}
+	const gchar *field = *pos;
+	const gchar *field_end = memchr(field, '\0', end - field);
+	if(!field_end) {
+		return NULL;
+	}
+	*pos = field_end + 1;
+	return field;
+}/*}}}*/
+static void archive_toc_append_field(GString *data, const gchar *field) {/*{{{*/
+	g_string_append(data, field);
+	g_string_append_c(data, '\0');
+}/*}}}*/
+static void archive_toc_append_number(GString *data, gint64 number) {/*{{{*/
+	g_string_append_printf(data, "%" G_GINT64_FORMAT, number);
+	g_string_append_c(data, '\0');
+}/*}}}*/
+
+static gint archive_toc_cache_file_compare(gconstpointer a, gconstpointer b) {/*{{{*/
+	// Most recently used first
+	time_t mtime_a = ((const archive_toc_cache_file_t *)a)->mtime;
+	time_t mtime_b = ((const archive_toc_cache_file_t *)b)->mtime;
+	return mtime_a < mtime_b ? 1 : (mtime_a > mtime_b ? -1 : 0);
+}/*}}}*/
+static void archive_toc_prune(const gchar *cache_directory) {/*{{{*/
+	// Remove cache files that have not been used for a while, and the least
+	// recently used ones beyond ARCHIVE_TOC_MAX_FILES. Loading a cache file
+	// updates its mtime.
+	GDir *dir = g_dir_open(cache_directory, 0, NULL);
+	if(!dir) {
+		return;
+	}
+
+	GArray *cache_files = g_array_new(FALSE, FALSE, sizeof(archive_toc_cache_file_t));
+	const gchar *name;
+	while((name = g_dir_read_name(dir))) {
+		if(!g_str_has_suffix(name, ".toc")) {
+			continue;
+		}
+		archive_toc_cache_file_t cache_file;
+		cache_file.file_name = g_build_filename(cache_directory, name, NULL);
+		GStatBuf cache_file_stat;
+		if(g_stat(cache_file.file_name, &cache_file_stat) != 0) {
+			g_free(cache_file.file_name);
+			continue;
+		}
+		cache_file.mtime = cache_file_stat.st_mtime;
+		g_array_append_val(cache_files, cache_file);
+	}
+	g_dir_close(dir);
+
+	g_array_sort(cache_files, archive_toc_cache_file_compare);
+	time_t now = time(NULL);
+	for(guint i=0; i<cache_files->len; i++) {
+		archive_toc_cache_file_t *cache_file = &g_array_index(cache_files, archive_toc_cache_file_t, i);
+		if(i >= ARCHIVE_TOC_MAX_FILES || now - cache_file->mtime > ARCHIVE_TOC_MAX_AGE) {
+			g_unlink(cache_file->file_name);
+		}
+		g_free(cache_file->file_name);
+	}
+	g_array_free(cache_files, TRUE);
+}/*}}}*/
+
+GPtrArray *archive_toc_load(file_t *file) {/*{{{*/
+	gchar *local_path = NULL;
+	GStatBuf file_stat;
+	gchar *cache_file_name = archive_toc_cache_file_name(file, &local_path, &file_stat);
+	if(!cache_file_name) {
+		return NULL;
+	}
+
+	gchar *data;
+	gsize data_size;
+	if(!g_file_get_contents(cache_file_name, &data, &data_size, NULL)) {
+		g_free(cache_file_name);
+		g_free(local_path);
+		return NULL;
+	}
+
+	const gchar *pos = data;
+	const gchar *end = data + data_size;
+	const gchar *magic = archive_toc_next_field(&pos, end);
+	const gchar *path = archive_toc_next_field(&pos, end);
+	const gchar *inode = archive_toc_next_field(&pos, end);
+	const gchar *size = archive_toc_next_field(&pos, end);
+	const gchar *mtime = archive_toc_next_field(&pos, end);
+	const gchar *mtime_nsec = archive_toc_next_field(&pos, end);
+
+	GPtrArray *entries = NULL;
+	if(mtime_nsec && strcmp(magic, ARCHIVE_TOC_MAGIC) == 0 && strcmp(path, local_path) == 0
+			&& g_ascii_strtoull(inode, NULL, 10) == (guint64)file_stat.st_ino
+			&& g_ascii_strtoll(size, NULL, 10) == (gint64)file_stat.st_size
+			&& g_ascii_strtoll(mtime, NULL, 10) == (gint64)file_stat.st_mtime
+			&& g_ascii_strtoll(mtime_nsec, NULL, 10) == archive_toc_mtime_nsec(&file_stat)) {
+		entries = g_ptr_array_new_with_free_func((GDestroyNotify)archive_toc_entry_free);
+
+		const gchar *entry_name;
+		while((entry_name = archive_toc_next_field(&pos, end))) {
+			const gchar *entry_size = archive_toc_next_field(&pos, end);
+			const gchar *entry_offset = archive_toc_next_field(&pos, end);
+			const gchar *entry_format = archive_toc_next_field(&pos, end);
+			if(!entry_format) {
+				// Truncated file
+				g_ptr_array_unref(entries);
+				entries = NULL;
+				break;
+			}
+			g_ptr_array_add(entries, archive_toc_entry_new(entry_name, g_ascii_strtoll(entry_size, NULL, 10), g_ascii_strtoll(entry_offset, NULL, 10), (int)g_ascii_strtoll(entry_format, NULL, 10)));
+		}
+	}
+
+	// Mark the cache file as used, see archive_toc_prune()
+	if(entries) {
+		g_utime(cache_file_name, NULL);
+	}
+
+	g_free(cache_file_name);
+	g_free(data);
+	g_free(local_path);
+	return entries;
+}/*}}}*/
+void archive_toc_store(file_t *file, GPtrArray *entries) {/*{{{*/
+	gchar *local_path = NULL;
+	GStatBuf file_stat;
+	gchar *cache_file_name = archive_toc_cache_file_name(file, &local_path, &file_stat);
+	if(!cache_file_name) {
+		return;
+	}
+
+	GString *data = g_string_new(NULL);
+	archive_toc_append_field(data, ARCHIVE_TOC_MAGIC);
+	archive_toc_append_field(data, local_path);
+	g_string_append_printf(data, "%" G_GUINT64_FORMAT, (guint64)file_stat.st_ino);
+	g_string_append_c(data, '\0');
+	archive_toc_append_number(data, file_stat.st_size);
+	archive_toc_append_number(data, file_stat.st_mtime);
+	archive_toc_append_number(data, archive_toc_mtime_nsec(&file_stat));
+	for(guint i=0; i<entries->len; i++) {
+		archive_toc_entry_t *entry = g_ptr_array_index(entries, i);
+		archive_toc_append_field(data, entry->entry_name);
+		archive_toc_append_number(data, entry->entry_size);
+		archive_toc_append_number(data, entry->entry_offset);
+		archive_toc_append_number(data, entry->entry_format);
+	}
+
+	gchar *cache_directory = g_path_get_dirname(cache_file_name);
+	if(g_mkdir_with_parents(cache_directory, 0700) == 0) {
+		// This writes to a temporary file first, so concurrent readers never
+		// see partial contents
+		g_file_set_contents(cache_file_name, data->str, data->len, NULL);
+		archive_toc_prune(cache_directory);
+	}
+
+	g_free(cache_directory);
+	g_string_free(data, TRUE);
+	g_free(cache_file_name);
+	g_free(local_path);
+}/*}}}*/
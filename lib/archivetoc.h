@@ -0,0 +1,49 @@
+/**
+ * pqiv
+ *
+ * Copyright (c) 2013-2017, Phillip Berndt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Persistent table of contents cache for the archive backends
+//
+// Listing an archive's entries requires reading all of it. The list is
+// therefore stored below the XDG cache directory, keyed by the archive's path,
+// inode, size and modification time, and reused as long as these match. Cache
+// files that have not been used for a while are removed.
+//
+
+#include "../pqiv.h"
+
+typedef struct {
+	gchar *entry_name;
+
+	// The uncompressed size of the entry, or -1 if unknown
+	gint64 entry_size;
+
+	// Where the entry's header starts, or -1, and the libarchive format of
+	// the archive, see the archive backends
+	gint64 entry_offset;
+	int entry_format;
+} archive_toc_entry_t;
+
+archive_toc_entry_t *archive_toc_entry_new(const gchar *entry_name, gint64 entry_size, gint64 entry_offset, int entry_format);
+void archive_toc_entry_free(archive_toc_entry_t *entry);
+
+// Load the cached entries of an archive, in archive order. Returns NULL if
+// there is no up to date cache file for it.
+GPtrArray *archive_toc_load(file_t *file);
+
+// Store the entries of an archive to the cache. Failures are silently ignored.
+void archive_toc_store(file_t *file, GPtrArray *entries);
@@ -0,0 +1,92 @@
+/**
+ * pqiv
+ *
+ * Copyright (c) 2013-2017, Phillip Berndt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "archivewindow.h"
+#include <string.h>
+
+typedef struct {
+	gchar *archive_name;
+	gchar *entry_name;
+	GBytes *data;
+} archive_window_entry_t;
+
+static GMutex archive_window_mutex;
+static GQueue archive_window_entries = G_QUEUE_INIT;
+static gsize archive_window_size = 0;
+
+// Maps archive names to the index of the entry loaded last, plus one
+static GHashTable *archive_window_last_access = NULL;
+
+static void archive_window_entry_free(archive_window_entry_t *entry) {/*{{{*/
+	archive_window_size -= g_bytes_get_size(entry->data);
+	g_bytes_unref(entry->data);
+	g_free(entry->archive_name);
+	g_free(entry->entry_name);
+	g_slice_free(archive_window_entry_t, entry);
+}/*}}}*/
+
+gboolean archive_window_access(const gchar *archive_name, guint entry_index) {/*{{{*/
+	g_mutex_lock(&archive_window_mutex);
+	if(!archive_window_last_access) {
+		archive_window_last_access = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+
+	// Preloading may load the previous page after the current one, so anything
+	// behind the last access counts as forward, not only its successor
+	gpointer last_access = NULL;
+	gboolean is_forward = g_hash_table_lookup_extended(archive_window_last_access, archive_name, NULL, &last_access) && entry_index + 1 > GPOINTER_TO_UINT(last_access);
+	g_hash_table_insert(archive_window_last_access, g_strdup(archive_name), GUINT_TO_POINTER(entry_index + 1));
+
+	g_mutex_unlock(&archive_window_mutex);
+	return is_forward;
+}/*}}}*/
+void archive_window_store(const gchar *archive_name, const gchar *entry_name, GBytes *data) {/*{{{*/
+	if(g_bytes_get_size(data) > ARCHIVE_WINDOW_BUDGET) {
+		g_bytes_unref(data);
+		return;
+	}
+
+	archive_window_entry_t *entry = g_slice_new(archive_window_entry_t);
+	entry->archive_name = g_strdup(archive_name);
+	entry->entry_name = g_strdup(entry_name);
+	entry->data = data;
+
+	g_mutex_lock(&archive_window_mutex);
+	archive_window_size += g_bytes_get_size(data);
+	g_queue_push_tail(&archive_window_entries, entry);
+	while(archive_window_size > ARCHIVE_WINDOW_BUDGET || archive_window_entries.length > ARCHIVE_WINDOW_ENTRIES * 2) {
+		archive_window_entry_free(g_queue_pop_head(&archive_window_entries));
+	}
+	g_mutex_unlock(&archive_window_mutex);
+}/*}}}*/
+GBytes *archive_window_take(const gchar *archive_name, const gchar *entry_name) {/*{{{*/
+	GBytes *retval = NULL;
+
+	g_mutex_lock(&archive_window_mutex);
+	for(GList *iter = archive_window_entries.head; iter; iter = g_list_next(iter)) {
+		archive_window_entry_t *entry = iter->data;
+		if(strcmp(entry->entry_name, entry_name) == 0 && strcmp(entry->archive_name, archive_name) == 0) {
+			retval = g_bytes_ref(entry->data);
+			g_queue_delete_link(&archive_window_entries, iter);
+			archive_window_entry_free(entry);
+			break;
+		}
+	}
+	g_mutex_unlock(&archive_window_mutex);
+
+	return retval;
+}/*}}}*/
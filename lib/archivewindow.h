@@ -0,0 +1,43 @@
+/**
+ * pqiv
+ *
+ * Copyright (c) 2013-2017, Phillip Berndt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Sequential read window for the archive backends
+//
+// In solid or compressed-stream archives, extracting an entry means
+// decompressing everything in front of it. When pages are read front to back,
+// the backends extract a few upcoming entries in the same pass and keep them
+// here until they are requested.
+//
+
+#include "../pqiv.h"
+
+// How many entries to extract ahead, and how many bytes to keep at most
+#define ARCHIVE_WINDOW_ENTRIES 16
+#define ARCHIVE_WINDOW_BUDGET (64 * 1024 * 1024)
+
+// Record that an archive's entry_index-th entry is being loaded. Returns TRUE
+// if this continues reading the archive forward.
+gboolean archive_window_access(const gchar *archive_name, guint entry_index);
+
+// Keep the contents of an entry, evicting the oldest ones if over budget.
+// Takes ownership of data.
+void archive_window_store(const gchar *archive_name, const gchar *entry_name, GBytes *data);
+
+// Remove an entry's contents from the window and return them, or NULL if they
+// are not available.
+GBytes *archive_window_take(const gchar *archive_name, const gchar *entry_name);
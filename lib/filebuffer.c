@@ -32,19 +32,62 @@
 #include <sys/mman.h>
 #endif
 
+// Buffers are distributed over several independently locked tables, by file
+// name, such that threads working on different files rarely contend
+#define FILE_BUFFER_SHARDS 16
+
+// Unused buffers are kept for reuse until either limit is exceeded. Memory
+// mappings do not count towards the byte budget, because their pages are
+// the kernel's to drop.
+#define FILE_BUFFER_CACHE_BUDGET (128 * 1024 * 1024)
+#define FILE_BUFFER_CACHE_MAX_ENTRIES 32
+
+// Mapped files up to this size are read ahead as a whole
+#define FILE_BUFFER_WILLNEED_LIMIT (64 * 1024 * 1024)
+
 struct buffered_file {
 	GBytes *data;
 	char *file_name;
 	int ref_count;
 	gboolean file_name_is_temporary;
+	gboolean data_is_mapped;
+
+	// Set while the thread that created the buffer reads the file, outside of
+	// the lock. Other threads wait for the shard's loaded condition.
+	gboolean is_loading;
+	gboolean load_failed;
+
+	// Set if the buffer must not be kept once it is unused
+	gboolean is_stale;
+
+	// The state of a local file when it was read, to tell whether a kept
+	// buffer is still up to date
+	gboolean has_file_stat;
+	GStatBuf file_stat;
+
+	// Position in file_buffer_cache, if unused and kept. Changed only with
+	// both the shard's lock and file_buffer_cache_mutex held.
+	GList *cache_link;
 };
 
-GHashTable *file_buffer_table = NULL;
-GRecMutex file_buffer_table_mutex;
+struct buffered_file_shard {
+	GMutex lock;
+	GCond loaded;
+	GHashTable *table;
+};
+
+static struct buffered_file_shard file_buffer_shards[FILE_BUFFER_SHARDS];
+
+// Keys of the unused buffers, least recently used first. Lock this after
+// the lock of a shard, never before.
+static GMutex file_buffer_cache_mutex;
+static GQueue file_buffer_cache = G_QUEUE_INIT;
+static gsize file_buffer_cache_size = 0;
 
-#ifdef HAS_MMAP
 extern GFile *gfile_for_commandline_arg(const char *);
 
+#ifdef HAS_MMAP
+
 struct buffered_file_mmap_info {
 	void *ptr;
 	int fd;
@@ -58,114 +101,264 @@ static void buffered_file_mmap_free_helper(struct buffered_file_mmap_info *info)
 }
 #endif
 
-GBytes *buffered_file_as_bytes(file_t *file, GInputStream *data, GError **error_pointer) {
-	g_rec_mutex_lock(&file_buffer_table_mutex);
-	if(!file_buffer_table) {
-		file_buffer_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+static struct buffered_file_shard *buffered_file_shard_lock(const char *file_name) {
+	struct buffered_file_shard *shard = &file_buffer_shards[g_str_hash(file_name) % FILE_BUFFER_SHARDS];
+	g_mutex_lock(&shard->lock);
+	if(!shard->table) {
+		shard->table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 	}
-	struct buffered_file *buffer = g_hash_table_lookup(file_buffer_table, file->file_name);
-	if(!buffer) {
-		GBytes *data_bytes = NULL;
+	return shard;
+}
 
-		if((file->file_flags & FILE_FLAGS_MEMORY_IMAGE)) {
-			if(file->file_data_loader) {
-				data_bytes = file->file_data_loader(file, error_pointer);
-			}
-			else {
-				data_bytes = g_bytes_ref(file->file_data);
+static gboolean buffered_file_stat(file_t *file, GStatBuf *file_stat) {
+	// stat() the file behind a file_t, if it is a local one
+	if((file->file_flags & FILE_FLAGS_MEMORY_IMAGE)) {
+		return FALSE;
+	}
+	GFile *input_file = gfile_for_commandline_arg(file->file_name);
+	char *path = g_file_get_path(input_file);
+	g_object_unref(input_file);
+	if(!path) {
+		return FALSE;
+	}
+	gboolean success = g_stat(path, file_stat) == 0;
+	g_free(path);
+	return success;
+}
+
+static gboolean buffered_file_stat_changed(GStatBuf *a, GStatBuf *b) {
+	return a->st_dev != b->st_dev || a->st_ino != b->st_ino || a->st_size != b->st_size || a->st_mtime != b->st_mtime;
+}
+
+static gsize buffered_file_cache_cost(struct buffered_file *buffer) {
+	return buffer->data && !buffer->data_is_mapped ? g_bytes_get_size(buffer->data) : 0;
+}
+
+static void buffered_file_cache_remove(struct buffered_file *buffer) {
+	// Must be called with file_buffer_cache_mutex held
+	g_queue_delete_link(&file_buffer_cache, buffer->cache_link);
+	buffer->cache_link = NULL;
+	file_buffer_cache_size -= buffered_file_cache_cost(buffer);
+}
+
+static void buffered_file_free(struct buffered_file_shard *shard, const char *key, struct buffered_file *buffer) {
+	// Must be called with the shard's lock held
+	if(buffer->data) {
+		g_bytes_unref(buffer->data);
+	}
+	if(buffer->file_name) {
+		if(buffer->file_name_is_temporary) {
+			g_unlink(buffer->file_name);
+		}
+		g_free(buffer->file_name);
+	}
+	g_hash_table_remove(shard->table, key);
+}
+
+static void buffered_file_cache_trim() {
+	// Evict unused buffers until the cache is within its limits. This may
+	// not hold file_buffer_cache_mutex while taking a shard's lock, so it
+	// looks the oldest entry up again and skips it if it has been reused
+	// in the meantime.
+	while(TRUE) {
+		g_mutex_lock(&file_buffer_cache_mutex);
+		if(file_buffer_cache.length == 0 || (file_buffer_cache_size <= FILE_BUFFER_CACHE_BUDGET && file_buffer_cache.length <= FILE_BUFFER_CACHE_MAX_ENTRIES)) {
+			g_mutex_unlock(&file_buffer_cache_mutex);
+			return;
+		}
+		char *file_name = g_strdup(g_queue_peek_head(&file_buffer_cache));
+		g_mutex_unlock(&file_buffer_cache_mutex);
+
+		struct buffered_file_shard *shard = buffered_file_shard_lock(file_name);
+		char *key;
+		struct buffered_file *buffer;
+		if(g_hash_table_lookup_extended(shard->table, file_name, (gpointer *)&key, (gpointer *)&buffer)) {
+			g_mutex_lock(&file_buffer_cache_mutex);
+			gboolean is_cached = buffer->cache_link != NULL;
+			if(is_cached) {
+				buffered_file_cache_remove(buffer);
 			}
+			g_mutex_unlock(&file_buffer_cache_mutex);
 
-			if(!data_bytes) {
-				g_rec_mutex_unlock(&file_buffer_table_mutex);
-				return NULL;
+			if(is_cached) {
+				buffered_file_free(shard, key, buffer);
 			}
 		}
-		else {
+		g_mutex_unlock(&shard->lock);
+		g_free(file_name);
+	}
+}
 
-#ifdef HAS_MMAP
-			// If this is a local file, try to mmap() it first instead of loading it completely
-			GFile *input_file = gfile_for_commandline_arg(file->file_name);
-			char *input_file_abspath = g_file_get_path(input_file);
-			if(input_file_abspath) {
-				GFileInfo *file_info = g_file_query_info(input_file, G_FILE_ATTRIBUTE_STANDARD_SIZE, G_FILE_QUERY_INFO_NONE, NULL, error_pointer);
-				if(!file_info) {
-					g_object_unref(input_file);
-					g_rec_mutex_unlock(&file_buffer_table_mutex);
-					return NULL;
-				}
-				goffset input_file_size = g_file_info_get_size(file_info);
-				g_object_unref(file_info);
-
-				int fd = open(input_file_abspath, O_RDONLY);
-				g_free(input_file_abspath);
-				if(fd < 0) {
-					g_object_unref(input_file);
-					g_rec_mutex_unlock(&file_buffer_table_mutex);
-					*error_pointer = g_error_new(g_quark_from_static_string("pqiv-filebuffer-error"), 1, "Opening the file failed with errno=%d: %s", errno, strerror(errno));
-					return NULL;
-				}
-				void *input_file_data = mmap(NULL, input_file_size, PROT_READ, MAP_SHARED, fd, 0);
+static struct buffered_file *buffered_file_acquire(file_t *file, struct buffered_file_shard **shard_pointer) {
+	// Return a referenced buffer for a file. If it has is_loading set, the
+	// caller must fill it and call buffered_file_finish_load.
+	struct buffered_file_shard *shard = buffered_file_shard_lock(file->file_name);
+	*shard_pointer = shard;
 
-				if(input_file_data != MAP_FAILED) {
-					struct buffered_file_mmap_info *mmap_info = g_slice_new(struct buffered_file_mmap_info);
-					mmap_info->ptr = input_file_data;
-					mmap_info->fd = fd;
-					mmap_info->size = input_file_size;
+	GStatBuf file_stat;
+	gboolean has_file_stat = FALSE;
 
-					data_bytes = g_bytes_new_with_free_func(input_file_data, input_file_size, (GDestroyNotify)buffered_file_mmap_free_helper, mmap_info);
-				}
-				else {
-					close(fd);
+	while(TRUE) {
+		char *key;
+		struct buffered_file *buffer;
+		if(!g_hash_table_lookup_extended(shard->table, file->file_name, (gpointer *)&key, (gpointer *)&buffer)) {
+			buffer = g_new0(struct buffered_file, 1);
+			buffer->ref_count = 1;
+			buffer->is_loading = TRUE;
+			g_hash_table_insert(shard->table, g_strdup(file->file_name), buffer);
+			g_mutex_unlock(&shard->lock);
+			return buffer;
+		}
+
+		if(buffer->cache_link && buffer->has_file_stat) {
+			// The file might have changed since the unused buffer was read.
+			// Check without holding the lock, then look the buffer up again.
+			if(!has_file_stat) {
+				g_mutex_unlock(&shard->lock);
+				if(!buffered_file_stat(file, &file_stat)) {
+					memset(&file_stat, 0, sizeof(file_stat));
 				}
+				has_file_stat = TRUE;
+				g_mutex_lock(&shard->lock);
+				continue;
 			}
-			g_object_unref(input_file);
-#endif
+			if(buffered_file_stat_changed(&buffer->file_stat, &file_stat)) {
+				g_mutex_lock(&file_buffer_cache_mutex);
+				buffered_file_cache_remove(buffer);
+				g_mutex_unlock(&file_buffer_cache_mutex);
+				buffered_file_free(shard, key, buffer);
+				continue;
+			}
+		}
 
-			if(data_bytes) {
-				// mmap() above worked
+		buffer->ref_count++;
+		if(buffer->cache_link) {
+			// The buffer is in use again
+			g_mutex_lock(&file_buffer_cache_mutex);
+			buffered_file_cache_remove(buffer);
+			g_mutex_unlock(&file_buffer_cache_mutex);
+		}
+
+		while(buffer->is_loading) {
+			g_cond_wait(&shard->loaded, &shard->lock);
+		}
+
+		if(!buffer->load_failed) {
+			g_mutex_unlock(&shard->lock);
+			return buffer;
+		}
+
+		// Loading failed in the other thread, and the buffer has been removed
+		// from the table. Try again.
+		if(--buffer->ref_count == 0) {
+			g_free(buffer);
+		}
+	}
+}
+
+static void buffered_file_finish_load(struct buffered_file_shard *shard, file_t *file, struct buffered_file *buffer, gboolean success) {
+	g_mutex_lock(&shard->lock);
+	buffer->is_loading = FALSE;
+	if(!success) {
+		buffer->load_failed = TRUE;
+
+		// Waiting threads still reference the buffer, so only the key is freed
+		char *key;
+		g_hash_table_lookup_extended(shard->table, file->file_name, (gpointer *)&key, NULL);
+		g_hash_table_steal(shard->table, file->file_name);
+		g_free(key);
+		if(--buffer->ref_count == 0) {
+			g_free(buffer);
+		}
+	}
+	g_cond_broadcast(&shard->loaded);
+	g_mutex_unlock(&shard->lock);
+}
+
+static GBytes *buffered_file_read_bytes(file_t *file, GInputStream *data, gboolean *data_is_mapped, GError **error_pointer) {
+	GBytes *data_bytes = NULL;
+
+	if((file->file_flags & FILE_FLAGS_MEMORY_IMAGE)) {
+		if(file->file_data_loader) {
+			data_bytes = file->file_data_loader(file, error_pointer);
+		}
+		else {
+			data_bytes = g_bytes_ref(file->file_data);
+		}
+
+		if(!data_bytes) {
+			return NULL;
+		}
+	}
+	else {
+
+#ifdef HAS_MMAP
+		// If this is a local file, try to mmap() it first instead of loading it completely
+		GFile *input_file = gfile_for_commandline_arg(file->file_name);
+		char *input_file_abspath = g_file_get_path(input_file);
+		if(input_file_abspath) {
+			GFileInfo *file_info = g_file_query_info(input_file, G_FILE_ATTRIBUTE_STANDARD_SIZE, G_FILE_QUERY_INFO_NONE, NULL, error_pointer);
+			if(!file_info) {
+				g_object_unref(input_file);
+				return NULL;
 			}
-			else if(!data) {
-				data = image_loader_stream_file(file, error_pointer);
-				if(!data) {
-					g_rec_mutex_unlock(&file_buffer_table_mutex);
-					return NULL;
+			goffset input_file_size = g_file_info_get_size(file_info);
+			g_object_unref(file_info);
+
+			int fd = open(input_file_abspath, O_RDONLY);
+			g_free(input_file_abspath);
+			if(fd < 0) {
+				g_object_unref(input_file);
+				*error_pointer = g_error_new(g_quark_from_static_string("pqiv-filebuffer-error"), 1, "Opening the file failed with errno=%d: %s", errno, strerror(errno));
+				return NULL;
+			}
+			void *input_file_data = mmap(NULL, input_file_size, PROT_READ, MAP_SHARED, fd, 0);
+
+			if(input_file_data != MAP_FAILED) {
+				struct buffered_file_mmap_info *mmap_info = g_slice_new(struct buffered_file_mmap_info);
+				mmap_info->ptr = input_file_data;
+				mmap_info->fd = fd;
+				mmap_info->size = input_file_size;
+
+				data_bytes = g_bytes_new_with_free_func(input_file_data, input_file_size, (GDestroyNotify)buffered_file_mmap_free_helper, mmap_info);
+				*data_is_mapped = TRUE;
+
+				// Backends usually read files front to back, and right away
+				posix_madvise(input_file_data, input_file_size, POSIX_MADV_SEQUENTIAL);
+				if(input_file_size <= FILE_BUFFER_WILLNEED_LIMIT) {
+					posix_madvise(input_file_data, input_file_size, POSIX_MADV_WILLNEED);
 				}
-				data_bytes = g_input_stream_read_completely(data, image_loader_cancellable, error_pointer);
-				g_object_unref(data);
 			}
 			else {
-				data_bytes = g_input_stream_read_completely(data, image_loader_cancellable, error_pointer);
+				close(fd);
 			}
+		}
+		g_object_unref(input_file);
+#endif
 
-			if(!data_bytes) {
-				g_rec_mutex_unlock(&file_buffer_table_mutex);
+		if(data_bytes) {
+			// mmap() above worked
+		}
+		else if(!data) {
+			data = image_loader_stream_file(file, error_pointer);
+			if(!data) {
 				return NULL;
 			}
+			data_bytes = g_input_stream_read_completely(data, image_loader_cancellable, error_pointer);
+			g_object_unref(data);
+		}
+		else {
+			data_bytes = g_input_stream_read_completely(data, image_loader_cancellable, error_pointer);
 		}
-		buffer = g_new0(struct buffered_file, 1);
-		g_hash_table_insert(file_buffer_table, g_strdup(file->file_name), buffer);
-		buffer->data = data_bytes;
-	}
-	buffer->ref_count++;
-	g_rec_mutex_unlock(&file_buffer_table_mutex);
-	return buffer->data;
-}
 
-char *buffered_file_as_local_file(file_t *file, GInputStream *data, GError **error_pointer) {
-	g_rec_mutex_lock(&file_buffer_table_mutex);
-	if(!file_buffer_table) {
-		file_buffer_table = g_hash_table_new(g_str_hash, g_str_equal);
-	}
-	struct buffered_file *buffer = g_hash_table_lookup(file_buffer_table, file->file_name);
-	if(buffer) {
-		buffer->ref_count++;
-		g_rec_mutex_unlock(&file_buffer_table_mutex);
-		return buffer->file_name;
+		if(!data_bytes) {
+			return NULL;
+		}
 	}
+	return data_bytes;
+}
 
-	buffer = g_new0(struct buffered_file, 1);
-	g_hash_table_insert(file_buffer_table, g_strdup(file->file_name), buffer);
-
+static gboolean buffered_file_make_local(file_t *file, GInputStream *data, struct buffered_file *buffer, GError **error_pointer) {
 	gchar *path = NULL;
 	if(!(file->file_flags & FILE_FLAGS_MEMORY_IMAGE)) {
 		GFile *input_file = g_file_new_for_commandline_arg(file->file_name);
@@ -181,9 +374,7 @@ char *buffered_file_as_local_file(file_t *file, GInputStream *data, GError **err
 		if(!data) {
 			data = image_loader_stream_file(file, error_pointer);
 			if(!data) {
-				g_hash_table_remove(file_buffer_table, file->file_name);
-				g_rec_mutex_unlock(&file_buffer_table_mutex);
-				return NULL;
+				return FALSE;
 			}
 			local_data = TRUE;
 		}
@@ -204,18 +395,14 @@ char *buffered_file_as_local_file(file_t *file, GInputStream *data, GError **err
 			if(local_data) {
 				g_object_unref(data);
 			}
-			g_hash_table_remove(file_buffer_table, file->file_name);
-			g_rec_mutex_unlock(&file_buffer_table_mutex);
-			return NULL;
+			return FALSE;
 		}
 
 		if(g_output_stream_splice(g_io_stream_get_output_stream(G_IO_STREAM(iostream)), data, G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, image_loader_cancellable, error_pointer) < 0) {
-			g_hash_table_remove(file_buffer_table, file->file_name);
 			if(local_data) {
 				g_object_unref(data);
 			}
-			g_rec_mutex_unlock(&file_buffer_table_mutex);
-			return NULL;
+			return FALSE;
 		}
 
 		buffer->file_name = g_file_get_path(temporary_file);
@@ -228,29 +415,135 @@ char *buffered_file_as_local_file(file_t *file, GInputStream *data, GError **err
 		}
 	}
 
-	buffer->ref_count++;
-	g_rec_mutex_unlock(&file_buffer_table_mutex);
+	return TRUE;
+}
+
+GBytes *buffered_file_as_bytes(file_t *file, GInputStream *data, GError **error_pointer) {
+	struct buffered_file_shard *shard;
+	struct buffered_file *buffer = buffered_file_acquire(file, &shard);
+	if(buffer->is_loading) {
+		// The file is read without holding a lock, such that slow reads do
+		// not block other threads. It is stat()ed before, such that changes
+		// while reading are noticed later.
+		buffer->has_file_stat = buffered_file_stat(file, &buffer->file_stat);
+		GBytes *data_bytes = buffered_file_read_bytes(file, data, &buffer->data_is_mapped, error_pointer);
+		buffer->data = data_bytes;
+		buffered_file_finish_load(shard, file, buffer, data_bytes != NULL);
+		return data_bytes;
+	}
+	return buffer->data;
+}
+
+char *buffered_file_as_local_file(file_t *file, GInputStream *data, GError **error_pointer) {
+	struct buffered_file_shard *shard;
+	struct buffered_file *buffer = buffered_file_acquire(file, &shard);
+	if(buffer->is_loading) {
+		// See buffered_file_as_bytes
+		gboolean success = buffered_file_make_local(file, data, buffer, error_pointer);
+		char *file_name = buffer->file_name;
+		buffered_file_finish_load(shard, file, buffer, success);
+		return success ? file_name : NULL;
+	}
 	return buffer->file_name;
 }
 
 void buffered_file_unref(file_t *file) {
-	g_rec_mutex_lock(&file_buffer_table_mutex);
-	struct buffered_file *buffer = g_hash_table_lookup(file_buffer_table, file->file_name);
-	if(!buffer) {
-		g_rec_mutex_unlock(&file_buffer_table_mutex);
+	struct buffered_file_shard *shard = buffered_file_shard_lock(file->file_name);
+	char *key;
+	struct buffered_file *buffer;
+	if(!g_hash_table_lookup_extended(shard->table, file->file_name, (gpointer *)&key, (gpointer *)&buffer)) {
+		g_mutex_unlock(&shard->lock);
 		return;
 	}
+
+	gboolean trim_cache = FALSE;
 	if(--buffer->ref_count == 0) {
-		if(buffer->data) {
-			g_bytes_unref(buffer->data);
+		if(buffer->data && !buffer->is_stale) {
+			// Keep the data around, such that switching between the pages
+			// of a multi-page file does not read it again
+			g_mutex_lock(&file_buffer_cache_mutex);
+			g_queue_push_tail(&file_buffer_cache, key);
+			buffer->cache_link = file_buffer_cache.tail;
+			file_buffer_cache_size += buffered_file_cache_cost(buffer);
+			g_mutex_unlock(&file_buffer_cache_mutex);
+			trim_cache = TRUE;
 		}
-		if(buffer->file_name) {
-			if(buffer->file_name_is_temporary) {
-				g_unlink(buffer->file_name);
-			}
-			g_free(buffer->file_name);
+		else {
+			buffered_file_free(shard, key, buffer);
+		}
+	}
+	g_mutex_unlock(&shard->lock);
+
+	if(trim_cache) {
+		buffered_file_cache_trim();
+	}
+}
+
+void buffered_file_invalidate(file_t *file) {
+	struct buffered_file_shard *shard = buffered_file_shard_lock(file->file_name);
+	char *key;
+	struct buffered_file *buffer;
+	if(g_hash_table_lookup_extended(shard->table, file->file_name, (gpointer *)&key, (gpointer *)&buffer)) {
+		g_mutex_lock(&file_buffer_cache_mutex);
+		gboolean is_cached = buffer->cache_link != NULL;
+		if(is_cached) {
+			buffered_file_cache_remove(buffer);
 		}
-		g_hash_table_remove(file_buffer_table, file->file_name);
+		g_mutex_unlock(&file_buffer_cache_mutex);
+
+		if(is_cached) {
+			buffered_file_free(shard, key, buffer);
+		}
+		else {
+			buffer->is_stale = TRUE;
+		}
+	}
+	g_mutex_unlock(&shard->lock);
+}
+
+#if defined(HAS_MMAP) && defined(POSIX_FADV_WILLNEED)
+// Opening a file can block for a long time on network file systems, hence
+// read ahead hints are issued from a separate thread
+#define FILE_BUFFER_READAHEAD_MAX_PENDING 32
+
+G_LOCK_DEFINE_STATIC(file_buffer_readahead_pool);
+static GThreadPool *file_buffer_readahead_pool = NULL;
+
+static void buffered_file_readahead_worker(gpointer path, gpointer user_data) {
+	int fd = open((char *)path, O_RDONLY);
+	if(fd >= 0) {
+		posix_fadvise(fd, 0, FILE_BUFFER_WILLNEED_LIMIT, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+	g_free(path);
+}
+#endif
+
+void buffered_file_readahead(file_t *file) {
+#if defined(HAS_MMAP) && defined(POSIX_FADV_WILLNEED)
+	if((file->file_flags & FILE_FLAGS_MEMORY_IMAGE)) {
+		return;
 	}
-	g_rec_mutex_unlock(&file_buffer_table_mutex);
+
+	GFile *input_file = gfile_for_commandline_arg(file->file_name);
+	char *path = g_file_get_path(input_file);
+	g_object_unref(input_file);
+	if(!path) {
+		return;
+	}
+
+	G_LOCK(file_buffer_readahead_pool);
+	if(!file_buffer_readahead_pool) {
+		file_buffer_readahead_pool = g_thread_pool_new(buffered_file_readahead_worker, NULL, 1, FALSE, NULL);
+	}
+	G_UNLOCK(file_buffer_readahead_pool);
+
+	// Hints are only useful while the user is still close to the file; do
+	// not let them pile up when skipping through a large list quickly
+	if(!file_buffer_readahead_pool || g_thread_pool_unprocessed(file_buffer_readahead_pool) >= FILE_BUFFER_READAHEAD_MAX_PENDING) {
+		g_free(path);
+		return;
+	}
+	g_thread_pool_push(file_buffer_readahead_pool, path, NULL);
+#endif
 }
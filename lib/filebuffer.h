@@ -33,6 +33,14 @@ GBytes *buffered_file_as_bytes(file_t *file, GInputStream *data, GError **error_
 // Return a (possibly temporary) file for a file_t
 char *buffered_file_as_local_file(file_t *file, GInputStream *data, GError **error_pointer);
 
-// Unreference one of the above, free'ing memory if
-// necessary
+// Unreference one of the above. Unused in-memory buffers are kept for a while,
+// within a fixed memory budget, in case they are needed again
 void buffered_file_unref(file_t *file);
+
+// Do not reuse the buffer of a file once it is unused, e.g. because the file
+// has changed on disk
+void buffered_file_invalidate(file_t *file);
+
+// Ask the kernel to read a local file into the page cache in the background,
+// because it is likely to be loaded soon. Does not keep a buffer.
+void buffered_file_readahead(file_t *file);
@@ -0,0 +1,83 @@
+/**
+ * pqiv
+ *
+ * Copyright (c) 2013-2014, Phillip Berndt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "zipindex.h"
+#include <string.h>
+
+#define ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE 0x06054b50
+#define ZIP_END_OF_CENTRAL_DIRECTORY_SIZE 22
+#define ZIP_CENTRAL_DIRECTORY_HEADER_SIGNATURE 0x02014b50
+#define ZIP_CENTRAL_DIRECTORY_HEADER_SIZE 46
+
+static guint16 zip_index_read_u16(const guchar *data) {/*{{{*/
+	return (guint16)data[0] | (guint16)data[1] << 8;
+}/*}}}*/
+static guint32 zip_index_read_u32(const guchar *data) {/*{{{*/
+	return (guint32)data[0] | (guint32)data[1] << 8 | (guint32)data[2] << 16 | (guint32)data[3] << 24;
+}/*}}}*/
+
+GHashTable *zip_index_from_central_directory(const guchar *data, gsize size) {/*{{{*/
+	if(size < ZIP_END_OF_CENTRAL_DIRECTORY_SIZE) {
+		return NULL;
+	}
+
+	// The end of central directory record is at the very end of the file,
+	// followed only by a comment of at most 64 KiB
+	gsize end_record = size - ZIP_END_OF_CENTRAL_DIRECTORY_SIZE;
+	gsize search_limit = end_record > 0xffff ? end_record - 0xffff : 0;
+	while(zip_index_read_u32(data + end_record) != ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+		if(end_record == search_limit) {
+			return NULL;
+		}
+		end_record--;
+	}
+
+	guint16 entries = zip_index_read_u16(data + end_record + 10);
+	guint32 directory_size = zip_index_read_u32(data + end_record + 12);
+	guint32 directory_offset = zip_index_read_u32(data + end_record + 16);
+	if(entries == 0xffff || directory_offset == 0xffffffff || (gsize)directory_offset + directory_size > end_record) {
+		return NULL;
+	}
+
+	// Offsets are relative to the start of the archive, which need not be the
+	// start of the file (e.g. for self-extracting archives)
+	gsize shift = end_record - directory_size - directory_offset;
+
+	GHashTable *index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	gsize position = directory_offset + shift;
+	for(guint i=0; i<entries; i++) {
+		if(position + ZIP_CENTRAL_DIRECTORY_HEADER_SIZE > end_record || zip_index_read_u32(data + position) != ZIP_CENTRAL_DIRECTORY_HEADER_SIGNATURE) {
+			break;
+		}
+		guint16 name_length = zip_index_read_u16(data + position + 28);
+		guint16 extra_length = zip_index_read_u16(data + position + 30);
+		guint16 comment_length = zip_index_read_u16(data + position + 32);
+		guint32 local_header_offset = zip_index_read_u32(data + position + 42);
+		if(position + ZIP_CENTRAL_DIRECTORY_HEADER_SIZE + name_length > end_record) {
+			break;
+		}
+
+		if(local_header_offset != 0xffffffff) {
+			gchar *name = g_strndup((const gchar *)data + position + ZIP_CENTRAL_DIRECTORY_HEADER_SIZE, name_length);
+			g_hash_table_insert(index, name, GSIZE_TO_POINTER(local_header_offset + shift));
+		}
+
+		position += ZIP_CENTRAL_DIRECTORY_HEADER_SIZE + name_length + extra_length + comment_length;
+	}
+
+	return index;
+}/*}}}*/
@@ -0,0 +1,32 @@
+/**
+ * pqiv
+ *
+ * Copyright (c) 2013-2014, Phillip Berndt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Random access into ZIP files for the archive backends
+//
+// libarchive reads archives front to back, so finding an entry means walking
+// all headers before it. The central directory of a ZIP file lists where each
+// entry's local header is; reading can start right there.
+//
+
+#include "../pqiv.h"
+
+// Parse the central directory of an in-memory ZIP file. Returns a table
+// mapping entry names to the offsets of their local headers (use
+// GPOINTER_TO_SIZE on the values), or NULL if the file has no usable
+// central directory. ZIP64 archives are not supported.
+GHashTable *zip_index_from_central_directory(const guchar *data, gsize size);
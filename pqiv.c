@@ -23,6 +23,7 @@
 #include "lib/config_parser.h"
 #include "lib/thumbnailcache.h"
 #include "lib/strnatcmp.h"
+#include "lib/filebuffer.h"
 #include <cairo/cairo.h>
 #include <gio/gio.h>
 #include <glib/gstdio.h>
@@ -150,6 +151,7 @@ gboolean file_tree_valid = FALSE;
 struct image_loader_queue_item {
 	BOSNode *node_ref;
 	int purpose;
+	double scale_level;
 };
 GAsyncQueue *image_loader_queue = NULL;
 GCancellable *image_loader_cancellable = NULL;
@@ -226,6 +228,19 @@ cairo_surface_t *last_visible_surface = NULL;
 cairo_surface_t *fading_surface = NULL;
 cairo_surface_t *current_scaled_image_surface = NULL;
 
+// The scaled image surface the image loader has last been asked to render in
+// the background. node is not a reference, it is only compared against.
+struct {
+	BOSNode *node;
+	int width;
+	int height;
+	gboolean done;
+} prerender_request = { NULL, 0, 0, FALSE };
+
+// While the user resizes the window, we only display a rescaled prerender,
+// and request a proper render once the size has settled.
+guint window_resize_settle_timeout_id = 0;
+
 #if !defined(CONFIGURED_WITHOUT_INFO_TEXT) || !defined(CONFIGURED_WITHOUT_MONTAGE_MODE)
 struct {
 	double fg_red;
@@ -240,6 +255,28 @@ struct {
 gint current_info_text_cached_font_size = -1;
 gchar *current_info_text = NULL;
 cairo_rectangle_int_t current_info_text_bounding_box = { 0, 0, 0, 0 };
+
+// The rendered info box, such that redraws need no text layout. Valid as long
+// as text and font_size match current_info_text{,_cached_font_size}. x and y
+// are the offset of the surface relative to the text origin.
+struct {
+	cairo_surface_t *surface;
+	gchar *text;
+	gint font_size;
+	int x;
+	int y;
+	int text_width;
+	int text_height;
+} info_text_cache = { NULL, NULL, -1, 0, 0, 0, 0 };
+#endif
+#if !defined(CONFIGURED_WITHOUT_MONTAGE_MODE) && !defined(CONFIGURED_WITHOUT_ACTIONS)
+// Rendered key binding labels for montage mode's follow mode, by label
+typedef struct {
+	cairo_surface_t *surface;
+	double x;
+	double y;
+} montage_binding_overlay_t;
+GHashTable *montage_binding_overlay_cache = NULL;
 #endif
 
 
@@ -252,7 +289,57 @@ gint current_shift_y = 0;
 guint32 last_button_press_time = 0;
 guint32 last_button_release_time = 0;
 guint current_image_animation_timeout_id = 0;
+gint64 current_image_animation_due_time = 0;
 gdouble current_image_animation_speed_scale = 1.0;
+// Pending seek, and whether to continue playback once it has finished
+guint current_image_animation_seek_timeout_id = 0;
+gboolean current_image_animation_seek_resume = FALSE;
+
+// If animation playback falls behind by more than this many microseconds
+// (e.g. because the window was hidden), restart the schedule instead of
+// dropping frames to catch up
+#define ANIMATION_MAX_LAG 250000
+
+// Upper bound for the number of frames dropped at once, such that the file
+// is not locked for long while catching up
+#define ANIMATION_MAX_DROPPED_FRAMES 8
+
+#if GTK_CHECK_VERSION(3, 8, 0)
+// Animations are decoded and scaled ahead of time by a worker thread, into a
+// small ring of frames that is presented in sync with the frame clock. The
+// ring is shared with the worker, hence reference counted. Pausing keeps the
+// ring, since the backend is ahead of the presented frame by the queued ones.
+#define ANIMATION_RING_SIZE 4
+typedef struct {
+	gint ref_count;
+	GMutex lock;
+	GCond cond;
+
+	// Weak reference, released by animation_playback_stop() once the worker
+	// has finished
+	BOSNode *node;
+
+	struct {
+		cairo_surface_t *surface;
+		double delay;
+	} frames[ANIMATION_RING_SIZE];
+	int head;
+	int count;
+
+	cairo_surface_t *presented;
+	double presented_delay;
+	gint64 next_frame_time;
+
+	// Negative until the first tick, such that the worker does not render
+	// at a scale level that is about to change
+	double scale_level;
+	double initial_delay;
+	gboolean stop;
+	gboolean finished;
+} animation_ring_t;
+animation_ring_t *current_animation_ring = NULL;
+guint current_animation_ring_tick_id = 0;
+#endif
 
 // -1 means no slideshow, 0 means active slideshow but no current timeout
 // source set, anything bigger than that actually is a slideshow id.
@@ -313,6 +400,7 @@ gboolean option_fading = FALSE;
 gboolean option_lazy_load = FALSE;
 gboolean option_allow_empty_window = FALSE;
 gboolean option_lowmem = FALSE;
+gint option_decoder_processes = 0;
 gboolean option_addl_from_stdin = FALSE;
 gboolean option_recreate_window = FALSE;
 gboolean option_enforce_window_aspect_ratio = FALSE;
@@ -447,6 +535,7 @@ GOptionEntry options[] = {
 	{ "box-colors", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer)&option_box_colors_callback, "Set box colors", "TEXT:BACKGROUND" },
 #endif
 	{ "browse", 0, 0, G_OPTION_ARG_NONE, &option_browse, "For each command line argument, additionally load all images from the image's directory", NULL },
+	{ "decoder-processes", 0, 0, G_OPTION_ARG_INT, &option_decoder_processes, "Load and render PostScript documents in COUNT separate processes", "COUNT" },
 	{ "disable-backends", 0, 0, G_OPTION_ARG_STRING, &option_disable_backends, "Disable the given backends", "BACKENDS" },
 	{ "disable-scaling", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, &option_scale_level_callback, "Disable scaling of images", NULL },
 	{ "end-of-files-action", 0, 0, G_OPTION_ARG_CALLBACK, &option_end_of_files_action_callback, "Action to take after all images have been viewed. (`quit', `wait', `wrap', `wrap-no-reshuffle')", "ACTION" },
@@ -735,6 +824,8 @@ const struct pqiv_action_descriptor {
 	{ "toggle_negate_mode", PARAMETER_INT },
 	{ "toggle_mark", PARAMETER_NONE },
 	{ "clear_marks", PARAMETER_NONE },
+	{ "animation_seek_relative", PARAMETER_DOUBLE },
+	{ "animation_seek_percentage", PARAMETER_DOUBLE },
 	{ NULL, 0 }
 };
 /* }}} */
@@ -766,10 +857,17 @@ void queue_draw();
 gboolean main_window_center();
 void window_screen_changed_callback(GtkWidget *widget, GdkScreen *previous_screen, gpointer user_data);
 typedef int image_loader_purpose_t;
+// Besides DEFAULT and MONTAGE, the loader can be asked to prerender a loaded image
+#define IMAGE_LOADER_PURPOSE_PRERENDER (MONTAGE + 1)
+// Number of upcoming files to read ahead of time when navigating
+#define READAHEAD_FILES 4
 gboolean test_and_invalidate_thumbnail(file_t *file);
 gboolean image_loader_load_single(BOSNode *node, gboolean called_from_main);
 gboolean fading_timeout_callback(gpointer user_data);
 void queue_image_load(BOSNode *);
+void queue_prerender_for_current_image(double scale_level);
+void animation_playback_stop();
+void animation_playback_pause();
 #ifndef CONFIGURED_WITHOUT_MONTAGE_MODE
 void queue_thumbnail_load(BOSNode *);
 #endif
@@ -785,7 +883,12 @@ double calculate_scale_level_to_fit(int image_width, int image_height, int windo
 gboolean main_window_calculate_ideal_size(int *new_window_width, int *new_window_height);
 void calculate_current_image_transformed_size(int *image_width, int *image_height);
 double calculate_auto_scale_level_for_screen(int image_width, int image_height);
+double calculate_auto_scale_level_for_window_state(int image_width, int image_height, gboolean fullscreen);
+void calculate_scaled_image_surface_size(file_t *file, double scale_level, int *width, int *height);
+void calculate_device_aligned_window_size(int *window_width, int *window_height);
 cairo_surface_t *get_scaled_image_surface_for_current_image();
+gboolean image_prerendered_view_has_size(cairo_surface_t *view, int width, int height);
+cairo_surface_t *image_rescale_surface(cairo_surface_t *source, int width, int height);
 gboolean window_state_into_fullscreen_actions(gpointer user_data);
 gboolean window_state_out_of_fullscreen_actions(gpointer user_data);
 gboolean window_draw_callback(GtkWidget *widget, cairo_t *cr_arg, gpointer user_data);
@@ -1410,7 +1513,110 @@ void load_images_directory_watch_callback(GFileMonitor *monitor, GFile *file, GF
 		g_free(name);
 	}
 }/*}}}*/
-BOSNode *load_images_handle_parameter_add_file(load_images_state_t state, file_t *file) {/*{{{*/
+typedef struct {
+	BOSNode *node;
+	file_t *file;
+	load_images_expand_fn_t expand_fn;
+	gpointer user_data;
+	GDestroyNotify user_data_free;
+} load_images_expansion_t;
+GThreadPool *load_images_expansion_pool = NULL;
+void load_images_expansion_free(load_images_expansion_t *expansion) {/*{{{*/
+	if(expansion->user_data_free) {
+		expansion->user_data_free(expansion->user_data);
+	}
+	file_free(expansion->file);
+	g_slice_free(load_images_expansion_t, expansion);
+}/*}}}*/
+gboolean load_images_document_expanded_callback(gpointer user_data) {/*{{{*/
+	// Page numbers and counts have changed
+	if(!main_window_visible) {
+		return FALSE;
+	}
+	update_info_text(NULL);
+	info_text_queue_redraw();
+	#ifndef CONFIGURED_WITHOUT_MONTAGE_MODE
+	if(application_mode == MONTAGE) {
+		D_LOCK(file_tree);
+		montage_window_move_cursor(0, 0,  0);
+		D_UNLOCK(file_tree);
+		gtk_widget_queue_draw(GTK_WIDGET(main_window));
+	}
+	#endif
+	return FALSE;
+}/*}}}*/
+void image_tree_renumber_keys(double spacing) {/*{{{*/
+	// Without sorting, keys are picked between those of neighbouring nodes.
+	// Once they get too close for the precision of doubles, number all nodes
+	// anew, spacing the keys evenly. This keeps the order of the nodes, so the
+	// tree stays valid. Must be called with the file_tree lock held.
+	double key = 0;
+	for(BOSNode *node = bostree_select(file_tree, 0); node; node = bostree_next_node(node)) {
+		*(double *)node->key = key;
+		key += spacing;
+	}
+}/*}}}*/
+void load_images_expansion_thread(gpointer data, gpointer user_data) {/*{{{*/
+	// Worker for load_images_handle_parameter_add_document(): Open the document
+	// and insert its pages directly after the placeholder
+	load_images_expansion_t *expansion = data;
+
+	GList *files = NULL;
+	if(file_tree_valid) {
+		files = expansion->expand_fn(expansion->file, expansion->user_data);
+	}
+
+	D_LOCK(file_tree);
+	BOSNode *node = NULL;
+	if(file_tree_valid) {
+		node = bostree_node_weak_unref(file_tree, expansion->node);
+	}
+	if(node && files) {
+		// Without sorting, the new pages get keys evenly spaced between the
+		// placeholder and its successor
+		BOSNode *previous_node = node;
+		BOSNode *next_node = bostree_next_node(node);
+		guint n_files = g_list_length(files);
+		guint n = 0;
+		for(GList *iter = files; iter; iter = g_list_next(iter), n++) {
+			file_t *file = iter->data;
+			if(bostree_node_count(file_tree) >= INT_MAX) {
+				file_free(file);
+				continue;
+			}
+			if(!option_sort) {
+				double *index = g_slice_new0(double);
+				if(next_node) {
+					*index = *(double *)previous_node->key + (*(double *)next_node->key - *(double *)previous_node->key) / (n_files - n + 1);
+					if(!(*index > *(double *)previous_node->key && *index < *(double *)next_node->key)) {
+						// Leave room for all pages between any two nodes
+						image_tree_renumber_keys(n_files + 1);
+						*index = *(double *)previous_node->key + (*(double *)next_node->key - *(double *)previous_node->key) / (n_files - n + 1);
+					}
+				}
+				else {
+					*index = *(double *)previous_node->key + 1;
+				}
+				previous_node = bostree_insert(file_tree, (void *)index, file);
+			}
+			else {
+				bostree_insert(file_tree, file->sort_name, file);
+			}
+		}
+	}
+	else {
+		g_list_free_full(files, (GDestroyNotify)file_free);
+		files = NULL;
+	}
+	D_UNLOCK(file_tree);
+
+	if(files) {
+		g_list_free(files);
+		gdk_threads_add_idle(load_images_document_expanded_callback, NULL);
+	}
+	load_images_expansion_free(expansion);
+}/*}}}*/
+BOSNode *load_images_handle_parameter_add_file_with_expansion(load_images_state_t state, file_t *file, load_images_expansion_t *expansion) {/*{{{*/
 	// Add image to images list/tree
 	// We need to check if the previous/next images have changed, because they
 	// might have been preloaded and need unloading if so.
@@ -1421,6 +1627,9 @@ BOSNode *load_images_handle_parameter_add_file(load_images_state_t state, file_t
 	if(!file_tree_valid) {
 		file_free(file);
 		D_UNLOCK(file_tree);
+		if(expansion) {
+			load_images_expansion_free(expansion);
+		}
 		return NULL;
 	}
 
@@ -1430,25 +1639,36 @@ BOSNode *load_images_handle_parameter_add_file(load_images_state_t state, file_t
 		g_printerr("Cannot add image %s: Maximum number of images reached.\n", file->display_name);
 		file_free(file);
 		D_UNLOCK(file_tree);
+		if(expansion) {
+			load_images_expansion_free(expansion);
+		}
 		return NULL;
 	}
 
 	BOSNode *new_node = NULL;
 	if(!option_sort) {
-		float *index = g_slice_new0(float);
+		double *index = g_slice_new0(double);
 		if(state == FILTER_OUTPUT) {
 			// As index, use
 			//  min(index(current) + .001, .5 index(current) + .5 index(next))
-			*index = 1.001f * *(float *)current_file_node->key;
-
 			BOSNode *next_node = bostree_next_node(current_file_node);
-			if(next_node) {
-				float alternative = .5f * (*(float *)current_file_node->key + *(float *)next_node->key);
-				*index = fminf(*index, alternative);
+			for(int attempt = 0; attempt < 2; attempt++) {
+				*index = *(double *)current_file_node->key + .001;
+				if(next_node) {
+					double alternative = .5 * (*(double *)current_file_node->key + *(double *)next_node->key);
+					*index = fmin(*index, alternative);
+				}
+				if(*index > *(double *)current_file_node->key && (!next_node || *index < *(double *)next_node->key)) {
+					break;
+				}
+				image_tree_renumber_keys(1);
 			}
 		}
 		else {
-			*index = (float)bostree_node_count(file_tree);
+			// Append after the last node. Its key might be larger than the
+			// number of nodes, see image_tree_renumber_keys().
+			BOSNode *last_node = bostree_select(file_tree, bostree_node_count(file_tree) - 1);
+			*index = last_node ? *(double *)last_node->key + 1 : 0;
 		}
 		new_node = bostree_insert(file_tree, (void *)index, file);
 	}
@@ -1458,6 +1678,14 @@ BOSNode *load_images_handle_parameter_add_file(load_images_state_t state, file_t
 	if(state == BROWSE_ORIGINAL_PARAMETER && browse_startup_node == NULL) {
 		browse_startup_node = bostree_node_weak_ref(new_node);
 	}
+	if(expansion) {
+		// Documents are opened one at a time, in the order they were found
+		if(!load_images_expansion_pool) {
+			load_images_expansion_pool = g_thread_pool_new(load_images_expansion_thread, NULL, 1, FALSE, NULL);
+		}
+		expansion->node = bostree_node_weak_ref(new_node);
+		g_thread_pool_push(load_images_expansion_pool, expansion, NULL);
+	}
 	D_UNLOCK(file_tree);
 	if(option_lazy_load && !gui_initialized) {
 		// When the first image has been processed, we can show the window
@@ -1489,6 +1717,17 @@ BOSNode *load_images_handle_parameter_add_file(load_images_state_t state, file_t
 	}
 	return new_node;
 }/*}}}*/
+BOSNode *load_images_handle_parameter_add_file(load_images_state_t state, file_t *file) {/*{{{*/
+	return load_images_handle_parameter_add_file_with_expansion(state, file, NULL);
+}/*}}}*/
+BOSNode *load_images_handle_parameter_add_document(load_images_state_t state, file_t *file, file_t *document, load_images_expand_fn_t expand_fn, gpointer user_data, GDestroyNotify user_data_free) {/*{{{*/
+	load_images_expansion_t *expansion = g_slice_new0(load_images_expansion_t);
+	expansion->file = image_loader_duplicate_file(document, NULL, NULL, NULL);
+	expansion->expand_fn = expand_fn;
+	expansion->user_data = user_data;
+	expansion->user_data_free = user_data_free;
+	return load_images_handle_parameter_add_file_with_expansion(state, file, expansion);
+}/*}}}*/
 GBytes *g_input_stream_read_completely(GInputStream *input_stream, GCancellable *cancellable, GError **error_pointer) {/*{{{*/
 	size_t data_length = 0;
 	char *data = g_malloc(1<<23); // + 8 Mib
@@ -1881,7 +2120,7 @@ void load_images_handle_parameter(char *param, load_images_state_t state, gint d
 		}
 	}
 }/*}}}*/
-int image_tree_float_compare(const float *a, const float *b) {/*{{{*/
+int image_tree_double_compare(const double *a, const double *b) {/*{{{*/
 	return *a > *b;
 }/*}}}*/
 void file_free(file_t *file) {/*{{{*/
@@ -1917,7 +2156,7 @@ void file_tree_free_helper(BOSNode *node) {
 
 	file_free(FILE(node));
 	if(!option_sort) {
-		g_slice_free(float, node->key);
+		g_slice_free(double, node->key);
 	}
 }
 void load_images() {/*{{{*/
@@ -1926,7 +2165,7 @@ void load_images() {/*{{{*/
 
 	// Allocate memory for the file list (Used for unsorted and random order file lists)
 	file_tree = bostree_new(
-		option_sort ? (BOSTree_cmp_function)strnatcasecmp : (BOSTree_cmp_function)image_tree_float_compare,
+		option_sort ? (BOSTree_cmp_function)strnatcasecmp : (BOSTree_cmp_function)image_tree_double_compare,
 		file_tree_free_helper
 	);
 	file_tree_valid = TRUE;
@@ -2027,8 +2266,15 @@ gboolean image_animation_timeout_callback(gpointer user_data) {/*{{{*/
 	D_UNLOCK(file_tree);
 
 	if(delay >= 0 && current_image_animation_speed_scale > 0) {
+		// Schedule relative to when this frame was due rather than to now,
+		// such that the latencies of the timeouts do not add up
+		gint64 now = g_get_monotonic_time();
+		current_image_animation_due_time += delay * 1000.;
+		if(now - current_image_animation_due_time > ANIMATION_MAX_LAG) {
+			current_image_animation_due_time = now;
+		}
 		current_image_animation_timeout_id = gdk_threads_add_timeout(
-			delay,
+			MAX(0, current_image_animation_due_time - now) / 1000,
 			image_animation_timeout_callback,
 			user_data);
 	}
@@ -2041,6 +2287,408 @@ gboolean image_animation_timeout_callback(gpointer user_data) {/*{{{*/
 
 	return FALSE;
 }/*}}}*/
+#if GTK_CHECK_VERSION(3, 8, 0)
+void animation_ring_unref(animation_ring_t *ring) {/*{{{*/
+	if(!g_atomic_int_dec_and_test(&ring->ref_count)) {
+		return;
+	}
+	for(int i = 0; i < ring->count; i++) {
+		cairo_surface_destroy(ring->frames[(ring->head + i) % ANIMATION_RING_SIZE].surface);
+	}
+	if(ring->presented) {
+		cairo_surface_destroy(ring->presented);
+	}
+	g_mutex_clear(&ring->lock);
+	g_cond_clear(&ring->cond);
+	g_slice_free(animation_ring_t, ring);
+}/*}}}*/
+gboolean animation_ring_frame_is_late(animation_ring_t *ring, double delay) {/*{{{*/
+	// Whether the frame about to be queued would already be superseded by
+	// its successor once it is due, i.e., whether drawing it is pointless.
+	// Lags above ANIMATION_MAX_LAG restart the schedule instead.
+	double speed = current_image_animation_speed_scale;
+	if(speed <= 0) {
+		return FALSE;
+	}
+
+	gboolean is_late = FALSE;
+	g_mutex_lock(&ring->lock);
+	if(ring->presented && ring->next_frame_time > 0) {
+		double due_time = ring->next_frame_time;
+		for(int i = 0; i < ring->count; i++) {
+			due_time += MAX(0, ring->frames[(ring->head + i) % ANIMATION_RING_SIZE].delay) * 1000. / speed;
+		}
+		gint64 lag = g_get_monotonic_time() - (gint64)(due_time + delay * 1000. / speed);
+		is_late = lag > 0 && lag < ANIMATION_MAX_LAG;
+	}
+	g_mutex_unlock(&ring->lock);
+
+	return is_late;
+}/*}}}*/
+gpointer animation_ring_thread(gpointer user_data) {/*{{{*/
+	animation_ring_t *ring = (animation_ring_t *)user_data;
+
+	// The first frame is the one the animation was initialized to, all
+	// further ones are decoded here. A resumed ring already holds the
+	// backend's current frame.
+	g_mutex_lock(&ring->lock);
+	gboolean advance = ring->presented || ring->count > 0;
+	g_mutex_unlock(&ring->lock);
+	double delay = ring->initial_delay;
+
+	while(TRUE) {
+		g_mutex_lock(&ring->lock);
+		while(!ring->stop && (ring->count == ANIMATION_RING_SIZE || ring->scale_level <= 0)) {
+			g_cond_wait(&ring->cond, &ring->lock);
+		}
+		double scale_level = ring->scale_level;
+		gboolean stop = ring->stop;
+		g_mutex_unlock(&ring->lock);
+		if(stop) {
+			break;
+		}
+		D_LOCK(file_tree);
+		gboolean node_valid = bostree_node_weak_unref(file_tree, bostree_node_weak_ref(ring->node)) != NULL;
+		D_UNLOCK(file_tree);
+		if(!node_valid) {
+			break;
+		}
+
+		// Decoding and drawing must happen in one go, since the backends only
+		// hold the current frame
+		file_t *file = FILE(ring->node);
+		cairo_surface_t *frame = NULL;
+		g_mutex_lock(&file->lock);
+		g_mutex_lock(&ring->lock);
+		stop = ring->stop;
+		g_mutex_unlock(&ring->lock);
+		if(!stop && file->is_loaded && !file->force_reload) {
+			if(advance) {
+				delay = file->file_type->animation_next_frame_fn(file);
+
+				// Drop frames that could not be shown in time without drawing
+				// them. Their display time goes to the next frame. Stop once the
+				// backend does not advance, e.g. because its decoder is behind
+				// as well; asking it again would only spin.
+				for(int dropped = 0; dropped < ANIMATION_MAX_DROPPED_FRAMES && delay > FILE_TYPE_ANIMATION_RETRY_DELAY && animation_ring_frame_is_late(ring, delay); dropped++) {
+					double next_delay = file->file_type->animation_next_frame_fn(file);
+					if(next_delay < 0) {
+						delay = next_delay;
+						break;
+					}
+					delay += next_delay;
+					if(next_delay <= FILE_TYPE_ANIMATION_RETRY_DELAY) {
+						break;
+					}
+				}
+			}
+			advance = TRUE;
+
+			int width, height;
+			calculate_scaled_image_surface_size(file, scale_level, &width, &height);
+			frame = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+			if(cairo_surface_status(frame) == CAIRO_STATUS_SUCCESS) {
+				cairo_t *cr = cairo_create(frame);
+				cairo_scale(cr, scale_level, scale_level);
+				cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+				file->file_type->draw_fn(file, cr);
+				cairo_destroy(cr);
+			}
+			else {
+				cairo_surface_destroy(frame);
+				frame = NULL;
+			}
+		}
+		g_mutex_unlock(&file->lock);
+		if(!frame) {
+			break;
+		}
+
+		g_mutex_lock(&ring->lock);
+		ring->frames[(ring->head + ring->count) % ANIMATION_RING_SIZE].surface = frame;
+		ring->frames[(ring->head + ring->count) % ANIMATION_RING_SIZE].delay = delay;
+		ring->count++;
+		g_mutex_unlock(&ring->lock);
+
+		if(delay < 0) {
+			break;
+		}
+	}
+
+	g_mutex_lock(&ring->lock);
+	ring->finished = TRUE;
+	g_cond_broadcast(&ring->cond);
+	g_mutex_unlock(&ring->lock);
+
+	animation_ring_unref(ring);
+	return NULL;
+}/*}}}*/
+void animation_ring_stop(animation_ring_t *ring) {/*{{{*/
+	// Stops the worker and waits until it no longer uses the backend. Must be
+	// called without file_tree locked.
+	g_mutex_lock(&ring->lock);
+	ring->stop = TRUE;
+	g_cond_broadcast(&ring->cond);
+	while(!ring->finished) {
+		g_cond_wait(&ring->cond, &ring->lock);
+	}
+	g_mutex_unlock(&ring->lock);
+}/*}}}*/
+double animation_ring_present_next_frame(animation_ring_t *ring, gint64 now) {/*{{{*/
+	// Requires ring->lock. Moves the oldest decoded frame to ->presented,
+	// schedules its successor and returns the frame's delay.
+	if(ring->presented) {
+		cairo_surface_destroy(ring->presented);
+	}
+	ring->presented = ring->frames[ring->head].surface;
+	double delay = ring->frames[ring->head].delay;
+	ring->presented_delay = delay;
+	ring->head = (ring->head + 1) % ANIMATION_RING_SIZE;
+	ring->count--;
+	g_cond_signal(&ring->cond);
+
+	if(delay >= 0 && current_image_animation_speed_scale > 0) {
+		// Advance relative to the scheduled time, not to now, to keep the
+		// nominal rate regardless of when exactly the frame clock ticks
+		if(ring->next_frame_time == 0 || now - ring->next_frame_time > ANIMATION_MAX_LAG) {
+			ring->next_frame_time = now;
+		}
+		ring->next_frame_time += delay * 1000. / current_image_animation_speed_scale;
+	}
+	return delay;
+}/*}}}*/
+cairo_surface_t *animation_ring_get_presented_frame() {/*{{{*/
+	// Returns a reference to the animation frame that is currently visible,
+	// or NULL if playback is not handled by the ring. A paused ring without
+	// queued frames is in sync with the backend, which draws at full quality.
+	animation_ring_t *ring = current_animation_ring;
+	if(!ring || ring->node != current_file_node) {
+		return NULL;
+	}
+	g_mutex_lock(&ring->lock);
+	if(!ring->presented && ring->count > 0) {
+		animation_ring_present_next_frame(ring, g_get_monotonic_time());
+	}
+	cairo_surface_t *retval = NULL;
+	if(ring->presented && !(ring->stop && ring->count == 0)) {
+		retval = cairo_surface_reference(ring->presented);
+	}
+	g_mutex_unlock(&ring->lock);
+	return retval;
+}/*}}}*/
+double animation_ring_get_lead() {/*{{{*/
+	// Returns how many ms of the animation the backend is ahead of the
+	// presented frame, i.e. the durations of all but the last queued frame
+	animation_ring_t *ring = current_animation_ring;
+	if(!ring || ring->node != current_file_node) {
+		return 0;
+	}
+	double lead = 0;
+	g_mutex_lock(&ring->lock);
+	if(ring->count > 0) {
+		if(ring->presented) {
+			lead += MAX(0, ring->presented_delay);
+		}
+		for(int i = 0; i < ring->count - 1; i++) {
+			lead += MAX(0, ring->frames[(ring->head + i) % ANIMATION_RING_SIZE].delay);
+		}
+	}
+	g_mutex_unlock(&ring->lock);
+	return lead;
+}/*}}}*/
+int animation_ring_step(int steps) {/*{{{*/
+	// Presents up to steps frames from a paused ring and returns how many
+	// remain to be decoded by the backend
+	animation_ring_t *ring = current_animation_ring;
+	if(!ring || ring->node != current_file_node) {
+		return steps;
+	}
+	g_mutex_lock(&ring->lock);
+	for(; steps > 0 && ring->count > 0; steps--) {
+		animation_ring_present_next_frame(ring, g_get_monotonic_time());
+	}
+	g_mutex_unlock(&ring->lock);
+	return steps;
+}/*}}}*/
+gboolean animation_ring_tick_callback(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data) {/*{{{*/
+	animation_ring_t *ring = current_animation_ring;
+
+	D_LOCK(file_tree);
+	gboolean is_valid = ring && file_tree_valid && ring->node == current_file_node && CURRENT_FILE->is_loaded && !CURRENT_FILE->force_reload;
+	D_UNLOCK(file_tree);
+	if(!is_valid) {
+		current_animation_ring_tick_id = 0;
+		animation_playback_stop();
+		return FALSE;
+	}
+	if(current_image_animation_speed_scale <= 0) {
+		current_animation_ring_tick_id = 0;
+		animation_playback_pause();
+		return FALSE;
+	}
+
+	gint64 now = gdk_frame_clock_get_frame_time(frame_clock);
+	gboolean has_new_frame = FALSE;
+	gboolean is_done = FALSE;
+
+	g_mutex_lock(&ring->lock);
+	ring->scale_level = current_scale_level;
+	g_cond_signal(&ring->cond);
+	// If more than one frame is due, only the last one is shown
+	while(ring->count > 0 && (!ring->presented || now >= ring->next_frame_time)) {
+		has_new_frame = TRUE;
+		if(animation_ring_present_next_frame(ring, now) < 0) {
+			is_done = TRUE;
+			break;
+		}
+	}
+	if(ring->count == 0 && ring->finished) {
+		is_done = TRUE;
+	}
+	cairo_surface_t *frame = has_new_frame ? cairo_surface_reference(ring->presented) : NULL;
+	g_mutex_unlock(&ring->lock);
+
+	if(frame) {
+		invalidate_current_scaled_image_surface();
+		int width, height;
+		calculate_scaled_image_surface_size(CURRENT_FILE, current_scale_level, &width, &height);
+		if(image_prerendered_view_has_size(frame, width, height)) {
+			current_scaled_image_surface = frame;
+		}
+		else {
+			cairo_surface_destroy(frame);
+		}
+		gtk_widget_queue_draw(GTK_WIDGET(main_window));
+	}
+
+	if(is_done) {
+		current_animation_ring_tick_id = 0;
+		animation_playback_stop();
+		return FALSE;
+	}
+	return TRUE;
+}/*}}}*/
+#endif
+void animation_playback_start() {/*{{{*/
+	// Requires file_tree to be locked
+	g_mutex_lock(&CURRENT_FILE->lock);
+	double delay = CURRENT_FILE->file_type->animation_initialize_fn(CURRENT_FILE);
+	g_mutex_unlock(&CURRENT_FILE->lock);
+
+#if GTK_CHECK_VERSION(3, 8, 0)
+	// In low memory mode, frames are drawn on the fly, as before
+	if(!option_lowmem && CURRENT_FILE->file_type->animation_next_frame_fn != NULL && CURRENT_FILE->file_type->draw_fn != NULL) {
+		animation_ring_t *ring = g_slice_new0(animation_ring_t);
+		ring->ref_count = 2;
+		g_mutex_init(&ring->lock);
+		g_cond_init(&ring->cond);
+		ring->node = bostree_node_weak_ref(current_file_node);
+		ring->scale_level = -1;
+		ring->initial_delay = delay;
+		current_animation_ring = ring;
+		g_thread_unref(g_thread_new("animation-decoder", animation_ring_thread, ring));
+		current_animation_ring_tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(main_window), animation_ring_tick_callback, NULL, NULL);
+		return;
+	}
+#endif
+
+	current_image_animation_due_time = g_get_monotonic_time() + delay * 1000.;
+	current_image_animation_timeout_id = gdk_threads_add_timeout(
+		delay,
+		image_animation_timeout_callback,
+		(gpointer)current_file_node);
+}/*}}}*/
+void animation_playback_pause() {/*{{{*/
+	// Like animation_playback_stop(), but keeps the frames the ring holds,
+	// such that the presented one stays visible and stepping continues from
+	// there. Must be called without file_tree locked.
+	if(current_image_animation_timeout_id > 0) {
+		g_source_remove(current_image_animation_timeout_id);
+		current_image_animation_timeout_id = 0;
+	}
+	if(current_image_animation_seek_timeout_id > 0) {
+		g_source_remove(current_image_animation_seek_timeout_id);
+		current_image_animation_seek_timeout_id = 0;
+	}
+#if GTK_CHECK_VERSION(3, 8, 0)
+	if(current_animation_ring_tick_id > 0) {
+		gtk_widget_remove_tick_callback(GTK_WIDGET(main_window), current_animation_ring_tick_id);
+		current_animation_ring_tick_id = 0;
+	}
+	if(current_animation_ring) {
+		animation_ring_stop(current_animation_ring);
+	}
+#endif
+}/*}}}*/
+void animation_playback_stop() {/*{{{*/
+	// Must be called without file_tree locked, since the worker might be
+	// waiting for it
+	animation_playback_pause();
+#if GTK_CHECK_VERSION(3, 8, 0)
+	if(current_animation_ring) {
+		D_LOCK(file_tree);
+		bostree_node_weak_unref(file_tree, current_animation_ring->node);
+		D_UNLOCK(file_tree);
+		animation_ring_unref(current_animation_ring);
+		current_animation_ring = NULL;
+	}
+#endif
+}/*}}}*/
+gboolean animation_playback_resume() {/*{{{*/
+	// Restarts the worker of a paused ring for the current file. Discards
+	// other rings and returns FALSE if there is none to resume.
+#if GTK_CHECK_VERSION(3, 8, 0)
+	animation_ring_t *ring = current_animation_ring;
+	if(ring && ring->node == current_file_node && current_animation_ring_tick_id == 0) {
+		g_mutex_lock(&ring->lock);
+		ring->stop = FALSE;
+		ring->finished = FALSE;
+		ring->next_frame_time = 0;
+		g_mutex_unlock(&ring->lock);
+		g_atomic_int_inc(&ring->ref_count);
+		g_thread_unref(g_thread_new("animation-decoder", animation_ring_thread, ring));
+		current_animation_ring_tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(main_window), animation_ring_tick_callback, NULL, NULL);
+		return TRUE;
+	}
+#endif
+	animation_playback_stop();
+	return FALSE;
+}/*}}}*/
+gboolean animation_seek_timeout_callback(gpointer user_data) {/*{{{*/
+	// Polls the backend until the first frame after a seek is available,
+	// shows it, and continues playback from there if it was active before
+	D_LOCK(file_tree);
+	if(!file_tree_valid || (BOSNode *)user_data != current_file_node || FILE(current_file_node)->force_reload || !FILE(current_file_node)->is_loaded) {
+		D_UNLOCK(file_tree);
+		current_image_animation_seek_timeout_id = 0;
+		return FALSE;
+	}
+	g_mutex_lock(&CURRENT_FILE->lock);
+	double delay = CURRENT_FILE->file_type->animation_next_frame_fn(CURRENT_FILE);
+	g_mutex_unlock(&CURRENT_FILE->lock);
+	if(delay >= 0 && delay <= FILE_TYPE_ANIMATION_RETRY_DELAY) {
+		D_UNLOCK(file_tree);
+		return TRUE;
+	}
+
+	current_image_animation_seek_timeout_id = 0;
+	if(current_image_animation_seek_resume && delay >= 0 && current_image_animation_speed_scale > 0) {
+		animation_playback_start();
+	}
+	D_UNLOCK(file_tree);
+
+	invalidate_current_scaled_image_surface();
+	gtk_widget_queue_draw(GTK_WIDGET(main_window));
+	return FALSE;
+}/*}}}*/
+gboolean animation_playback_active() {/*{{{*/
+#if GTK_CHECK_VERSION(3, 8, 0)
+	if(current_animation_ring_tick_id > 0) {
+		return TRUE;
+	}
+#endif
+	return current_image_animation_timeout_id > 0;
+}/*}}}*/
 void image_file_updated_callback(GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data) {/*{{{*/
 	BOSNode *node = (BOSNode *)user_data;
 
@@ -2109,6 +2757,7 @@ gboolean main_window_resize_callback(gpointer user_data) {/*{{{*/
 	// Recalculate the required window size
 	int new_window_width = current_scale_level * image_width;
 	int new_window_height = current_scale_level * image_height;
+	calculate_device_aligned_window_size(&new_window_width, &new_window_height);
 
 	// Resize if this has not worked before, but accept a slight deviation (might be round-off error)
 	if(main_window_width >= 0 && abs(main_window_width - new_window_width) + abs(main_window_height - new_window_height) > 1) {
@@ -2135,6 +2784,7 @@ gboolean main_window_calculate_ideal_size(int *new_window_width, int *new_window
 
 		*new_window_width = current_scale_level * image_width + 0.5;
 		*new_window_height = current_scale_level * image_height + 0.5;
+		calculate_device_aligned_window_size(new_window_width, new_window_height);
 	}
 	#ifndef CONFIGURED_WITHOUT_MONTAGE_MODE
 	else if(application_mode == MONTAGE) {
@@ -2294,13 +2944,10 @@ gboolean image_loaded_handler(gconstpointer node) {/*{{{*/
 	// Note: This might mean as well that the *thumbnail* has been loaded,
 	// but not the image itself. So check ->is_loaded in any case!
 
-	D_LOCK(file_tree);
-
 	// Remove any old timeouts etc.
-	if(current_image_animation_timeout_id > 0) {
-		g_source_remove(current_image_animation_timeout_id);
-		current_image_animation_timeout_id = 0;
-	}
+	animation_playback_stop();
+
+	D_LOCK(file_tree);
 
 	// Only react if the loaded node is still current
 	if(node && node != current_file_node) {
@@ -2364,13 +3011,8 @@ gboolean image_loaded_handler(gconstpointer node) {/*{{{*/
 
 	// Initialize animation timer if the image is animated
 	if((CURRENT_FILE->file_flags & FILE_FLAGS_ANIMATION) != 0 && CURRENT_FILE->file_type->animation_initialize_fn != NULL) {
-		g_mutex_lock(&CURRENT_FILE->lock);
-		current_image_animation_timeout_id = gdk_threads_add_timeout(
-			CURRENT_FILE->file_type->animation_initialize_fn(CURRENT_FILE),
-			image_animation_timeout_callback,
-			(gpointer)current_file_node);
-		g_mutex_unlock(&CURRENT_FILE->lock);
 		current_image_animation_speed_scale = 1.0;
+		animation_playback_start();
 	}
 
 	// Update geometry hints, calculate initial window size and place window
@@ -2653,11 +3295,31 @@ void image_loader_create_thumbnail(file_t *file) {/*{{{*/
 	file->thumbnail = surf;
 }/*}}}*/
 #endif
+cairo_surface_t *image_render_scaled_view(file_t *file, double scale_level, int width, int height) {/*{{{*/
+	cairo_surface_t *view = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	if(cairo_surface_status(view) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(view);
+		return NULL;
+	}
+	cairo_t *cr = cairo_create(view);
+	cairo_scale(cr, scale_level, scale_level);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	if(file->file_type->draw_fn != NULL) {
+		g_mutex_lock(&file->lock);
+		file->file_type->draw_fn(file, cr);
+		g_mutex_unlock(&file->lock);
+	}
+	cairo_destroy(cr);
+	return view;
+}/*}}}*/
+gboolean image_prerendered_view_has_size(cairo_surface_t *view, int width, int height) {/*{{{*/
+	return view && cairo_image_surface_get_width(view) == width && cairo_image_surface_get_height(view) == height;
+}/*}}}*/
 void image_generate_prerendered_view(file_t *file, gboolean force, double scale_level) {/*{{{*/
 	if(option_lowmem) {
 		return;
 	}
-	if(file->file_flags && FILE_FLAGS_ANIMATION) {
+	if(file->file_flags & FILE_FLAGS_ANIMATION) {
 		return;
 	}
 	if(force && file->prerendered_view) {
@@ -2667,36 +3329,111 @@ void image_generate_prerendered_view(file_t *file, gboolean force, double scale_
 	if(scale_level < 0) {
 		scale_level = calculate_auto_scale_level_for_screen(file->width, file->height);
 	}
-	int width = scale_level * file->width + .5;
-	int height = scale_level * file->height + .5;
-
-	if(file->prerendered_view) {
-		int old_width = cairo_image_surface_get_width(file->prerendered_view);
-		int old_height = cairo_image_surface_get_height(file->prerendered_view);
+	int width, height;
+	calculate_scaled_image_surface_size(file, scale_level, &width, &height);
 
-		if(old_width != width || old_height != height) {
-			cairo_surface_destroy(file->prerendered_view);
-			file->prerendered_view = NULL;
-		}
+	if(file->prerendered_view && !image_prerendered_view_has_size(file->prerendered_view, width, height)) {
+		g_mutex_lock(&file->lock);
+		cairo_surface_destroy(file->prerendered_view);
+		file->prerendered_view = NULL;
+		g_mutex_unlock(&file->lock);
 	}
 
 	if(!file->prerendered_view) {
-		cairo_surface_t *prerendered_view = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-		if(cairo_surface_status(prerendered_view) == CAIRO_STATUS_SUCCESS) {
-			cairo_t *cr = cairo_create(prerendered_view);
-			cairo_scale(cr, scale_level, scale_level);
-			cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-			if(file->file_type->draw_fn != NULL) {
-				g_mutex_lock(&file->lock);
-				file->file_type->draw_fn(file, cr);
-				g_mutex_unlock(&file->lock);
+		cairo_surface_t *prerendered_view = image_render_scaled_view(file, scale_level, width, height);
+		g_mutex_lock(&file->lock);
+		file->prerendered_view = prerendered_view;
+		g_mutex_unlock(&file->lock);
+	}
+}/*}}}*/
+void image_generate_alternate_prerendered_view(file_t *file, double scale_level) {/*{{{*/
+	// Like image_generate_prerendered_view, but keeps the default render.
+	// This is what the loader uses to have the image ready at a second scale
+	// level, and to render new scale levels in the background.
+	if(option_lowmem) {
+		return;
+	}
+	if(file->file_flags & FILE_FLAGS_ANIMATION) {
+		return;
+	}
+	int width, height;
+	calculate_scaled_image_surface_size(file, scale_level, &width, &height);
+	if(image_prerendered_view_has_size(file->prerendered_view, width, height) || image_prerendered_view_has_size(file->prerendered_view_alternate, width, height)) {
+		return;
+	}
+
+	cairo_surface_t *prerendered_view = image_render_scaled_view(file, scale_level, width, height);
+	if(!prerendered_view) {
+		return;
+	}
+	g_mutex_lock(&file->lock);
+	if(file->prerendered_view_alternate) {
+		cairo_surface_destroy(file->prerendered_view_alternate);
+	}
+	file->prerendered_view_alternate = prerendered_view;
+	g_mutex_unlock(&file->lock);
+}/*}}}*/
+gboolean image_prerendered_handler(gconstpointer node) {/*{{{*/
+	// Called once the loader has finished (or skipped) a prerender request
+	if(node == prerender_request.node) {
+		prerender_request.done = TRUE;
+	}
+	if(node == current_file_node) {
+		gtk_widget_queue_draw(GTK_WIDGET(main_window));
+	}
+	return FALSE;
+}/*}}}*/
+#ifndef CONFIGURED_WITHOUT_MONTAGE_MODE
+void image_loader_readahead_thumbnail_candidates() {/*{{{*/
+	// Must be called by the image loader thread, with file_tree locked.
+	//
+	// Check the cache for the next few queued thumbnails. The files of those
+	// that miss will have to be decoded, so have the kernel fetch them in the
+	// background as a whole while the loader works on earlier items.
+	#if GLIB_CHECK_VERSION(2, 46, 0)
+		// Remembers which nodes have been checked before, to not query the
+		// cache for the same node each time the queue advances. The pointers
+		// are only compared, never dereferenced.
+		static BOSNode *checked_nodes[READAHEAD_FILES] = { NULL };
+
+		struct image_loader_queue_item *items[READAHEAD_FILES];
+		BOSNode *candidates[READAHEAD_FILES];
+		int n_items = 0, n_candidates = 0;
+
+		g_async_queue_lock(image_loader_queue);
+		while(n_items < READAHEAD_FILES && (items[n_items] = g_async_queue_try_pop_unlocked(image_loader_queue)) != NULL) {
+			if(items[n_items]->node_ref && items[n_items]->purpose == MONTAGE) {
+				candidates[n_candidates++] = bostree_node_weak_ref(items[n_items]->node_ref);
+			}
+			n_items++;
+		}
+		while(n_items > 0) {
+			g_async_queue_push_front_unlocked(image_loader_queue, items[--n_items]);
+		}
+		g_async_queue_unlock(image_loader_queue);
+
+		for(int i=0; i<n_candidates; i++) {
+			BOSNode *node = candidates[i];
+			gboolean checked = FALSE;
+			for(int j=0; j<READAHEAD_FILES; j++) {
+				checked |= checked_nodes[j] == node;
+			}
+			if(!checked && bostree_node_weak_unref(file_tree, bostree_node_weak_ref(node))) {
+				test_and_invalidate_thumbnail(FILE(node));
+				if(!FILE(node)->thumbnail && !FILE(node)->is_loaded) {
+					if(!(option_thumbnails.enabled || application_mode == MONTAGE) || option_thumbnails.persist == THUMBNAILS_PERSIST_OFF || load_thumbnail_from_cache(FILE(node), option_thumbnails.width, option_thumbnails.height, option_thumbnails.persist, option_thumbnails.special_thumbnail_directory) == FALSE) {
+						buffered_file_readahead(FILE(node));
+					}
+				}
 			}
-			cairo_destroy(cr);
-			file->prerendered_view = cairo_surface_reference(prerendered_view);
+			bostree_node_weak_unref(file_tree, node);
 		}
-		cairo_surface_destroy(prerendered_view);
-	}
+		for(int j=0; j<READAHEAD_FILES; j++) {
+			checked_nodes[j] = j < n_candidates ? candidates[j] : NULL;
+		}
+	#endif
 }/*}}}*/
+#endif
 gpointer image_loader_thread(gpointer user_data) {/*{{{*/
 	while(TRUE) {
 		// Handle new queued image load
@@ -2705,9 +3442,8 @@ gpointer image_loader_thread(gpointer user_data) {/*{{{*/
 		if(node == NULL) {
 			return NULL;
 		}
-		#ifndef CONFIGURED_WITHOUT_MONTAGE_MODE
 		image_loader_purpose_t purpose = it->purpose;
-		#endif
+		double prerender_scale_level = it->scale_level;
 		g_slice_free(struct image_loader_queue_item, it);
 
 		// The image might still be in the loader queue though it has already
@@ -2719,14 +3455,37 @@ gpointer image_loader_thread(gpointer user_data) {/*{{{*/
 			continue;
 		}
 
+		// Prerender requests never load an image; if it has been unloaded in
+		// the meantime, the main thread will notice.
+		if(purpose == IMAGE_LOADER_PURPOSE_PRERENDER) {
+			if(FILE(node)->is_loaded) {
+				image_generate_alternate_prerendered_view(FILE(node), prerender_scale_level);
+			}
+			gdk_threads_add_idle((GSourceFunc)image_prerendered_handler, node);
+
+			D_LOCK(file_tree);
+			bostree_node_weak_unref(file_tree, node);
+			D_UNLOCK(file_tree);
+			continue;
+		}
+
 		// Short-circuit: If we want to load this image for its thumbnail, check the cache first.
 		// We might not have to load it at all.
 		#ifndef CONFIGURED_WITHOUT_MONTAGE_MODE
 		if(purpose == MONTAGE) {
-			// Unload an old thumbnail if it does not have the correct size
 			D_LOCK(file_tree);
+			image_loader_readahead_thumbnail_candidates();
+
+			// Unload an old thumbnail if it does not have the correct size. The
+			// read ahead above might have loaded the thumbnail already.
 			test_and_invalidate_thumbnail(FILE(node));
-			if(!FILE(node)->thumbnail && (option_thumbnails.enabled || application_mode == MONTAGE) && option_thumbnails.persist != THUMBNAILS_PERSIST_OFF) {
+			if(FILE(node)->thumbnail) {
+				bostree_node_weak_unref(file_tree, node);
+				D_UNLOCK(file_tree);
+				gdk_threads_add_idle((GSourceFunc)image_loaded_handler, node);
+				continue;
+			}
+			if((option_thumbnails.enabled || application_mode == MONTAGE) && option_thumbnails.persist != THUMBNAILS_PERSIST_OFF) {
 				if(load_thumbnail_from_cache(FILE(node), option_thumbnails.width, option_thumbnails.height, option_thumbnails.persist, option_thumbnails.special_thumbnail_directory) == TRUE) {
 					// Loading the thumbnail succeeded. We may break here.
 					bostree_node_weak_unref(file_tree, node);
@@ -2737,6 +3496,14 @@ gpointer image_loader_thread(gpointer user_data) {/*{{{*/
 					continue;
 				}
 			}
+
+			#if !GLIB_CHECK_VERSION(2, 46, 0)
+				// The loader queue can not be inspected; read ahead the image
+				// that is about to be decoded at least
+				if(!FILE(node)->is_loaded) {
+					buffered_file_readahead(FILE(node));
+				}
+			#endif
 			D_UNLOCK(file_tree);
 		}
 		#endif
@@ -2827,6 +3594,22 @@ gpointer image_loader_thread(gpointer user_data) {/*{{{*/
 			image_generate_prerendered_view(FILE(node), FALSE, -1);
 
 			gdk_threads_add_idle((GSourceFunc)image_loaded_handler, node);
+
+			// For the current image, also prerender the view for the other
+			// window state, such that toggling fullscreen is instant. Use the
+			// same (rotated) size the window state change will scale for.
+			if(node == current_file_node && wm_supports_fullscreen) {
+				int image_width, image_height;
+				D_LOCK(file_tree);
+				gboolean is_current = node == current_file_node;
+				if(is_current) {
+					calculate_current_image_transformed_size(&image_width, &image_height);
+				}
+				D_UNLOCK(file_tree);
+				if(is_current) {
+					image_generate_alternate_prerendered_view(FILE(node), calculate_auto_scale_level_for_window_state(image_width, image_height, !main_window_in_fullscreen));
+				}
+			}
 		}
 
 		D_LOCK(file_tree);
@@ -2890,6 +3673,7 @@ void abort_pending_image_loads(BOSNode *new_pos) {/*{{{*/
 		bostree_node_weak_unref(file_tree, ref->node_ref);
 		g_slice_free(struct image_loader_queue_item, ref);
 	}
+	prerender_request.node = NULL;
 	if(image_loader_thread_currently_loading != NULL && image_loader_thread_currently_loading != new_pos) {
 		g_cancellable_cancel(image_loader_cancellable);
 	}
@@ -2898,6 +3682,28 @@ void queue_image_load(BOSNode *node) {/*{{{*/
 	struct image_loader_queue_item *it = g_slice_new(struct image_loader_queue_item);
 	it->node_ref = node; // Must be weak_ref'ed by caller. (Simplifies thread safety.)
 	it->purpose = DEFAULT;
+	it->scale_level = -1;
+	g_async_queue_push(image_loader_queue, it);
+}/*}}}*/
+void queue_prerender_for_current_image(double scale_level) {/*{{{*/
+	// Must be called with file_tree locked.
+	if(option_lowmem || !image_loader_thread_ref || !is_current_file_loaded()) {
+		return;
+	}
+	int width, height;
+	calculate_scaled_image_surface_size(CURRENT_FILE, scale_level, &width, &height);
+	if(prerender_request.node == current_file_node && prerender_request.width == width && prerender_request.height == height) {
+		return;
+	}
+	prerender_request.node = current_file_node;
+	prerender_request.width = width;
+	prerender_request.height = height;
+	prerender_request.done = FALSE;
+
+	struct image_loader_queue_item *it = g_slice_new(struct image_loader_queue_item);
+	it->node_ref = bostree_node_weak_ref(current_file_node);
+	it->purpose = IMAGE_LOADER_PURPOSE_PRERENDER;
+	it->scale_level = scale_level;
 	g_async_queue_push(image_loader_queue, it);
 }/*}}}*/
 #ifndef CONFIGURED_WITHOUT_MONTAGE_MODE
@@ -2905,6 +3711,7 @@ void queue_thumbnail_load(BOSNode *node) {/*{{{*/
 	struct image_loader_queue_item *it = g_slice_new(struct image_loader_queue_item);
 	it->node_ref = node; // Must be weak_ref'ed by caller.
 	it->purpose = MONTAGE;
+	it->scale_level = -1;
 	g_async_queue_push(image_loader_queue, it);
 }/*}}}*/
 #endif
@@ -2921,7 +3728,14 @@ void unload_image(BOSNode *node) {/*{{{*/
 		cairo_surface_destroy(file->prerendered_view);
 		file->prerendered_view = NULL;
 	}
+	if(file->prerendered_view_alternate) {
+		cairo_surface_destroy(file->prerendered_view_alternate);
+		file->prerendered_view_alternate = NULL;
+	}
 	file->is_loaded = FALSE;
+	if(file->force_reload) {
+		buffered_file_invalidate(file);
+	}
 	file->force_reload = FALSE;
 	if(file->file_monitor != NULL) {
 		g_file_monitor_cancel(file->file_monitor);
@@ -2976,6 +3790,24 @@ void preload_adjacent_images() {/*{{{*/
 		D_UNLOCK(file_tree);
 	}
 
+	// Files further ahead are not decoded, but have the kernel read them into
+	// the page cache, such that loading them does not wait for the disk
+	D_LOCK(file_tree);
+	for(ptrdiff_t movement = option_lowmem ? 1 : 2; movement <= READAHEAD_FILES; movement++) {
+		BOSNode *node = relative_image_pointer(movement);
+		if(!node || node == current_file_node) {
+			break;
+		}
+		buffered_file_readahead(FILE(node));
+	}
+	if(option_lowmem && current_file_node) {
+		BOSNode *node = previous_file();
+		if(node && node != current_file_node) {
+			buffered_file_readahead(FILE(node));
+		}
+	}
+	D_UNLOCK(file_tree);
+
 #ifndef CONFIGURED_WITHOUT_MONTAGE_MODE
 	if(option_thumbnails.enabled && option_thumbnails.auto_generate_for_adjacents > 0) {
 		D_LOCK(file_tree);
@@ -3890,6 +4722,23 @@ void setup_checkerboard_pattern() {/*{{{*/
     cairo_pattern_set_extend(background_checkerboard_pattern, CAIRO_EXTEND_REPEAT);
     cairo_pattern_set_filter(background_checkerboard_pattern, CAIRO_FILTER_NEAREST);
 }/*}}}*/
+cairo_surface_t *image_rescale_surface(cairo_surface_t *source, int width, int height) {/*{{{*/
+	// Quick bilinear rescale, for use as a stand-in until a proper render
+	// at the new size is available
+	cairo_surface_t *retval = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	if(cairo_surface_status(retval) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(retval);
+		return NULL;
+	}
+	cairo_t *cr = cairo_create(retval);
+	cairo_scale(cr, width * 1. / cairo_image_surface_get_width(source), height * 1. / cairo_image_surface_get_height(source));
+	cairo_set_source_surface(cr, source, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	return retval;
+}/*}}}*/
 cairo_surface_t *get_scaled_image_surface_for_current_image() {/*{{{*/
 	if(current_scaled_image_surface != NULL) {
 		return cairo_surface_reference(current_scaled_image_surface);
@@ -3897,37 +4746,85 @@ cairo_surface_t *get_scaled_image_surface_for_current_image() {/*{{{*/
 	if(!CURRENT_FILE->is_loaded) {
 		return NULL;
 	}
-	if(CURRENT_FILE->prerendered_view &&
-			fabs(current_scale_level * CURRENT_FILE->width + .5 - cairo_image_surface_get_width(CURRENT_FILE->prerendered_view)) < 2 &&
-			fabs(current_scale_level * CURRENT_FILE->height + .5 - cairo_image_surface_get_height(CURRENT_FILE->prerendered_view)) < 2) {
+	int width, height;
+	calculate_scaled_image_surface_size(CURRENT_FILE, current_scale_level, &width, &height);
+#if GTK_CHECK_VERSION(3, 8, 0)
+	// During animation playback, the backend is ahead of what is visible.
+	// Stick to the presented frame; the ring catches up with new scale levels
+	// within a few frames.
+	cairo_surface_t *animation_frame = animation_ring_get_presented_frame();
+	if(animation_frame) {
+		if(image_prerendered_view_has_size(animation_frame, width, height)) {
+			current_scaled_image_surface = cairo_surface_reference(animation_frame);
+			return animation_frame;
+		}
+		cairo_surface_t *retval = image_rescale_surface(animation_frame, width, height);
+		cairo_surface_destroy(animation_frame);
+		return retval;
+	}
+#endif
+	// The loader replaces the prerenders while holding the file's lock. Take
+	// references to those needed below, such that they stay valid.
+	g_mutex_lock(&CURRENT_FILE->lock);
+	if(!image_prerendered_view_has_size(CURRENT_FILE->prerendered_view, width, height) && image_prerendered_view_has_size(CURRENT_FILE->prerendered_view_alternate, width, height)) {
+		// The alternate render fits (e.g. after toggling fullscreen). Swap,
+		// such that the old one is available if the user toggles back.
+		cairo_surface_t *alternate = CURRENT_FILE->prerendered_view_alternate;
+		CURRENT_FILE->prerendered_view_alternate = CURRENT_FILE->prerendered_view;
+		CURRENT_FILE->prerendered_view = alternate;
+	}
+	cairo_surface_t *prerendered_view = NULL;
+	cairo_surface_t *stand_in_source = NULL;
+	if(image_prerendered_view_has_size(CURRENT_FILE->prerendered_view, width, height)) {
+		prerendered_view = cairo_surface_reference(CURRENT_FILE->prerendered_view);
+	}
+	else if(CURRENT_FILE->prerendered_view || CURRENT_FILE->prerendered_view_alternate) {
+		stand_in_source = cairo_surface_reference(CURRENT_FILE->prerendered_view ? CURRENT_FILE->prerendered_view : CURRENT_FILE->prerendered_view_alternate);
+	}
+	g_mutex_unlock(&CURRENT_FILE->lock);
+
+	if(prerendered_view) {
 		// If the file has a prerender at the correct size attached, we can reuse it here.
-		cairo_surface_t *retval = cairo_surface_reference(CURRENT_FILE->prerendered_view);
+		// Sizes are in device pixels and computed the same way for both, so a
+		// match means that the prerender is exactly what would be drawn below.
 		if(!option_lowmem) {
-			current_scaled_image_surface = cairo_surface_reference(retval);
+			current_scaled_image_surface = cairo_surface_reference(prerendered_view);
 		}
-		return retval;
+		return prerendered_view;
 	}
 	/*
 	else if(CURRENT_FILE->prerendered_view) {
 		printf("Info: Cache miss! %dx%d (cached) vs %dx%d (requested)\n", cairo_image_surface_get_width(CURRENT_FILE->prerendered_view), cairo_image_surface_get_height(CURRENT_FILE->prerendered_view),
-			(int)(current_scale_level * CURRENT_FILE->width + .5), (int)(current_scale_level * CURRENT_FILE->height + .5));
+			width, height);
 	}
 	else {
-		printf("Info: Cache miss! Nothing present %dx%d (requested)\n", (int)(current_scale_level * CURRENT_FILE->width + .5), (int)(current_scale_level * CURRENT_FILE->height + .5));
+		printf("Info: Cache miss! Nothing present %dx%d (requested)\n", width, height);
 	}
 	*/
 
-	cairo_surface_t *retval = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, current_scale_level * CURRENT_FILE->width + .5, current_scale_level * CURRENT_FILE->height + .5);
-	if(cairo_surface_status(retval) != CAIRO_STATUS_SUCCESS) {
-		cairo_surface_destroy(retval);
-		return NULL;
+	// If there is a prerender at a different size, do not block the UI on
+	// rendering the image again: Have the loader do that, and display a
+	// quickly rescaled version of the prerender until it's done.
+	if(stand_in_source) {
+		cairo_surface_t *retval = NULL;
+		if(!option_lowmem && image_loader_thread_ref) {
+			if(window_resize_settle_timeout_id == 0) {
+				queue_prerender_for_current_image(current_scale_level);
+			}
+			if(window_resize_settle_timeout_id != 0 || !prerender_request.done) {
+				retval = image_rescale_surface(stand_in_source, width, height);
+			}
+		}
+		cairo_surface_destroy(stand_in_source);
+		if(retval) {
+			return retval;
+		}
 	}
 
-	cairo_t *cr = cairo_create(retval);
-	cairo_scale(cr, current_scale_level, current_scale_level);
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	draw_current_image_to_context(cr);
-	cairo_destroy(cr);
+	cairo_surface_t *retval = image_render_scaled_view(CURRENT_FILE, current_scale_level, width, height);
+	if(!retval) {
+		return NULL;
+	}
 
 	if(!option_lowmem) {
 		current_scaled_image_surface = cairo_surface_reference(retval);
@@ -4168,9 +5065,13 @@ void window_fullscreen() {/*{{{*/
 	if(main_window_in_fullscreen) return;
 
 	if(is_current_file_loaded()) {
-		main_window_in_fullscreen = TRUE;
-		image_generate_prerendered_view(CURRENT_FILE, FALSE, -1);
-		main_window_in_fullscreen = FALSE;
+		// The loader usually has the fullscreen render ready already. If not,
+		// have it render one now instead of blocking here.
+		int image_width, image_height;
+		D_LOCK(file_tree);
+		calculate_current_image_transformed_size(&image_width, &image_height);
+		queue_prerender_for_current_image(calculate_auto_scale_level_for_window_state(image_width, image_height, TRUE));
+		D_UNLOCK(file_tree);
 	}
 
 	// Bugfix for Awesome WM: If hints are active, windows are fullscreen'ed honoring the aspect ratio
@@ -4209,9 +5110,11 @@ void window_unfullscreen() {/*{{{*/
 	if(!main_window_in_fullscreen) return;
 
 	if(is_current_file_loaded()) {
-		main_window_in_fullscreen = FALSE;
-		image_generate_prerendered_view(CURRENT_FILE, FALSE, -1);
-		main_window_in_fullscreen = TRUE;
+		int image_width, image_height;
+		D_LOCK(file_tree);
+		calculate_current_image_transformed_size(&image_width, &image_height);
+		queue_prerender_for_current_image(calculate_auto_scale_level_for_window_state(image_width, image_height, FALSE));
+		D_UNLOCK(file_tree);
 	}
 
 	// Required to avoid tearing
@@ -4653,6 +5556,60 @@ struct window_draw_thumbnail_montage_show_binding_overlays_data {
 	int current_y;
 	char *active_prefix;
 };
+void montage_binding_overlay_free(gpointer data) {/*{{{*/
+	montage_binding_overlay_t *overlay = data;
+	cairo_surface_destroy(overlay->surface);
+	g_slice_free(montage_binding_overlay_t, overlay);
+}/*}}}*/
+montage_binding_overlay_t *window_draw_thumbnail_montage_get_binding_overlay(cairo_t *cr_arg, const char *label) {/*{{{*/
+	// Labels only ever depend on their text and the scale factor of the
+	// target, so render each only once
+	if(montage_binding_overlay_cache == NULL) {
+		montage_binding_overlay_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, montage_binding_overlay_free);
+	}
+	gchar *cache_key = g_strdup_printf("%d:%s", screen_scale_factor, label);
+	montage_binding_overlay_t *overlay = g_hash_table_lookup(montage_binding_overlay_cache, cache_key);
+	if(overlay) {
+		g_free(cache_key);
+		return overlay;
+	}
+
+	double x1, y1, x2, y2;
+	cairo_save(cr_arg);
+	cairo_set_font_size(cr_arg, 12);
+	cairo_text_path(cr_arg, label);
+	cairo_path_extents(cr_arg, &x1, &y1, &x2, &y2);
+	cairo_new_path(cr_arg);
+	cairo_restore(cr_arg);
+
+	// Similar surfaces inherit the device scale, so labels stay sharp on HiDPI screens
+	cairo_surface_t *surface = cairo_surface_create_similar(cairo_get_target(cr_arg), CAIRO_CONTENT_COLOR_ALPHA, ceil(x2 - x1 + 10), ceil(y2 - y1 + 8));
+	if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		g_free(cache_key);
+		return NULL;
+	}
+
+	overlay = g_slice_new(montage_binding_overlay_t);
+	overlay->surface = surface;
+	overlay->x = -5;
+	overlay->y = -(y2 - y1) - 2;
+
+	cairo_t *cr = cairo_create(surface);
+	cairo_translate(cr, -overlay->x, -overlay->y);
+	cairo_rectangle(cr, -5, -(y2 - y1) - 2, x2 - x1 + 10, y2 - y1 + 8);
+	cairo_set_source_rgb(cr, option_box_colors.bg_red, option_box_colors.bg_green, option_box_colors.bg_blue);
+	cairo_fill(cr);
+
+	cairo_set_font_size(cr, 12);
+	cairo_text_path(cr, label);
+	cairo_set_source_rgb(cr, option_box_colors.fg_red, option_box_colors.fg_green, option_box_colors.fg_blue);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+
+	g_hash_table_insert(montage_binding_overlay_cache, cache_key, overlay);
+	return overlay;
+}/*}}}*/
 void window_draw_thumbnail_montage_show_binding_overlays_looper(gpointer key, gpointer value, gpointer user_data) {/*{{{*/
 	const int n_thumbs_x = main_window_width / (option_thumbnails.width + 10) / screen_scale_factor;
 	const int n_thumbs_y = main_window_height / (option_thumbnails.height + 10) / screen_scale_factor;
@@ -4772,22 +5729,11 @@ void window_draw_thumbnail_montage_show_binding_overlays_looper(gpointer key, gp
 			);
 		}
 
-		double x1, y1, x2, y2;
-		cairo_set_font_size(cr_arg, 12);
-		cairo_text_path(cr_arg, data.active_prefix);
-		cairo_path_extents(cr_arg, &x1, &y1, &x2, &y2);
-		cairo_path_t *text_path = cairo_copy_path(cr_arg);
-		cairo_new_path(cr_arg);
-		cairo_rectangle(cr_arg, -5, -(y2 - y1) - 2, x2 - x1 + 10, y2 - y1 + 8);
-		cairo_close_path(cr_arg);
-		cairo_set_source_rgb(cr_arg, option_box_colors.bg_red, option_box_colors.bg_green, option_box_colors.bg_blue);
-		cairo_fill(cr_arg);
-
-		cairo_new_path(cr_arg);
-		cairo_append_path(cr_arg, text_path);
-		cairo_set_source_rgb(cr_arg, option_box_colors.fg_red, option_box_colors.fg_green, option_box_colors.fg_blue);
-		cairo_fill(cr_arg);
-		cairo_path_destroy(text_path);
+		montage_binding_overlay_t *overlay = window_draw_thumbnail_montage_get_binding_overlay(cr_arg, data.active_prefix);
+		if(overlay) {
+			cairo_set_source_surface(cr_arg, overlay->surface, overlay->x, overlay->y);
+			cairo_paint(cr_arg);
+		}
 
 		cairo_restore(cr_arg);
 	}
@@ -5073,6 +6019,89 @@ gboolean window_show_background_pixmap_cb(gpointer user_data) {/*{{{*/
 
 	return FALSE;
 }/*}}}*/
+#ifndef CONFIGURED_WITHOUT_INFO_TEXT
+void window_draw_info_text_update_cache(cairo_t *cr_arg) {/*{{{*/
+	// Lay out the info text and render the box to info_text_cache. cr_arg
+	// must be translated to where the text is to be drawn.
+	if(info_text_cache.surface != NULL) {
+		cairo_surface_destroy(info_text_cache.surface);
+		info_text_cache.surface = NULL;
+	}
+	g_free(info_text_cache.text);
+	info_text_cache.text = g_strdup(current_info_text);
+	info_text_cache.text_width = info_text_cache.text_height = 0;
+
+	PangoFontDescription *pango_font_desc = pango_font_description_from_string(option_font);
+	PangoLayout *pango_layout = pango_cairo_create_layout(cr_arg);
+	pango_layout_set_text(pango_layout, current_info_text, -1);
+
+	// Attempt this multiple times: If it does not fit the window,
+	// retry with a smaller font size
+	gint font_size;
+	if(current_info_text_cached_font_size < 0) {
+		const gint desc_font_size = pango_font_description_get_size(pango_font_desc);
+		font_size = desc_font_size != 0 ? desc_font_size : 12;
+		font_size *= screen_scale_factor;
+		current_info_text_cached_font_size = 0;
+	}
+	else {
+		font_size = current_info_text_cached_font_size;
+	}
+	PangoRectangle pango_extents = { 0, 0, 0, 0 };
+	for(; font_size > 1; font_size--) {
+		pango_font_description_set_size(pango_font_desc, font_size * PANGO_SCALE);
+		pango_layout_set_font_description(pango_layout, pango_font_desc);
+		pango_layout_get_extents(pango_layout, NULL, &pango_extents);
+
+		if((pango_extents.x + pango_extents.width) / PANGO_SCALE > main_window_width - csd_width - 10 * screen_scale_factor && !main_window_in_fullscreen) {
+			continue;
+		}
+		current_info_text_cached_font_size = font_size;
+		break;
+	}
+	info_text_cache.font_size = current_info_text_cached_font_size;
+
+	if(font_size > 1) {
+		const int x1 = pango_extents.x / PANGO_SCALE;
+		const int y1 = pango_extents.y / PANGO_SCALE;
+		const int x2 = (pango_extents.x + pango_extents.width) / PANGO_SCALE;
+		const int y2 = (pango_extents.y + pango_extents.height) / PANGO_SCALE;
+
+		cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, (x2 - x1) + 10, (y2 - y1) + 4);
+		if(cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS) {
+			cairo_t *cr = cairo_create(surface);
+
+			// Render the way the text would render on the window
+			cairo_font_options_t *font_options = cairo_font_options_create();
+			cairo_surface_get_font_options(cairo_get_target(cr_arg), font_options);
+			cairo_set_font_options(cr, font_options);
+			cairo_font_options_destroy(font_options);
+
+			cairo_translate(cr, -(x1 - 5), -(y1 - 2));
+			cairo_set_source_rgb(cr, option_box_colors.bg_red, option_box_colors.bg_green, option_box_colors.bg_blue);
+			cairo_rectangle(cr, x1 - 5, y1 - 2, (x2 - x1) + 10, (y2 - y1) + 4);
+			cairo_fill(cr);
+
+			cairo_set_source_rgb(cr, option_box_colors.fg_red, option_box_colors.fg_green, option_box_colors.fg_blue);
+			pango_cairo_update_layout(cr, pango_layout);
+			pango_cairo_show_layout(cr, pango_layout);
+			cairo_destroy(cr);
+
+			info_text_cache.surface = surface;
+			info_text_cache.x = x1 - 5;
+			info_text_cache.y = y1 - 2;
+		}
+		else {
+			cairo_surface_destroy(surface);
+		}
+		info_text_cache.text_width = x2 - x1;
+		info_text_cache.text_height = y2 - y1;
+	}
+
+	g_object_unref(pango_layout);
+	pango_font_description_free(pango_font_desc);
+}/*}}}*/
+#endif
 gboolean window_draw_callback(GtkWidget *widget, cairo_t *cr_arg, gpointer user_data) {/*{{{*/
 	// Drawing can generally mean that we succeeded in performing some action.
 	// Resume the action queue
@@ -5317,75 +6346,30 @@ gboolean window_draw_callback(GtkWidget *widget, cairo_t *cr_arg, gpointer user_
 	// Draw info box (directly to the screen)
 #ifndef CONFIGURED_WITHOUT_INFO_TEXT
 	if(current_info_text != NULL) {
-		PangoFontDescription *pango_font_desc = pango_font_description_from_string(option_font);
-		double x1 = 0., x2 = 0., y1 = 0., y2 = 0.;
-
 		cairo_save(cr_arg);
-		// Attempt this multiple times: If it does not fit the window,
-		// retry with a smaller font size
-		gint font_size;
-		if(current_info_text_cached_font_size < 0) {
-			const gint desc_font_size = pango_font_description_get_size(pango_font_desc);
-			font_size = desc_font_size != 0 ? desc_font_size : 12;
-			font_size *= screen_scale_factor;
-			current_info_text_cached_font_size = 0;
+		if(main_window_in_fullscreen == FALSE) {
+			// Tiling WMs, at least i3, react weird on our window size changing.
+			// Drawing the info box on the image helps to avoid users noticing that.
+			cairo_translate(cr_arg, x < 0 ? 0 : x, y < 0 ? 0 : y);
 		}
-		else {
-			font_size = current_info_text_cached_font_size;
-		}
-		for(; font_size > 1; font_size--) {
-			PangoRectangle pango_extents;
-			PangoLayout *pango_layout;
-
-			if(main_window_in_fullscreen == FALSE) {
-				// Tiling WMs, at least i3, react weird on our window size changing.
-				// Drawing the info box on the image helps to avoid users noticing that.
-				cairo_translate(cr_arg, x < 0 ? 0 : x, y < 0 ? 0 : y);
-			}
+		cairo_translate(cr_arg, 10 * screen_scale_factor, 20 * screen_scale_factor);
 
-			cairo_translate(cr_arg, 10 * screen_scale_factor, 20 * screen_scale_factor);
-
-			pango_layout = pango_cairo_create_layout(cr_arg);
-			pango_font_description_set_size(pango_font_desc, font_size * PANGO_SCALE);
-			pango_layout_set_font_description(pango_layout, pango_font_desc);
-
-			pango_layout_set_text(pango_layout, current_info_text, -1);
-			pango_layout_get_extents(pango_layout, NULL, &pango_extents);
-			x1 = pango_extents.x / PANGO_SCALE;
-			y1 = pango_extents.y / PANGO_SCALE;
-			x2 = (pango_extents.x + pango_extents.width) / PANGO_SCALE;
-			y2 = (pango_extents.y + pango_extents.height) / PANGO_SCALE;
-
-			if(x2 > main_window_width - csd_width - 10 * screen_scale_factor && !main_window_in_fullscreen) {
-				cairo_restore(cr_arg);
-				cairo_save(cr_arg);
-				g_object_unref(pango_layout);
-				continue;
-			}
-			current_info_text_cached_font_size = font_size;
-
-			cairo_set_source_rgb(cr_arg, option_box_colors.bg_red, option_box_colors.bg_green, option_box_colors.bg_blue);
-			cairo_rectangle(cr_arg, x1 - 5, y1 - 2, (x2 - x1) + 10, (y2 - y1) + 4);
-			cairo_fill(cr_arg);
-
-			cairo_set_source_rgb(cr_arg, option_box_colors.fg_red, option_box_colors.fg_green, option_box_colors.fg_blue);
-			pango_cairo_show_layout(cr_arg, pango_layout);
-			cairo_fill(cr_arg);
-
-			g_object_unref(pango_layout);
-			break;
+		if(current_info_text_cached_font_size < 0 || info_text_cache.font_size != current_info_text_cached_font_size || g_strcmp0(info_text_cache.text, current_info_text) != 0) {
+			window_draw_info_text_update_cache(cr_arg);
+		}
+		if(info_text_cache.surface != NULL) {
+			cairo_set_source_surface(cr_arg, info_text_cache.surface, info_text_cache.x, info_text_cache.y);
+			cairo_paint(cr_arg);
 		}
-
-		pango_font_description_free(pango_font_desc);
 		cairo_restore(cr_arg);
 
 		// Store where the box was drawn to allow for partial updates of the screen
 		current_info_text_bounding_box.x = (main_window_in_fullscreen == TRUE ? 0 : (x < 0 ? 0 : x)) + 10 - 5;
-		current_info_text_bounding_box.y = (main_window_in_fullscreen == TRUE ? 0 : (y < 0 ? 0 : y)) + 20 -(y2 - y1) - 2;
+		current_info_text_bounding_box.y = (main_window_in_fullscreen == TRUE ? 0 : (y < 0 ? 0 : y)) + 20 - info_text_cache.text_height - 2;
 
 		 // Redraw some extra pixels to make sure a wider new box would be covered:
-		current_info_text_bounding_box.width = (x2 - x1) + 10 + 30;
-		current_info_text_bounding_box.height = (y2 - y1) + 4 + 4;
+		current_info_text_bounding_box.width = info_text_cache.text_width + 10 + 30;
+		current_info_text_bounding_box.height = info_text_cache.text_height + 4 + 4;
 	}
 #endif
 
@@ -5441,9 +6425,12 @@ double calculate_scale_level_to_fit(int image_width, int image_height, int windo
 	return scale_level;
 }/*}}}*/
 double calculate_auto_scale_level_for_screen(int image_width, int image_height) {/*{{{*/
+	return calculate_auto_scale_level_for_window_state(image_width, image_height, main_window_in_fullscreen);
+}/*}}}*/
+double calculate_auto_scale_level_for_window_state(int image_width, int image_height, gboolean fullscreen) {/*{{{*/
 	double scale_level = current_scale_level;
 
-	if(!main_window_in_fullscreen) {
+	if(!fullscreen) {
 		const int screen_width = screen_geometry.width;
 		const int screen_height = screen_geometry.height;
 
@@ -5467,6 +6454,25 @@ double calculate_auto_scale_level_for_screen(int image_width, int image_height)
 				// If the height exceeds screen size, scale down
 				scale_level = screen_height * option_scale_screen_fraction / image_height;
 			}
+
+			if(screen_scale_factor > 1 && (option_scale == AUTO_SCALEUP || option_scale == AUTO_SCALEDOWN)) {
+				// The window can only be resized in multiples of the scale
+				// factor. If the image does not fit the window we'll actually
+				// get, set_scale_level_to_fit() would change the scale level
+				// once the window is configured, and the prerendered view
+				// would be wasted. So pick a scale level here that is stable
+				// under that operation.
+				int window_width = scale_level * image_width + .5;
+				int window_height = scale_level * image_height + .5;
+				calculate_device_aligned_window_size(&window_width, &window_height);
+				if(fabs(calculate_scale_level_to_fit(image_width, image_height, window_width, window_height) - scale_level) > DBL_EPSILON) {
+					window_width = scale_level * image_width + .5;
+					window_height = scale_level * image_height + .5;
+					window_width = window_width > screen_scale_factor ? window_width - window_width % screen_scale_factor : screen_scale_factor;
+					window_height = window_height > screen_scale_factor ? window_height - window_height % screen_scale_factor : screen_scale_factor;
+					scale_level = fmin(window_width * 1. / image_width, window_height * 1. / image_height);
+				}
+			}
 		}
 	}
 	else {
@@ -5475,6 +6481,28 @@ double calculate_auto_scale_level_for_screen(int image_width, int image_height)
 
 	return scale_level;
 }/*}}}*/
+void calculate_scaled_image_surface_size(file_t *file, double scale_level, int *width, int *height) {/*{{{*/
+	// Size, in device pixels, of the scaled image surfaces. Prerendered
+	// views and the scaled image cache must agree on this for the former
+	// to be reusable by the latter.
+	*width = scale_level * file->width + .5;
+	*height = scale_level * file->height + .5;
+	if(*width < 1) {
+		*width = 1;
+	}
+	if(*height < 1) {
+		*height = 1;
+	}
+}/*}}}*/
+void calculate_device_aligned_window_size(int *window_width, int *window_height) {/*{{{*/
+	// GTK sizes windows in logical pixels, so with GDK_SCALE > 1 only multiples
+	// of the scale factor are possible. Round up, such that the image is never
+	// cropped.
+	if(screen_scale_factor > 1) {
+		*window_width = (*window_width + screen_scale_factor - 1) / screen_scale_factor * screen_scale_factor;
+		*window_height = (*window_height + screen_scale_factor - 1) / screen_scale_factor * screen_scale_factor;
+	}
+}/*}}}*/
 void set_scale_level_for_screen() {/*{{{*/
 	if(!current_file_node) {
 		return;
@@ -5688,8 +6716,9 @@ void action(pqiv_action_t action_id, pqiv_action_parameter_t parameter) {/*{{{*/
 				// Required to avoid tearing
 				requested_main_window_width = current_scale_level * image_width;
 				requested_main_window_height = current_scale_level * image_height;
+				calculate_device_aligned_window_size(&requested_main_window_width, &requested_main_window_height);
 				window_prerender_background_pixmap(requested_main_window_width, requested_main_window_height, current_scale_level, main_window_in_fullscreen);
-				gtk_window_resize(main_window, current_scale_level * image_width / screen_scale_factor, current_scale_level * image_height / screen_scale_factor);
+				gtk_window_resize(main_window, requested_main_window_width / screen_scale_factor, requested_main_window_height / screen_scale_factor);
 				if(!wm_supports_moveresize) {
 					queue_draw();
 				}
@@ -6171,20 +7200,34 @@ void action(pqiv_action_t action_id, pqiv_action_parameter_t parameter) {/*{{{*/
 			if(!(CURRENT_FILE->file_flags & FILE_FLAGS_ANIMATION)) {
 				break;
 			}
-			if(current_image_animation_timeout_id > 0) {
-				g_source_remove(current_image_animation_timeout_id);
-				current_image_animation_timeout_id = 0;
-			}
+			animation_playback_pause();
 			current_image_animation_speed_scale = 0;
-			D_LOCK(file_tree);
-			if(parameter.pint > 0 && CURRENT_FILE->file_type->animation_next_frame_fn != NULL) {
-				// Skip all but one frame here, the last frame progression
-				// happens in image_animation_timeout_callback
-				for(int i = 0; i < parameter.pint - 1; i++) {
-					CURRENT_FILE->file_type->animation_next_frame_fn(CURRENT_FILE);
+			{
+				int steps = MAX(parameter.pint, 1);
+#if GTK_CHECK_VERSION(3, 8, 0)
+				// Frames decoded ahead of time by the ring come first. Once they
+				// are used up, the backend is at the presented frame again.
+				steps = animation_ring_step(steps);
+				if(steps == 0) {
+					invalidate_current_scaled_image_surface();
+					gtk_widget_queue_draw(GTK_WIDGET(main_window));
+					update_info_text(NULL);
+					break;
 				}
+#endif
+				animation_playback_stop();
+				D_LOCK(file_tree);
+				if(CURRENT_FILE->file_type->animation_next_frame_fn != NULL) {
+					// Skip all but one frame here, the last frame progression
+					// happens in image_animation_timeout_callback
+					g_mutex_lock(&CURRENT_FILE->lock);
+					for(int i = 0; i < steps - 1; i++) {
+						CURRENT_FILE->file_type->animation_next_frame_fn(CURRENT_FILE);
+					}
+					g_mutex_unlock(&CURRENT_FILE->lock);
+				}
+				D_UNLOCK(file_tree);
 			}
-			D_UNLOCK(file_tree);
 			image_animation_timeout_callback(current_file_node);
 			update_info_text(NULL);
 			break;
@@ -6194,13 +7237,13 @@ void action(pqiv_action_t action_id, pqiv_action_parameter_t parameter) {/*{{{*/
 				break;
 			}
 			current_image_animation_speed_scale = 1.0;
-			if(current_image_animation_timeout_id == 0
+			if(!animation_playback_active()
 					&& (CURRENT_FILE->file_flags & FILE_FLAGS_ANIMATION) != 0
-					&& CURRENT_FILE->file_type->animation_initialize_fn != NULL) {
-				current_image_animation_timeout_id = gdk_threads_add_timeout(
-					CURRENT_FILE->file_type->animation_initialize_fn(CURRENT_FILE),
-					image_animation_timeout_callback,
-					(gpointer)current_file_node);
+					&& CURRENT_FILE->file_type->animation_initialize_fn != NULL
+					&& !animation_playback_resume()) {
+				D_LOCK(file_tree);
+				animation_playback_start();
+				D_UNLOCK(file_tree);
 			}
 			update_info_text(NULL);
 			break;
@@ -6231,6 +7274,55 @@ void action(pqiv_action_t action_id, pqiv_action_parameter_t parameter) {/*{{{*/
 			info_text_queue_redraw();
 			break;
 
+		case ACTION_ANIMATION_SEEK_RELATIVE:
+		case ACTION_ANIMATION_SEEK_PERCENTAGE:
+			if(!is_current_file_loaded() || !(CURRENT_FILE->file_flags & FILE_FLAGS_ANIMATION) || CURRENT_FILE->file_type->animation_seek_fn == NULL) {
+				break;
+			}
+			{
+				// Playback restarts from the new position once the backend has
+				// the first frame there, unless the animation was stopped. The
+				// backend might be ahead of the presented frame, which relative
+				// seeks refer to.
+				gboolean was_playing = animation_playback_active() || (current_image_animation_seek_timeout_id > 0 && current_image_animation_seek_resume);
+				double position = parameter.pdouble;
+#if GTK_CHECK_VERSION(3, 8, 0)
+				if(action_id == ACTION_ANIMATION_SEEK_RELATIVE) {
+					position -= animation_ring_get_lead() / 1000.;
+				}
+#endif
+				animation_playback_stop();
+
+				D_LOCK(file_tree);
+				g_mutex_lock(&CURRENT_FILE->lock);
+				double delay;
+				if(action_id == ACTION_ANIMATION_SEEK_RELATIVE) {
+					delay = CURRENT_FILE->file_type->animation_seek_fn(CURRENT_FILE, position, ANIMATION_SEEK_RELATIVE_SECONDS);
+				}
+				else {
+					delay = CURRENT_FILE->file_type->animation_seek_fn(CURRENT_FILE, position / 100., ANIMATION_SEEK_ABSOLUTE_FRACTION);
+				}
+				g_mutex_unlock(&CURRENT_FILE->lock);
+				if(delay > FILE_TYPE_ANIMATION_RETRY_DELAY) {
+					if(was_playing) {
+						animation_playback_start();
+					}
+					invalidate_current_scaled_image_surface();
+					gtk_widget_queue_draw(GTK_WIDGET(main_window));
+				}
+				else if(delay >= 0) {
+					// The seek finishes in the background. Wait for the new frame
+					// without blocking here; until then, the last one stays visible.
+					current_image_animation_seek_resume = was_playing;
+					current_image_animation_seek_timeout_id = gdk_threads_add_timeout(
+						delay,
+						animation_seek_timeout_callback,
+						(gpointer)current_file_node);
+				}
+				D_UNLOCK(file_tree);
+			}
+			break;
+
 		case ACTION_GOTO_EARLIER_FILE:
 			if(earlier_file_node != NULL) {
 				absolute_image_movement(bostree_node_weak_ref(earlier_file_node));
@@ -6297,10 +7389,7 @@ void action(pqiv_action_t action_id, pqiv_action_parameter_t parameter) {/*{{{*/
 				g_source_remove(slideshow_timeout_id);
 				slideshow_timeout_id = 0;
 			}
-			if(current_image_animation_timeout_id > 0) {
-				g_source_remove(current_image_animation_timeout_id);
-				current_image_animation_timeout_id = 0;
-			}
+			animation_playback_stop();
 			if(last_visible_surface) {
 				cairo_surface_destroy(last_visible_surface);
 				last_visible_surface = NULL;
@@ -6696,6 +7785,19 @@ void action(pqiv_action_t action_id, pqiv_action_parameter_t parameter) {/*{{{*/
 	// from. Issue the next action, if one's in the queue, to be run.
 	action_done();
 }/*}}}*/
+gboolean window_resize_settled_callback(gpointer user_data) {/*{{{*/
+	window_resize_settle_timeout_id = 0;
+
+	// Have the loader render the final size. Until it's done, the draw
+	// callback keeps displaying the rescaled prerender.
+	D_LOCK(file_tree);
+	if(is_current_file_loaded() && current_scaled_image_surface == NULL) {
+		queue_prerender_for_current_image(current_scale_level);
+	}
+	D_UNLOCK(file_tree);
+	gtk_widget_queue_draw(GTK_WIDGET(main_window));
+	return FALSE;
+}/*}}}*/
 gboolean window_configure_callback(GtkWidget *widget, GdkEventConfigure *event, gpointer user_data) {/*{{{*/
 	/*
 	 * struct GdkEventConfigure {
@@ -6768,6 +7870,13 @@ gboolean window_configure_callback(GtkWidget *widget, GdkEventConfigure *event,
 		if(main_window_width != event->width - csd_width || main_window_height != event->height - csd_height) {
 			set_scale_level_to_fit();
 		}
+
+		// Configure events come in bursts while the user resizes the window.
+		// Postpone rendering the image at its new size until they stop.
+		if(window_resize_settle_timeout_id > 0) {
+			g_source_remove(window_resize_settle_timeout_id);
+		}
+		window_resize_settle_timeout_id = gdk_threads_add_timeout(150, window_resize_settled_callback, NULL);
 		gdk_window_invalidate_rect(gtk_widget_get_window(GTK_WIDGET(main_window)), NULL, TRUE);
 		queue_draw();
 
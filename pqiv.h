@@ -104,6 +104,11 @@ struct _file {
 	// be present, not guaranteed to have the correct scale level.
 	cairo_surface_t *prerendered_view;
 
+	// Second render, for the scale level the image would have in the other
+	// window state (windowed/fullscreen), or one requested asynchronously.
+	// Same guarantees as prerendered_view; the two are swapped on use.
+	cairo_surface_t *prerendered_view_alternate;
+
 	// File-type specific data, allocated and freed by the file type handlers
 	void *private;
 
@@ -149,7 +154,21 @@ typedef double (*file_type_animation_initialize_fn_t)(file_t *file);
 
 // Animation support: Advance to the next frame, return ms until next frame
 // Optional, you can also set the pointer to this function to NULL.
+// If no new frame is available yet, e.g. because decoding fell behind, keep
+// the current one and return FILE_TYPE_ANIMATION_RETRY_DELAY.
 typedef double (*file_type_animation_next_frame_fn_t)(file_t *file);
+#define FILE_TYPE_ANIMATION_RETRY_DELAY 5
+
+// Animation support: Jump to a position, return ms until next frame, or a
+// negative value if seeking failed. The position is either in seconds relative
+// to the current frame, or a fraction of the animation's total duration.
+// To seek in the background instead, return FILE_TYPE_ANIMATION_RETRY_DELAY,
+// keep the current frame, and have animation_next_frame_fn return
+// FILE_TYPE_ANIMATION_RETRY_DELAY until the first frame at the new position
+// is available.
+// Optional, you can also set the pointer to this function to NULL.
+typedef enum { ANIMATION_SEEK_RELATIVE_SECONDS, ANIMATION_SEEK_ABSOLUTE_FRACTION } animation_seek_mode_t;
+typedef double (*file_type_animation_seek_fn_t)(file_t *file, double position, animation_seek_mode_t mode);
 
 // Draw the current view to a cairo context
 typedef void (*file_type_draw_fn_t)(file_t *file, cairo_t *cr);
@@ -169,6 +188,7 @@ struct file_type_handler_struct_t {
 	file_type_unload_fn_t unload_fn;
 	file_type_animation_initialize_fn_t animation_initialize_fn;
 	file_type_animation_next_frame_fn_t animation_next_frame_fn;
+	file_type_animation_seek_fn_t animation_seek_fn;
 	file_type_draw_fn_t draw_fn;
 };
 
@@ -183,6 +203,13 @@ extern GCancellable *image_loader_cancellable;
 // Current scale level. For backends that don't support cairo natively.
 extern gdouble current_scale_level;
 
+// Number of helper processes backends may decode in, or 0 to decode in-process
+// (--decoder-processes)
+extern gint option_decoder_processes;
+
+// Whether to keep as little decoded image data around as possible (--low-memory)
+extern gboolean option_lowmem;
+
 // Load a file from disc/memory/network
 GInputStream *image_loader_stream_file(file_t *file, GError **error_pointer);
 
@@ -197,6 +224,19 @@ file_t *image_loader_duplicate_file(file_t *file, gchar *custom_file_name, gchar
 // forwarded unaltered.
 BOSNode *load_images_handle_parameter_add_file(load_images_state_t state, file_t *file);
 
+// Expansion function for load_images_handle_parameter_add_document(): Open the
+// document and return newly allocated file_ts for all pages following the first
+// one, in order. Called from a background thread, with a copy of the document's
+// file_t without private data.
+typedef GList *(*load_images_expand_fn_t)(file_t *document, gpointer user_data);
+
+// Add a placeholder for a multi-page document, typically its first page, and
+// expand it into the remaining pages in the background. This keeps startup fast
+// if many documents are loaded, since only the placeholder is added at once.
+// The document file_t itself remains owned by the caller. user_data is passed to
+// expand_fn and released using user_data_free afterwards.
+BOSNode *load_images_handle_parameter_add_document(load_images_state_t state, file_t *file, file_t *document, load_images_expand_fn_t expand_fn, gpointer user_data, GDestroyNotify user_data_free);
+
 // Find a handler for a given file; useful for handler redirection, see archive
 // file type
 BOSNode *load_images_handle_parameter_find_handler(const char *param, load_images_state_t state, file_t *file, GtkFileFilterInfo *file_filter_info);
@@ -292,6 +332,8 @@ typedef enum {
 	ACTION_TOGGLE_NEGATE_MODE,
 	ACTION_TOGGLE_MARK,
 	ACTION_CLEAR_MARKS,
+	ACTION_ANIMATION_SEEK_RELATIVE,
+	ACTION_ANIMATION_SEEK_PERCENTAGE,
 } pqiv_action_t;
 
 typedef union {